@@ -473,7 +473,11 @@ void owl_cmd_add_defaults(owl_cmddict *cd)
               "normally.\n"
               "\n"
               "Unless --quiet is passed, a message is printed about\n"
-              "how many logs there are to flush."),
+              "how many logs there are to flush.\n"
+              "\n"
+              "Log files are kept open between messages; this command\n"
+              "also writes out anything not yet written and reopens\n"
+              "them, for instance after they have been moved aside."),
 
   OWLCMD_ARGS("load-subs", owl_command_loadsubs, OWL_CTX_ANY,
 	      "load subscriptions from a file",
@@ -632,6 +636,7 @@ void owl_cmd_add_defaults(owl_cmddict *cd)
 	      "show keymaps\n"
 	      "show keymap <keymap>\n"
 	      "show license\n"
+	      "show memory\n"
 	      "show quickstart\n"
 	      "show startup\n"
 	      "show status\n"
@@ -642,6 +647,7 @@ void owl_cmd_add_defaults(owl_cmddict *cd)
 	      "show variable <variable>\n"
 	      "show version\n"
 	      "show view [<view>]\n"
+	      "show zephyr\n"
 	      "show zpunts\n",
 
 	      "Show colors will display a list of valid colors for the\n"
@@ -659,6 +665,11 @@ void owl_cmd_add_defaults(owl_cmddict *cd)
 	      "for formatting messages.\n\n"
 	      "Show variables will list the names of all variables.\n\n"
 	      "Show errors will show a list of errors encountered by BarnOwl.\n\n"
+	      "Show memory will show how much memory is saved by sharing\n"
+	      "     repeated message fields, and how well the cache of\n"
+	      "     formatted messages is doing.\n\n"
+	      "Show zephyr will count the zephyrs, acks, dropped pings\n"
+	      "     and pseudologin replies received, in all and per second.\n\n"
 	      "SEE ALSO: filter, view, alias, bindkey, help\n"),
   
   OWLCMD_ARGS("delete", owl_command_delete, OWL_CTX_INTERACTIVE,
@@ -2115,6 +2126,10 @@ char *owl_command_show(int argc, const char *const *argv, const char *buff)
     owl_function_about();
   } else if (!strcmp(argv[1], "status")) {
     owl_function_status();
+  } else if (!strcmp(argv[1], "memory")) {
+    owl_function_show_memory();
+  } else if (!strcmp(argv[1], "zephyr")) {
+    owl_function_show_zephyr_stats();
   } else if (!strcmp(argv[1], "license")) {
     owl_function_show_license();
   } else if (!strcmp(argv[1], "quickstart")) {
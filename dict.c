@@ -1,18 +1,20 @@
 /* Dictionary data abstraction.  
  * Maps from strings to pointers.
- * Stores as a sorted list of key/value pairs.
- * O(n) on inserts and deletes.
- * O(log n) on searches
+ * Stores as an open-addressed hash table with linear probing.
+ * O(1) on inserts, deletes and searches.
+ * Keys come back sorted from owl_dict_get_keys.
  */
 
 #include "owl.h"
 
-#define INITSIZE 30
-#define GROWBY 3 / 2
+#define INITSIZE 32		/* must be a power of two */
+/* grow when more than this fraction of the slots is in use */
+#define MAXLOAD_NUM 3
+#define MAXLOAD_DEN 4
 
 void owl_dict_create(owl_dict *d) {
   d->size=0;
-  d->els=g_new(owl_dict_el, INITSIZE);
+  d->els=g_new0(owl_dict_el, INITSIZE);
   d->avail=INITSIZE;
 }
 
@@ -20,45 +22,64 @@ int owl_dict_get_size(const owl_dict *d) {
   return(d->size);
 }
 
-/* Finds the position of an element with key k, or of the element where
- * this element would logically go, and stores the index in pos.
+/* Finds the slot holding key k, whose hash is h, or the empty slot
+ * where it would go, and stores the index in pos.
  * Returns 1 if found, else 0. */
-int _owl_dict_find_pos(const owl_dict *d, const char *k, int *pos) {
-  int lo = 0, hi = d->size;
-  while (lo < hi) {
-    int mid = (lo + hi)/2; /* lo goes up and we can't hit hi, so no +1 */
-    int cmp = strcmp(k, d->els[mid].k);
-    if (cmp < 0) {
-      hi = mid;
-    } else if (cmp > 0) {
-      lo = mid+1;
-    } else {
-      *pos = mid;
+static int _owl_dict_find_pos(const owl_dict *d, const char *k, guint h, int *pos) {
+  int mask = d->avail - 1;
+  int i;
+
+  for (i = h & mask; d->els[i].k; i = (i + 1) & mask) {
+    if (d->els[i].hash == h && !strcmp(k, d->els[i].k)) {
+      *pos = i;
       return 1;
     }
   }
-  *pos = lo;
+  *pos = i;
   return 0;
 }
 
+/* Moves every element into a table of 'avail' slots */
+static void _owl_dict_resize(owl_dict *d, int avail) {
+  owl_dict_el *old = d->els;
+  int oldavail = d->avail;
+  int i, pos;
+
+  d->els = g_new0(owl_dict_el, avail);
+  d->avail = avail;
+  for (i = 0; i < oldavail; i++) {
+    if (!old[i].k) continue;
+    _owl_dict_find_pos(d, old[i].k, old[i].hash, &pos);
+    d->els[pos] = old[i];
+  }
+  g_free(old);
+}
+
 /* returns the value corresponding to key k */
 void *owl_dict_find_element(const owl_dict *d, const char *k) {
   int found, pos;
-  found = _owl_dict_find_pos(d, k, &pos);
+  found = _owl_dict_find_pos(d, k, g_str_hash(k), &pos);
   if (!found) {
     return(NULL);
   }
   return(d->els[pos].v);
 }
 
-/* Returns a GPtrArray of dictionary keys. Duplicates the keys, so
- * they will need to be freed by the caller with g_free. */
+static gint _owl_dict_key_compare(gconstpointer a, gconstpointer b) {
+  return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/* Returns a GPtrArray of dictionary keys, in sorted order. Duplicates
+ * the keys, so they will need to be freed by the caller with
+ * g_free. */
 CALLER_OWN GPtrArray *owl_dict_get_keys(const owl_dict *d) {
   GPtrArray *keys = g_ptr_array_sized_new(d->size);
   int i;
-  for (i = 0; i < d->size; i++) {
-    g_ptr_array_add(keys, g_strdup(d->els[i].k));
+  for (i = 0; i < d->avail; i++) {
+    if (d->els[i].k)
+      g_ptr_array_add(keys, g_strdup(d->els[i].k));
   }
+  g_ptr_array_sort(keys, _owl_dict_key_compare);
   return keys;
 }
 
@@ -75,8 +96,9 @@ void owl_dict_noop_delete(void *x)
 */
 int owl_dict_insert_element(owl_dict *d, const char *k, void *v, void (*delete_on_replace)(void *old))
 {
+  guint h = g_str_hash(k);
   int pos, found;
-  found = _owl_dict_find_pos(d, k, &pos);
+  found = _owl_dict_find_pos(d, k, h, &pos);
   if (found && delete_on_replace) {
     delete_on_replace(d->els[pos].v);
     d->els[pos].v = v;
@@ -84,20 +106,14 @@ int owl_dict_insert_element(owl_dict *d, const char *k, void *v, void (*delete_o
   } else if (found && !delete_on_replace) {
     return(-2);
   } else {
-    if (d->size + 1 > d->avail) {
-      int avail = MAX(d->avail * GROWBY, d->size + 1);
-      d->els = g_renew(owl_dict_el, d->els, avail);
-      d->avail = avail;
-      if (d->els==NULL) return(-1);
-    }
-    if (pos!=d->size) {
-      /* shift forward to leave us a slot */
-      memmove(d->els+pos+1, d->els+pos, 
-	      sizeof(owl_dict_el)*(d->size-pos));
+    if ((d->size + 1) * MAXLOAD_DEN > d->avail * MAXLOAD_NUM) {
+      _owl_dict_resize(d, d->avail * 2);
+      _owl_dict_find_pos(d, k, h, &pos);
     }
     d->size++;
     d->els[pos].k = g_strdup(k);
     d->els[pos].v = v;    
+    d->els[pos].hash = h;
     return(0);
   }
 }
@@ -106,16 +122,24 @@ int owl_dict_insert_element(owl_dict *d, const char *k, void *v, void (*delete_o
  * return it so the caller can free it. */
 CALLER_OWN void *owl_dict_remove_element(owl_dict *d, const char *k)
 {
-  int i;
-  int pos, found;
+  int mask = d->avail - 1;
+  int pos, found, i, home;
   void *v;
-  found = _owl_dict_find_pos(d, k, &pos);
+  found = _owl_dict_find_pos(d, k, g_str_hash(k), &pos);
   if (!found) return(NULL);
   g_free(d->els[pos].k);
   v = d->els[pos].v;
-  for (i=pos; i<d->size-1; i++) {
-    d->els[i]=d->els[i+1];
+  /* Close the gap: pull back each later element of the run which
+   * would no longer be found past it. */
+  for (i = (pos + 1) & mask; d->els[i].k; i = (i + 1) & mask) {
+    home = d->els[i].hash & mask;
+    if (((i - home) & mask) >= ((i - pos) & mask)) {
+      d->els[pos] = d->els[i];
+      pos = i;
+    }
   }
+  d->els[pos].k = NULL;
+  d->els[pos].v = NULL;
   d->size--;
   return(v);
 }
@@ -125,10 +149,10 @@ void owl_dict_cleanup(owl_dict *d, void (*elefree)(void *))
 {
   int i;
 
-  for (i=0; i<d->size; i++) {
+  for (i=0; i<d->avail; i++) {
+    if (!d->els[i].k) continue;
     g_free(d->els[i].k);
     if (elefree) (elefree)(d->els[i].v);
   }
   if (d->els) g_free(d->els);
 }
-
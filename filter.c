@@ -27,15 +27,17 @@ owl_filter *owl_filter_new_colored(const char *name, int argc, const char *const
   f->name=g_strdup(name);
   f->fgcolor = fgcolor;
   f->bgcolor = bgcolor;
+  f->program = g_array_new(false, false, sizeof(owl_filter_insn));
+  f->generation = -1;
 
   if (!(f->root = owl_filter_parse_expression(argc, argv, NULL))) {
     owl_filter_delete(f);
     return NULL;
   }
 
-  /* Now check for recursion. */
-  if (owl_filter_is_toodeep(f)) {
-    owl_function_error("Filter loop!");
+  /* Compiling inlines referenced filters, which also catches loops
+   * and filters that would expand too far. */
+  if (owl_filter_compile(f) != OWL_FILTER_COMPILE_OK) {
     owl_filter_delete(f);
     return NULL;
   }
@@ -154,6 +156,7 @@ SV *owl_filter_to_sv(const owl_filter *f)
 void owl_filter_set_fgcolor(owl_filter *f, int color)
 {
   f->fgcolor=color;
+  owl_global_invalidate_colors(&g);
 }
 
 int owl_filter_get_fgcolor(const owl_filter *f)
@@ -164,6 +167,7 @@ int owl_filter_get_fgcolor(const owl_filter *f)
 void owl_filter_set_bgcolor(owl_filter *f, int color)
 {
   f->bgcolor=color;
+  owl_global_invalidate_colors(&g);
 }
 
 int owl_filter_get_bgcolor(const owl_filter *f)
@@ -171,15 +175,292 @@ int owl_filter_get_bgcolor(const owl_filter *f)
   return(f->bgcolor);
 }
 
+static int owl_filter_emit(GArray *prog, int op, const owl_filterelement *fe)
+{
+  owl_filter_insn insn;
+
+  insn.op = op;
+  insn.target = -1;
+  insn.fe = fe;
+  insn.set = NULL;
+  g_array_append_val(prog, insn);
+  return prog->len - 1;
+}
+
+static void owl_filter_clear_program(GArray *prog)
+{
+  int i;
+
+  for (i = 0; i < prog->len; i++) {
+    if (g_array_index(prog, owl_filter_insn, i).set)
+      g_hash_table_destroy(g_array_index(prog, owl_filter_insn, i).set);
+  }
+  g_array_set_size(prog, 0);
+}
+
+/* An or of this many exact matches on one field, as buddy and
+ * narrowing filters build up, becomes a single hash lookup. */
+#define OWL_FILTER_SET_MIN 3
+
+static guint owl_filter_set_hash(gconstpointer key)
+{
+  const char *p;
+  guint h = 5381;
+
+  for (p = key; *p; p++)
+    h = h * 33 + g_ascii_tolower(*p);
+  return h;
+}
+
+static gboolean owl_filter_set_equal(gconstpointer a, gconstpointer b)
+{
+  return !g_ascii_strcasecmp(a, b);
+}
+
+/* Adds the leaves of the or-expression fe to 'leaves'.  Returns false
+ * if one of them is not an exact match on the same field as the
+ * others. */
+static bool owl_filter_collect_set(const owl_filterelement *fe, GPtrArray *leaves)
+{
+  const owl_filterelement *first;
+
+  switch (fe->type) {
+  case OWL_FILTERELEMENT_OR:
+    return owl_filter_collect_set(fe->left, leaves) &&
+      owl_filter_collect_set(fe->right, leaves);
+  case OWL_FILTERELEMENT_GROUP:
+    return owl_filter_collect_set(fe->left, leaves);
+  case OWL_FILTERELEMENT_RE:
+    if (!owl_regex_get_exact_text(&(fe->re)))
+      return false;
+    if (leaves->len) {
+      first = leaves->pdata[0];
+      if (first->fieldid != fe->fieldid || first->attr != fe->attr)
+        return false;
+    }
+    g_ptr_array_add(leaves, (gpointer)fe);
+    return true;
+  default:
+    return false;
+  }
+}
+
+/* Emits a set lookup for the or-expression fe if it is a long enough
+ * run of exact matches.  Returns false if it is not. */
+static bool owl_filter_compile_set(GArray *prog, const owl_filterelement *fe)
+{
+  GPtrArray *leaves = g_ptr_array_new();
+  const owl_filterelement *leaf;
+  GHashTable *set;
+  int i;
+
+  if (!owl_filter_collect_set(fe, leaves) || leaves->len < OWL_FILTER_SET_MIN) {
+    g_ptr_array_free(leaves, true);
+    return false;
+  }
+  set = g_hash_table_new(owl_filter_set_hash, owl_filter_set_equal);
+  for (i = 0; i < leaves->len; i++) {
+    leaf = leaves->pdata[i];
+    g_hash_table_add(set, (gpointer)owl_regex_get_exact_text(&(leaf->re)));
+  }
+  i = owl_filter_emit(prog, OWL_FILTER_OP_SET, leaves->pdata[0]);
+  g_array_index(prog, owl_filter_insn, i).set = set;
+  g_ptr_array_free(leaves, true);
+  return true;
+}
+
+static int owl_filter_set_contains(GHashTable *set, const char *value)
+{
+  char *folded;
+  const char *p;
+  int ret;
+
+  for (p = value; *p && !(*p & 0x80); p++)
+    ;
+  if (!*p || !g_utf8_validate(value, -1, NULL))
+    return g_hash_table_lookup_extended(set, value, NULL, NULL);
+  folded = g_utf8_casefold(value, -1);
+  ret = g_hash_table_lookup_extended(set, folded, NULL, NULL);
+  g_free(folded);
+  return ret;
+}
+
+/* Appends the code for fe to prog. 'stack' holds the names of the
+ * filters currently being inlined; referring to one of them again is
+ * a loop. Inlining also stops once the stack or the program grows past
+ * its limit, since references repeated at every level make the
+ * program grow exponentially. Any of these is reported through *error
+ * and leaves prog unfinished. */
+static void owl_filter_compile_element(GArray *prog, const owl_filterelement *fe, GPtrArray *stack, bool *refs, int *error)
+{
+  const owl_filter *sub;
+  int i, jump;
+
+  if (*error != OWL_FILTER_COMPILE_OK)
+    return;
+  if (prog->len > OWL_FILTER_MAX_PROGRAM) {
+    *error = OWL_FILTER_COMPILE_TOOLARGE;
+    return;
+  }
+
+  switch (fe->type) {
+  case OWL_FILTERELEMENT_TRUE:
+    owl_filter_emit(prog, OWL_FILTER_OP_TRUE, NULL);
+    break;
+  case OWL_FILTERELEMENT_FALSE:
+    owl_filter_emit(prog, OWL_FILTER_OP_FALSE, NULL);
+    break;
+  case OWL_FILTERELEMENT_RE:
+    owl_filter_emit(prog, OWL_FILTER_OP_RE, fe);
+    break;
+  case OWL_FILTERELEMENT_PERL:
+    owl_filter_emit(prog, OWL_FILTER_OP_PERL, fe);
+    break;
+  case OWL_FILTERELEMENT_GROUP:
+    owl_filter_compile_element(prog, fe->left, stack, refs, error);
+    break;
+  case OWL_FILTERELEMENT_NOT:
+    owl_filter_compile_element(prog, fe->left, stack, refs, error);
+    owl_filter_emit(prog, OWL_FILTER_OP_NOT, NULL);
+    break;
+  case OWL_FILTERELEMENT_OR:
+    if (owl_filter_compile_set(prog, fe))
+      break;
+    /* fall through */
+  case OWL_FILTERELEMENT_AND:
+    /* short-circuit: skip the right operand if the left one already
+     * decides the result */
+    owl_filter_compile_element(prog, fe->left, stack, refs, error);
+    jump = owl_filter_emit(prog, fe->type == OWL_FILTERELEMENT_AND ?
+                           OWL_FILTER_OP_JUMP_IF_FALSE :
+                           OWL_FILTER_OP_JUMP_IF_TRUE, NULL);
+    owl_filter_compile_element(prog, fe->right, stack, refs, error);
+    g_array_index(prog, owl_filter_insn, jump).target = prog->len;
+    break;
+  case OWL_FILTERELEMENT_FILTER:
+    *refs = true;
+    for (i = 0; i < stack->len; i++) {
+      if (!strcmp(stack->pdata[i], fe->field)) {
+        *error = OWL_FILTER_COMPILE_LOOP;
+        return;
+      }
+    }
+    if (stack->len > OWL_FILTER_MAX_DEPTH) {
+      *error = OWL_FILTER_COMPILE_TOODEEP;
+      return;
+    }
+    sub = owl_global_get_filter(&g, fe->field);
+    if (!sub || !sub->root) {
+      /* the filter does not exist, maybe because it was deleted.
+       * Default to not matching
+       */
+      owl_filter_emit(prog, OWL_FILTER_OP_FALSE, NULL);
+      return;
+    }
+    g_ptr_array_add(stack, fe->field);
+    owl_filter_compile_element(prog, sub->root, stack, refs, error);
+    g_ptr_array_set_size(stack, stack->len - 1);
+    break;
+  }
+}
+
+/* (Re)builds f's program from its expression tree. If the filter
+ * refers to itself or expands too far, says so, leaves a program that
+ * matches nothing and returns the OWL_FILTER_COMPILE_* reason. */
+int owl_filter_compile(owl_filter *f)
+{
+  GPtrArray *stack = g_ptr_array_new();
+  bool refs = false;
+  int error = OWL_FILTER_COMPILE_OK;
+
+  owl_filter_clear_program(f->program);
+  g_ptr_array_add(stack, f->name);
+  owl_filter_compile_element(f->program, f->root, stack, &refs, &error);
+  g_ptr_array_free(stack, true);
+
+  /* programs that inlined other filters go stale when those change */
+  f->generation = refs ? owl_global_get_filter_generation(&g) : -1;
+
+  if (error == OWL_FILTER_COMPILE_OK)
+    return error;
+  owl_filter_clear_program(f->program);
+  owl_filter_emit(f->program, OWL_FILTER_OP_FALSE, NULL);
+  if (error == OWL_FILTER_COMPILE_LOOP)
+    owl_function_error("Filter loop!");
+  else if (error == OWL_FILTER_COMPILE_TOODEEP)
+    owl_function_error("Filter %s refers to filters nested more than %d deep",
+                       f->name, OWL_FILTER_MAX_DEPTH);
+  else
+    owl_function_error("Filter %s is too large once the filters it refers to are expanded",
+                       f->name);
+  return error;
+}
+
+static int owl_filter_run(const GArray *prog, const owl_message *m)
+{
+  const owl_filter_insn *insn;
+  char *perlrv;
+  int pc = 0, ret = 0;
+
+  while (pc < prog->len) {
+    insn = &g_array_index(prog, owl_filter_insn, pc++);
+    switch (insn->op) {
+    case OWL_FILTER_OP_TRUE:
+      ret = 1;
+      break;
+    case OWL_FILTER_OP_FALSE:
+      ret = 0;
+      break;
+    case OWL_FILTER_OP_RE:
+      /* the text signature can rule out a match on a core field */
+      if (insn->fe->indexed && !owl_message_may_contain(m, owl_regex_get_literal(&(insn->fe->re)), false)) {
+        ret = 0;
+        break;
+      }
+      ret = !owl_regex_compare(&(insn->fe->re),
+                               owl_filterelement_get_field(insn->fe, m),
+                               NULL, NULL);
+      break;
+    case OWL_FILTER_OP_SET:
+      ret = owl_filter_set_contains(insn->set, owl_filterelement_get_field(insn->fe, m));
+      break;
+    case OWL_FILTER_OP_PERL:
+      ret = 0;
+      if (owl_perlconfig_is_function(insn->fe->field)) {
+        perlrv = owl_perlconfig_call_with_message(insn->fe->field, m);
+        if (perlrv) {
+          ret = !strcmp(perlrv, "1");
+          g_free(perlrv);
+        }
+      }
+      break;
+    case OWL_FILTER_OP_NOT:
+      ret = !ret;
+      break;
+    case OWL_FILTER_OP_JUMP_IF_FALSE:
+      if (!ret) pc = insn->target;
+      break;
+    case OWL_FILTER_OP_JUMP_IF_TRUE:
+      if (ret) pc = insn->target;
+      break;
+    }
+  }
+  return ret;
+}
+
 /* return 1 if the message matches the given filter, otherwise
  * return 0.
  */
 int owl_filter_message_match(const owl_filter *f, const owl_message *m)
 {
-  int ret;
   if(!f->root) return 0;
-  ret = owl_filterelement_match(f->root, m);
-  return ret;
+  /* A filter this one inlined was redefined or removed, so the old
+   * program may point into freed elements. The program is only a
+   * cache of root, so rebuilding it doesn't change f. */
+  if (f->generation >= 0 &&
+      f->generation != owl_global_get_filter_generation(&g))
+    owl_filter_compile((owl_filter *)f);
+  return owl_filter_run(f->program, m);
 }
 
 
@@ -235,9 +516,27 @@ int owl_filter_equiv(const owl_filter *a, const owl_filter *b)
 }
 
 
-int owl_filter_is_toodeep(const owl_filter *f)
+/* Returns true if the filter is named 'name' or refers to the filter
+ * 'name', directly or through other filters. */
+bool owl_filter_depends_on(const owl_filter *f, const char *name)
+{
+  if (!strcmp(owl_filter_get_name(f), name)) return true;
+  return owl_filterelement_depends_on(f->root, name, 0);
+}
+
+/* Returns true if whether a message matches the filter may change
+ * after the message has arrived, so that match results can't be kept
+ * around. */
+bool owl_filter_is_volatile(const owl_filter *f)
+{
+  return owl_filterelement_is_volatile(f->root, 0);
+}
+
+/* Returns true if the filter runs perl, directly or through other
+ * filters, so that its answer may change at any time. */
+bool owl_filter_calls_perl(const owl_filter *f)
 {
-  return owl_filterelement_is_toodeep(f, f->root);
+  return owl_filterelement_calls_perl(f->root, 0);
 }
 
 void owl_filter_delete(owl_filter *f)
@@ -250,5 +549,9 @@ void owl_filter_delete(owl_filter *f)
   }
   if (f->name)
     g_free(f->name);
+  if (f->program) {
+    owl_filter_clear_program(f->program);
+    g_array_free(f->program, true);
+  }
   g_slice_free(owl_filter, f);
 }
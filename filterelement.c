@@ -1,129 +1,73 @@
 #include "owl.h"
 
-static const char * owl_filterelement_get_field(const owl_message *m, const char * field)
+static const struct {
+  const char *name;
+  int id;
+} owl_filterelement_fields[] = {
+  { "class",     OWL_FILTER_FIELD_CLASS },
+  { "instance",  OWL_FILTER_FIELD_INSTANCE },
+  { "sender",    OWL_FILTER_FIELD_SENDER },
+  { "recipient", OWL_FILTER_FIELD_RECIPIENT },
+  { "body",      OWL_FILTER_FIELD_BODY },
+  { "opcode",    OWL_FILTER_FIELD_OPCODE },
+  { "realm",     OWL_FILTER_FIELD_REALM },
+  { "type",      OWL_FILTER_FIELD_TYPE },
+  { "hostname",  OWL_FILTER_FIELD_HOSTNAME },
+  { "deleted",   OWL_FILTER_FIELD_DELETED },
+  { "direction", OWL_FILTER_FIELD_DIRECTION },
+  { "login",     OWL_FILTER_FIELD_LOGIN },
+};
+
+/* Returns the value of the field a regex filterelement matches
+ * against. The field was resolved when the element was created. */
+const char *owl_filterelement_get_field(const owl_filterelement *fe, const owl_message *m)
 {
   const char *match;
-  if (!strcasecmp(field, "class")) {
-    match=owl_message_get_class(m);
-  } else if (!strcasecmp(field, "instance")) {
-    match=owl_message_get_instance(m);
-  } else if (!strcasecmp(field, "sender")) {
-    match=owl_message_get_sender(m);
-  } else if (!strcasecmp(field, "recipient")) {
-    match=owl_message_get_recipient(m);
-  } else if (!strcasecmp(field, "body")) {
-    match=owl_message_get_body(m);
-  } else if (!strcasecmp(field, "opcode")) {
-    match=owl_message_get_opcode(m);
-  } else if (!strcasecmp(field, "realm")) {
-    match=owl_message_get_realm(m);
-  } else if (!strcasecmp(field, "type")) {
-    match=owl_message_get_type(m);
-  } else if (!strcasecmp(field, "hostname")) {
-    match=owl_message_get_hostname(m);
-  } else if (!strcasecmp(field, "deleted")) {
-    match=owl_message_is_delete(m) ? "true" : "false";
-  } else if (!strcasecmp(field, "direction")) {
+
+  switch (fe->fieldid) {
+  case OWL_FILTER_FIELD_CLASS:
+    return owl_message_get_class(m);
+  case OWL_FILTER_FIELD_INSTANCE:
+    return owl_message_get_instance(m);
+  case OWL_FILTER_FIELD_SENDER:
+    return owl_message_get_sender(m);
+  case OWL_FILTER_FIELD_RECIPIENT:
+    return owl_message_get_recipient(m);
+  case OWL_FILTER_FIELD_BODY:
+    return owl_message_get_body(m);
+  case OWL_FILTER_FIELD_OPCODE:
+    return owl_message_get_opcode(m);
+  case OWL_FILTER_FIELD_REALM:
+    return owl_message_get_realm(m);
+  case OWL_FILTER_FIELD_TYPE:
+    return owl_message_get_type(m);
+  case OWL_FILTER_FIELD_HOSTNAME:
+    return owl_message_get_hostname(m);
+  case OWL_FILTER_FIELD_DELETED:
+    return owl_message_is_delete(m) ? "true" : "false";
+  case OWL_FILTER_FIELD_DIRECTION:
     if (owl_message_is_direction_out(m)) {
-      match="out";
+      return "out";
     } else if (owl_message_is_direction_in(m)) {
-      match="in";
+      return "in";
     } else if (owl_message_is_direction_none(m)) {
-      match="none";
-    } else {
-      match="";
+      return "none";
     }
-  } else if (!strcasecmp(field, "login")) {
+    return "";
+  case OWL_FILTER_FIELD_LOGIN:
     if (owl_message_is_login(m)) {
-      match="login";
+      return "login";
     } else if (owl_message_is_logout(m)) {
-      match="logout";
-    } else {
-      match="none";
+      return "logout";
     }
-  } else {
-    match = owl_message_get_attribute_value(m,field);
-    if(match == NULL) match = "";
+    return "none";
   }
 
+  match = owl_message_get_attribute_value_quark(m, fe->attr);
+  if(match == NULL) match = "";
   return match;
 }
 
-static int owl_filterelement_match_false(const owl_filterelement *fe, const owl_message *m)
-{
-  return 0;
-}
-
-static int owl_filterelement_match_true(const owl_filterelement *fe, const owl_message *m)
-{
-  return 1;
-}
-
-static int owl_filterelement_match_re(const owl_filterelement *fe, const owl_message *m)
-{
-  const char * val = owl_filterelement_get_field(m, fe->field);
-  return !owl_regex_compare(&(fe->re), val, NULL, NULL);
-}
-
-static int owl_filterelement_match_filter(const owl_filterelement *fe, const owl_message *m)
-{
-  const owl_filter *subfilter;
-  subfilter=owl_global_get_filter(&g, fe->field);
-  if (!subfilter) {
-    /* the filter does not exist, maybe because it was deleted.
-     * Default to not matching
-     */
-    return 0;
-  } 
-  return owl_filter_message_match(subfilter, m);
-}
-
-static int owl_filterelement_match_perl(const owl_filterelement *fe, const owl_message *m)
-{
-  const char *subname;
-  char *perlrv;
-  int   tf=0;
-
-  subname = fe->field;
-  if (!owl_perlconfig_is_function(subname)) {
-    return 0;
-  }
-  perlrv = owl_perlconfig_call_with_message(subname, m);
-  if (perlrv) {
-    if (0 == strcmp(perlrv, "1")) {
-      tf=1;
-    }
-    g_free(perlrv);
-  }
-  return tf;
-}
-
-static int owl_filterelement_match_group(const owl_filterelement *fe, const owl_message *m)
-{
-  return owl_filterelement_match(fe->left, m);
-}
-
-/* XXX: Our boolean operators short-circuit here. The original owl did
-   not. Do we care?
-*/
-
-static int owl_filterelement_match_and(const owl_filterelement *fe, const owl_message *m)
-{
-  return owl_filterelement_match(fe->left, m) &&
-    owl_filterelement_match(fe->right, m);
-}
-
-static int owl_filterelement_match_or(const owl_filterelement *fe, const owl_message *m)
-{
-  return owl_filterelement_match(fe->left, m) ||
-    owl_filterelement_match(fe->right, m);
-}
-
-static int owl_filterelement_match_not(const owl_filterelement *fe, const owl_message *m)
-{
-  return !owl_filterelement_match(fe->left, m);
-}
-
 /* Print methods */
 
 static void owl_filterelement_print_true(const owl_filterelement *fe, GString *buf)
@@ -190,8 +134,11 @@ static void owl_filterelement_print_not(const owl_filterelement *fe, GString *bu
 void owl_filterelement_create(owl_filterelement *fe) {
   fe->field = NULL;
   fe->left = fe->right = NULL;
-  fe->match_message = NULL;
+  fe->type = OWL_FILTERELEMENT_FALSE;
   fe->print_elt = NULL;
+  fe->fieldid = OWL_FILTER_FIELD_ATTRIBUTE;
+  fe->attr = 0;
+  fe->indexed = false;
   owl_regex_init(&(fe->re));
 }
 
@@ -199,19 +146,21 @@ void owl_filterelement_create(owl_filterelement *fe) {
 void owl_filterelement_create_true(owl_filterelement *fe)
 {
   owl_filterelement_create(fe);
-  fe->match_message = owl_filterelement_match_true;
+  fe->type = OWL_FILTERELEMENT_TRUE;
   fe->print_elt = owl_filterelement_print_true;
 }
 
 void owl_filterelement_create_false(owl_filterelement *fe)
 {
   owl_filterelement_create(fe);
-  fe->match_message = owl_filterelement_match_false;
+  fe->type = OWL_FILTERELEMENT_FALSE;
   fe->print_elt = owl_filterelement_print_false;
 }
 
 int owl_filterelement_create_re(owl_filterelement *fe, const char *field, const char *re)
 {
+  int i;
+
   owl_filterelement_create(fe);
   fe->field=g_strdup(field);
   if(owl_regex_create(&(fe->re), re)) {
@@ -219,7 +168,18 @@ int owl_filterelement_create_re(owl_filterelement *fe, const char *field, const
     fe->field = NULL;
     return (-1);
   }
-  fe->match_message = owl_filterelement_match_re;
+  for (i = 0; i < G_N_ELEMENTS(owl_filterelement_fields); i++) {
+    if (!strcasecmp(field, owl_filterelement_fields[i].name)) {
+      fe->fieldid = owl_filterelement_fields[i].id;
+      break;
+    }
+  }
+  if (fe->fieldid == OWL_FILTER_FIELD_ATTRIBUTE)
+    fe->attr = g_quark_from_string(field);
+  fe->indexed = owl_regex_get_literal(&(fe->re)) != NULL &&
+    fe->fieldid != OWL_FILTER_FIELD_ATTRIBUTE &&
+    fe->fieldid <= OWL_FILTER_FIELD_TYPE;
+  fe->type = OWL_FILTERELEMENT_RE;
   fe->print_elt = owl_filterelement_print_re;
   return 0;
 }
@@ -228,7 +188,7 @@ void owl_filterelement_create_filter(owl_filterelement *fe, const char *name)
 {
   owl_filterelement_create(fe);
   fe->field=g_strdup(name);
-  fe->match_message = owl_filterelement_match_filter;
+  fe->type = OWL_FILTERELEMENT_FILTER;
   fe->print_elt = owl_filterelement_print_filter;
 }
 
@@ -236,7 +196,7 @@ void owl_filterelement_create_perl(owl_filterelement *fe, const char *name)
 {
   owl_filterelement_create(fe);
   fe->field=g_strdup(name);
-  fe->match_message = owl_filterelement_match_perl;
+  fe->type = OWL_FILTERELEMENT_PERL;
   fe->print_elt = owl_filterelement_print_perl;
 }
 
@@ -244,7 +204,7 @@ void owl_filterelement_create_group(owl_filterelement *fe, owl_filterelement *in
 {
   owl_filterelement_create(fe);
   fe->left = in;
-  fe->match_message = owl_filterelement_match_group;
+  fe->type = OWL_FILTERELEMENT_GROUP;
   fe->print_elt = owl_filterelement_print_group;
 }
 
@@ -252,7 +212,7 @@ void owl_filterelement_create_not(owl_filterelement *fe, owl_filterelement *in)
 {
   owl_filterelement_create(fe);
   fe->left = in;
-  fe->match_message = owl_filterelement_match_not;
+  fe->type = OWL_FILTERELEMENT_NOT;
   fe->print_elt = owl_filterelement_print_not;
 }
 
@@ -261,7 +221,7 @@ void owl_filterelement_create_and(owl_filterelement *fe, owl_filterelement *lhs,
   owl_filterelement_create(fe);
   fe->left = lhs;
   fe->right = rhs;
-  fe->match_message = owl_filterelement_match_and;
+  fe->type = OWL_FILTERELEMENT_AND;
   fe->print_elt = owl_filterelement_print_and;
 }
 
@@ -270,56 +230,64 @@ void owl_filterelement_create_or(owl_filterelement *fe, owl_filterelement *lhs,
   owl_filterelement_create(fe);
   fe->left = lhs;
   fe->right = rhs;
-  fe->match_message = owl_filterelement_match_or;
+  fe->type = OWL_FILTERELEMENT_OR;
   fe->print_elt = owl_filterelement_print_or;
 }
 
-int owl_filterelement_match(const owl_filterelement *fe, const owl_message *m)
+bool owl_filterelement_depends_on(const owl_filterelement *fe, const char *name, int depth)
 {
-  if(!fe) return 0;
-  if(!fe->match_message) return 0;
-  return fe->match_message(fe, m);
-}
-
-static int fe_visiting = 0;
-static int fe_visited  = 1;
+  const owl_filter *f;
 
-int owl_filterelement_is_toodeep(const owl_filter *f, const owl_filterelement *fe)
-{
-  int rv;
-  owl_dict filters;
-  owl_dict_create(&filters);
+  if (!fe) return false;
+  /* be conservative about anything suspiciously deep */
+  if (depth > OWL_FILTER_MAX_DEPTH) return true;
 
-  owl_dict_insert_element(&filters, f->name, &fe_visiting, owl_dict_noop_delete);
+  if (fe->type == OWL_FILTERELEMENT_FILTER) {
+    if (!strcmp(fe->field, name)) return true;
+    f = owl_global_get_filter(&g, fe->field);
+    return f && owl_filterelement_depends_on(f->root, name, depth+1);
+  }
+  return owl_filterelement_depends_on(fe->left, name, depth+1) ||
+    owl_filterelement_depends_on(fe->right, name, depth+1);
+}
 
-  rv = _owl_filterelement_is_toodeep(fe, &filters);
+/* Perl filters and the deleted and question fields can give a
+ * different answer for a message later on. */
+bool owl_filterelement_is_volatile(const owl_filterelement *fe, int depth)
+{
+  const owl_filter *f;
 
-  owl_dict_cleanup(&filters, NULL);
-  return rv;
+  if (!fe) return false;
+  if (depth > OWL_FILTER_MAX_DEPTH) return true;
+
+  if (fe->type == OWL_FILTERELEMENT_PERL) {
+    return true;
+  } else if (fe->type == OWL_FILTERELEMENT_RE) {
+    return fe->fieldid == OWL_FILTER_FIELD_DELETED ||
+      !strcasecmp(fe->field, "question");
+  } else if (fe->type == OWL_FILTERELEMENT_FILTER) {
+    f = owl_global_get_filter(&g, fe->field);
+    return f && owl_filterelement_is_volatile(f->root, depth+1);
+  }
+  return owl_filterelement_is_volatile(fe->left, depth+1) ||
+    owl_filterelement_is_volatile(fe->right, depth+1);
 }
 
-int _owl_filterelement_is_toodeep(const owl_filterelement *fe, owl_dict *seen)
+bool owl_filterelement_calls_perl(const owl_filterelement *fe, int depth)
 {
-  int rv = 0;
   const owl_filter *f;
 
-  if(fe->match_message == owl_filterelement_match_filter) {
-    int *nval = owl_dict_find_element(seen, fe->field);
-    if(nval == &fe_visiting) {
-      return 1;
-    } else if (nval == NULL) {
-      f = owl_global_get_filter(&g, fe->field);
-      owl_dict_insert_element(seen, fe->field, &fe_visiting, owl_dict_noop_delete);
-      if(f) rv = _owl_filterelement_is_toodeep(f->root, seen);
-      owl_dict_insert_element(seen, fe->field, &fe_visited, owl_dict_noop_delete);
-    }
-  } else {
-    if(fe->left)
-      rv = rv || _owl_filterelement_is_toodeep(fe->left, seen);
-    if(fe->right)
-      rv = rv || _owl_filterelement_is_toodeep(fe->right, seen);
+  if (!fe) return false;
+  if (depth > OWL_FILTER_MAX_DEPTH) return true;
+
+  if (fe->type == OWL_FILTERELEMENT_PERL) {
+    return true;
+  } else if (fe->type == OWL_FILTERELEMENT_FILTER) {
+    f = owl_global_get_filter(&g, fe->field);
+    return f && owl_filterelement_calls_perl(f->root, depth+1);
   }
-  return rv;
+  return owl_filterelement_calls_perl(fe->left, depth+1) ||
+    owl_filterelement_calls_perl(fe->right, depth+1);
 }
 
 void owl_filterelement_cleanup(owl_filterelement *fe)
@@ -1,109 +1,288 @@
 #include "filterproc.h"
 #include <sys/wait.h>
 #include <string.h>
+#include <unistd.h>
 #include <glib.h>
 
-struct filter_data {
-  const char **in;
-  const char *in_end;
-  GString *out_str;
-  GMainLoop *loop;
+/* at most this many filters from call_filter_async run at once; the
+ * rest wait their turn */
+#define FILTER_MAX_RUNNING 8
+/* the child's output is read in pieces of this size */
+#define FILTER_READ_SIZE 4096
+
+struct filter_proc {
+  char **argv;
+  GMainContext *context;
+  char *in;
+  gsize in_len, in_pos;
+  GString *out_str;             /* NULL if the output goes to 'output' */
+  filter_output_func output;
+  filter_done_func done;
+  void *cbdata;
+  int queued;                   /* counted against FILTER_MAX_RUNNING */
+  int pending;                  /* stdin, stdout and the child, until done */
   int err;
+  int status;
 };
 
-static gboolean filter_stdin(GIOChannel *channel, GIOCondition condition, gpointer data_)
+G_LOCK_DEFINE_STATIC(filter_queue);
+static GQueue filter_waiting = G_QUEUE_INIT;
+static int filter_running = 0;
+
+static gboolean filter_start(struct filter_proc *proc);
+
+static void filter_proc_free(struct filter_proc *proc)
 {
-  struct filter_data *data = data_;
+  g_strfreev(proc->argv);
+  g_main_context_unref(proc->context);
+  g_free(proc->in);
+  if (proc->out_str)
+    g_string_free(proc->out_str, TRUE);
+  g_slice_free(struct filter_proc, proc);
+}
+
+/* Hands the result to the caller and, for a queued filter, lets the
+ * next one waiting start */
+static void filter_finish(struct filter_proc *proc)
+{
+  struct filter_proc *next = NULL;
+  char *out = NULL;
+
+  if (proc->out_str) {
+    out = g_string_free(proc->out_str, proc->err);
+    proc->out_str = NULL;
+  }
+  proc->done(out, proc->err, proc->status, proc->cbdata);
+
+  if (proc->queued) {
+    G_LOCK(filter_queue);
+    next = g_queue_pop_head(&filter_waiting);
+    if (!next)
+      filter_running--;
+    G_UNLOCK(filter_queue);
+  }
+  filter_proc_free(proc);
+
+  /* a failed start finishes the filter, which starts the next */
+  if (next)
+    filter_start(next);
+}
+
+static void filter_step(struct filter_proc *proc)
+{
+  if (--proc->pending == 0)
+    filter_finish(proc);
+}
+
+static gboolean filter_stdin(GIOChannel *channel, GIOCondition condition, gpointer data)
+{
+  struct filter_proc *proc = data;
   gboolean done = condition & (G_IO_ERR | G_IO_HUP);
 
   if (condition & G_IO_OUT) {
     gsize n;
-    GIOStatus ret = g_io_channel_write_chars(channel, *data->in, data->in_end - *data->in, &n, NULL);
-    *data->in += n;
+    GIOStatus ret = g_io_channel_write_chars(channel, proc->in + proc->in_pos, proc->in_len - proc->in_pos, &n, NULL);
+    proc->in_pos += n;
     if (ret == G_IO_STATUS_ERROR)
-      data->err = 1;
-    if (ret == G_IO_STATUS_ERROR || *data->in == data->in_end)
+      proc->err = 1;
+    if (ret == G_IO_STATUS_ERROR || proc->in_pos == proc->in_len)
       done = TRUE;
   }
 
   if (condition & G_IO_ERR)
-    data->err = 1;
+    proc->err = 1;
 
-  if (done)
+  if (done) {
     g_io_channel_shutdown(channel, TRUE, NULL);
+    filter_step(proc);
+  }
   return !done;
 }
 
-static gboolean filter_stdout(GIOChannel *channel, GIOCondition condition, gpointer data_)
+static gboolean filter_stdout(GIOChannel *channel, GIOCondition condition, gpointer data)
 {
-  struct filter_data *data = data_;
+  struct filter_proc *proc = data;
   gboolean done = condition & (G_IO_ERR | G_IO_HUP);
 
   if (condition & (G_IO_IN | G_IO_HUP)) {
-    gchar *buf;
+    gchar buf[FILTER_READ_SIZE];
     gsize n;
-    GIOStatus ret = g_io_channel_read_to_end(channel, &buf, &n, NULL);
-    g_string_append_len(data->out_str, buf, n);
-    g_free(buf);
+    GIOStatus ret;
+
+    do {
+      ret = g_io_channel_read_chars(channel, buf, sizeof(buf), &n, NULL);
+      if (n > 0 && proc->output)
+        proc->output(buf, n, proc->cbdata);
+      else if (n > 0)
+        g_string_append_len(proc->out_str, buf, n);
+    } while (ret == G_IO_STATUS_NORMAL);
+    if (ret == G_IO_STATUS_EOF)
+      done = TRUE;
     if (ret == G_IO_STATUS_ERROR) {
-      data->err = 1;
+      proc->err = 1;
       done = TRUE;
     }
   }
 
   if (condition & G_IO_ERR)
-    data->err = 1;
+    proc->err = 1;
 
   if (done) {
     g_io_channel_shutdown(channel, TRUE, NULL);
-    g_main_loop_quit(data->loop);
+    filter_step(proc);
   }
   return !done;
 }
 
-int call_filter(const char *const *argv, const char *in, char **out, int *status)
+static void filter_exited(GPid pid, gint status, gpointer data)
+{
+  struct filter_proc *proc = data;
+
+  proc->status = status;
+  g_spawn_close_pid(pid);
+  filter_step(proc);
+}
+
+static gboolean filter_failed(gpointer data)
+{
+  struct filter_proc *proc = data;
+
+  proc->err = 1;
+  filter_finish(proc);
+  return FALSE;
+}
+
+static void filter_watch(struct filter_proc *proc, int fd, GIOCondition condition, GIOFunc func)
+{
+  GIOChannel *channel = g_io_channel_unix_new(fd);
+  GSource *source;
+
+  g_io_channel_set_encoding(channel, NULL, NULL);
+  g_io_channel_set_buffered(channel, FALSE);
+  g_io_channel_set_close_on_unref(channel, TRUE);
+  g_io_channel_set_flags(channel, g_io_channel_get_flags(channel) | G_IO_FLAG_NONBLOCK, NULL);
+  source = g_io_create_watch(channel, condition);
+  g_io_channel_unref(channel);
+  g_source_set_callback(source, (GSourceFunc)func, proc, NULL);
+  g_source_attach(source, proc->context);
+  g_source_unref(source);
+}
+
+/* Runs the child and starts watching it.  If it can't be run, the
+ * filter finishes with an error from an idle callback, and this
+ * returns false. */
+static gboolean filter_start(struct filter_proc *proc)
 {
   GPid child_pid;
   int child_stdin, child_stdout;
+  GSource *source;
 
-  if (!g_spawn_async_with_pipes(NULL, (char**)argv, NULL,
+  if (!g_spawn_async_with_pipes(NULL, proc->argv, NULL,
                                 G_SPAWN_SEARCH_PATH | G_SPAWN_DO_NOT_REAP_CHILD,
                                 NULL, NULL,
                                 &child_pid, &child_stdin, &child_stdout, NULL,
                                 NULL)) {
-    *out = NULL;
-    return 1;
+    source = g_idle_source_new();
+    g_source_set_callback(source, filter_failed, proc, NULL);
+    g_source_attach(source, proc->context);
+    g_source_unref(source);
+    return FALSE;
+  }
+
+  proc->pending = 3;
+  if (proc->in_len == 0) {
+    /* nothing to write, so the child may as well see EOF at once */
+    close(child_stdin);
+    proc->pending--;
+  } else {
+    filter_watch(proc, child_stdin, G_IO_OUT | G_IO_ERR | G_IO_HUP, filter_stdin);
   }
+  filter_watch(proc, child_stdout, G_IO_IN | G_IO_ERR | G_IO_HUP, filter_stdout);
+  source = g_child_watch_source_new(child_pid);
+  g_source_set_callback(source, (GSourceFunc)filter_exited, proc, NULL);
+  g_source_attach(source, proc->context);
+  g_source_unref(source);
+  return TRUE;
+}
+
+static struct filter_proc *filter_new(const char *const *argv, const char *in,
+                                      GMainContext *context,
+                                      filter_output_func output,
+                                      filter_done_func done, void *cbdata)
+{
+  struct filter_proc *proc = g_slice_new0(struct filter_proc);
 
   if (in == NULL) in = "";
-  GMainContext *context = g_main_context_new();
-  struct filter_data data = {&in, in + strlen(in), g_string_new(""), g_main_loop_new(context, FALSE), 0};
+  proc->argv = g_strdupv((char **)argv);
+  proc->context = g_main_context_ref(context ? context : g_main_context_default());
+  proc->in_len = strlen(in);
+  proc->in = g_strdup(in);
+  proc->output = output;
+  if (!output)
+    proc->out_str = g_string_new("");
+  proc->done = done;
+  proc->cbdata = cbdata;
+  return proc;
+}
 
-  GIOChannel *channel = g_io_channel_unix_new(child_stdin);
-  g_io_channel_set_encoding(channel, NULL, NULL);
-  g_io_channel_set_flags(channel, g_io_channel_get_flags(channel) | G_IO_FLAG_NONBLOCK, NULL);
-  GSource *source = g_io_create_watch(channel, G_IO_OUT | G_IO_ERR | G_IO_HUP);
-  g_io_channel_unref(channel);
-  g_source_set_callback(source, (GSourceFunc)filter_stdin, &data, NULL);
-  g_source_attach(source, context);
-  g_source_unref(source);
+/* Runs argv with 'in' on its stdin, without waiting for it.  The
+ * child's output is passed to 'output' as it comes, if that is given,
+ * and collected otherwise.  Once the child has exited and its output
+ * is read, 'done' gets the collected output (NULL on error or when
+ * streaming, and the callee's to free), whether there was an error,
+ * and the child's wait status.  The callbacks run from 'context', or
+ * the default main context if it is NULL.  If too many filters are
+ * running already, this one waits for some to finish. */
+void call_filter_async(const char *const *argv, const char *in,
+                       GMainContext *context,
+                       filter_output_func output,
+                       filter_done_func done, void *cbdata)
+{
+  struct filter_proc *proc = filter_new(argv, in, context, output, done, cbdata);
+  gboolean start;
 
-  channel = g_io_channel_unix_new(child_stdout);
-  g_io_channel_set_encoding(channel, NULL, NULL);
-  g_io_channel_set_flags(channel, g_io_channel_get_flags(channel) | G_IO_FLAG_NONBLOCK, NULL);
-  source = g_io_create_watch(channel, G_IO_IN | G_IO_ERR | G_IO_HUP);
-  g_io_channel_unref(channel);
-  g_source_set_callback(source, (GSourceFunc)filter_stdout, &data, NULL);
-  g_source_attach(source, context);
-  g_source_unref(source);
+  proc->queued = 1;
+  G_LOCK(filter_queue);
+  start = filter_running < FILTER_MAX_RUNNING;
+  if (start)
+    filter_running++;
+  else
+    g_queue_push_tail(&filter_waiting, proc);
+  G_UNLOCK(filter_queue);
+
+  if (start)
+    filter_start(proc);
+}
+
+struct filter_data {
+  GMainLoop *loop;
+  char **out;
+  int *status;
+  int err;
+};
 
+static void filter_sync_done(char *out, int err, int status, void *data_)
+{
+  struct filter_data *data = data_;
+
+  *data->out = out;
+  *data->status = status;
+  data->err = err;
+  g_main_loop_quit(data->loop);
+}
+
+int call_filter(const char *const *argv, const char *in, char **out, int *status)
+{
+  GMainContext *context = g_main_context_new();
+  struct filter_data data = {g_main_loop_new(context, FALSE), out, status, 0};
+  struct filter_proc *proc = filter_new(argv, in, context, NULL, filter_sync_done, &data);
+
+  /* Not counted against FILTER_MAX_RUNNING: waiting here for a slot
+   * held by filters of the default context would never end. */
+  filter_start(proc);
   g_main_loop_run(data.loop);
 
   g_main_loop_unref(data.loop);
   g_main_context_unref(context);
-
-  waitpid(child_pid, status, 0);
-  g_spawn_close_pid(child_pid);
-  *out = g_string_free(data.out_str, data.err);
   return data.err;
 }
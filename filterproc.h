@@ -1,8 +1,19 @@
 #ifndef INC_BARNOWL_FILTER_PROC_H
 #define INC_BARNOWL_FILTER_PROC_H
 
+#include <glib.h>
+
+typedef void (*filter_output_func)(const char *data, gsize len, void *cbdata);
+typedef void (*filter_done_func)(char *out, int err, int status, void *cbdata);
+
 int call_filter(const char *const *argv,
                 const char *in,
                 char **out, int *status);
 
+void call_filter_async(const char *const *argv,
+                       const char *in,
+                       GMainContext *context,
+                       filter_output_func output,
+                       filter_done_func done, void *cbdata);
+
 #endif /* INC_BARNOWL_FILTER_PROC_H */
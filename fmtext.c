@@ -1,15 +1,41 @@
 #include "owl.h"
 
+/* A stretch of text in one set of attributes, within one line.  A
+ * line's newline ends its last run. */
+typedef struct _owl_fmtext_run {               /* noproto */
+  int start, end;               /* bytes of the buffer, without format chars */
+  char attr;
+  short fgcolor, bgcolor;
+} owl_fmtext_run;
+
+struct _owl_fmtext_index {                     /* noproto */
+  GArray *runs;                 /* owl_fmtext_run, in buffer order */
+  GArray *lines;                /* int: first run of each line, and of
+                                 * whatever follows the last newline */
+};
+
+static void owl_fmtext_free_index(owl_fmtext *f)
+{
+  if (!f->index) return;
+  g_array_free(f->index->runs, true);
+  g_array_free(f->index->lines, true);
+  g_slice_free(owl_fmtext_index, f->index);
+  f->index = NULL;
+}
+
+
 /* initialize an fmtext with no data */
 void owl_fmtext_init_null(owl_fmtext *f)
 {
   f->buff = g_string_new("");
+  f->index = NULL;
 }
 
 /* Clear the data from an fmtext, but don't deallocate memory. This
    fmtext can then be appended to again. */
 void owl_fmtext_clear(owl_fmtext *f)
 {
+  owl_fmtext_free_index(f);
   g_string_truncate(f->buff, 0);
 }
 
@@ -30,6 +56,8 @@ void owl_fmtext_append_attr(owl_fmtext *f, const char *text, char attr, short fg
   if (fgcolor != OWL_COLOR_DEFAULT) fg=1;
   if (bgcolor != OWL_COLOR_DEFAULT) bg=1;
 
+  owl_fmtext_free_index(f);
+
   /* Set attributes */
   if (a)
     g_string_append_unichar(f->buff, OWL_FMTEXT_UC_ATTR | attr);
@@ -132,6 +160,7 @@ static void _owl_fmtext_append_fmtext(owl_fmtext *f, const owl_fmtext *in, int s
   short fgcolor = OWL_COLOR_DEFAULT;
   short bgcolor = OWL_COLOR_DEFAULT;
 
+  owl_fmtext_free_index(f);
   _owl_fmtext_scan_attributes(in, start, &attr, &fgcolor, &bgcolor);
 
   if (attr != OWL_FMTEXT_ATTR_NONE)
@@ -291,6 +320,225 @@ void owl_fmtext_curs_waddstr_without_search(const owl_fmtext *f, WINDOW *w, char
 {
   _owl_fmtext_curs_waddstr(f, w, 0, default_attrs, default_fgcolor, default_bgcolor);
 }
+static void owl_fmtext_index_add_run(owl_fmtext_index *idx, int start, int end, char attr, short fgcolor, short bgcolor)
+{
+  owl_fmtext_run run;
+
+  if (end <= start) return;
+  run.start = start;
+  run.end = end;
+  run.attr = attr;
+  run.fgcolor = fgcolor;
+  run.bgcolor = bgcolor;
+  g_array_append_val(idx->runs, run);
+}
+
+/* Splits f into runs of text in the same attributes and notes where
+ * its lines start, so drawing it needn't scan for format characters.
+ * The index is kept until f changes.  Returns the bytes it takes. */
+size_t owl_fmtext_build_index(const owl_fmtext *f)
+{
+  owl_fmtext_index *idx = f->index;
+  const char *s = f->buff->str;
+  int i, start = 0, line;
+  char attr = 0;
+  short fgcolor = OWL_COLOR_DEFAULT, bgcolor = OWL_COLOR_DEFAULT;
+  gunichar c;
+
+  if (!idx) {
+    idx = g_slice_new(owl_fmtext_index);
+    idx->runs = g_array_new(false, false, sizeof(owl_fmtext_run));
+    idx->lines = g_array_new(false, false, sizeof(int));
+    line = 0;
+    g_array_append_val(idx->lines, line);
+
+    for (i = 0; i < f->buff->len; ) {
+      if (s[i] == OWL_FMTEXT_UC_STARTBYTE_UTF8 &&
+          owl_fmtext_is_format_char(c = g_utf8_get_char(s + i))) {
+        owl_fmtext_index_add_run(idx, start, i, attr, fgcolor, bgcolor);
+        _owl_fmtext_update_attributes(c, &attr, &fgcolor, &bgcolor);
+        i = g_utf8_next_char(s + i) - s;
+        start = i;
+      } else if (s[i] == '\n') {
+        owl_fmtext_index_add_run(idx, start, ++i, attr, fgcolor, bgcolor);
+        line = idx->runs->len;
+        g_array_append_val(idx->lines, line);
+        start = i;
+      } else {
+        i++;
+      }
+    }
+    owl_fmtext_index_add_run(idx, start, f->buff->len, attr, fgcolor, bgcolor);
+    /* the index is a cache; building it doesn't change f */
+    ((owl_fmtext *)f)->index = idx;
+  }
+  return sizeof(*idx) +
+    idx->runs->len * sizeof(owl_fmtext_run) + idx->lines->len * sizeof(int);
+}
+
+/* Where _owl_fmtext_paint is in drawing a line */
+typedef struct _owl_fmtext_painter {           /* noproto */
+  WINDOW *w;
+  char default_attrs;
+  short default_fgcolor, default_bgcolor;
+  bool set;                     /* whether the attributes below are set */
+  char attr;
+  short fgcolor, bgcolor, pair;
+} owl_fmtext_painter;
+
+static void _owl_fmtext_paint_set(owl_fmtext_painter *p, char attr, short fgcolor, short bgcolor)
+{
+  attr |= p->default_attrs;
+  if (fgcolor == OWL_COLOR_DEFAULT) fgcolor = p->default_fgcolor;
+  if (bgcolor == OWL_COLOR_DEFAULT) bgcolor = p->default_bgcolor;
+  if (p->set && attr == p->attr && fgcolor == p->fgcolor && bgcolor == p->bgcolor)
+    return;
+  p->set = true;
+  p->attr = attr;
+  p->fgcolor = fgcolor;
+  p->bgcolor = bgcolor;
+  _owl_fmtext_wattrset(p->w, attr);
+  p->pair = owl_fmtext_get_colorpair(fgcolor, bgcolor);
+  _owl_fmtext_wcolor_set(p->w, p->pair);
+}
+
+/* Draws 'len' bytes of text, highlighting matches of the search */
+static void _owl_fmtext_paint(owl_fmtext_painter *p, const char *text, int len, char attr, short fgcolor, short bgcolor)
+{
+  char *s, *copy;
+  int start, end;
+
+  if (len <= 0) return;
+  _owl_fmtext_paint_set(p, attr, fgcolor, bgcolor);
+  if (!owl_global_is_search_active(&g)) {
+    waddnstr(p->w, text, len);
+    return;
+  }
+
+  s = copy = g_strndup(text, len);
+  while (owl_regex_compare(owl_global_get_search_re(&g), s, &start, &end) == 0) {
+    /* Prevent an infinite loop matching the empty string. */
+    if (end == 0)
+      break;
+    waddnstr(p->w, s, start);
+    _owl_fmtext_wattrset(p->w, p->attr ^ OWL_FMTEXT_ATTR_REVERSE);
+    _owl_fmtext_wcolor_set(p->w, p->pair);
+    waddnstr(p->w, s + start, end - start);
+    _owl_fmtext_wattrset(p->w, p->attr);
+    _owl_fmtext_wcolor_set(p->w, p->pair);
+    s += end;
+  }
+  waddstr(p->w, s);
+  g_free(copy);
+}
+
+static void _owl_fmtext_paint_spaces(owl_fmtext_painter *p, int n)
+{
+  static const char spaces[] = "                ";
+  const int chunk = sizeof(spaces) - 1;
+
+  for (; n > 0; n -= chunk)
+    _owl_fmtext_paint(p, spaces, MIN(n, chunk),
+                      OWL_FMTEXT_ATTR_NONE, OWL_COLOR_DEFAULT, OWL_COLOR_DEFAULT);
+}
+
+/* Draws lines 'aline' up to 'aline + lines' of 'f' to the curses
+ * window 'w', from column 'acol' to 'bcol', with the search
+ * highlighted.  This draws what owl_fmtext_truncate_lines and
+ * owl_fmtext_truncate_cols followed by owl_fmtext_curs_waddstr would,
+ * without building the truncated copies, by walking the index of 'f'.
+ */
+void owl_fmtext_curs_waddstr_range(const owl_fmtext *f, WINDOW *w, int aline, int lines, int acol, int bcol, char default_attrs, short default_fgcolor, short default_bgcolor)
+{
+  const owl_fmtext_index *idx;
+  const owl_fmtext_run *run, *nlrun;
+  owl_fmtext_painter p;
+  const char *s = f->buff->str, *ptr, *pending;
+  int line, r, col, chwidth, n, padding;
+  bool started, wide, done;
+  gunichar c;
+
+  if (w==NULL) {
+    owl_function_debugmsg("Hit a null window in owl_fmtext_curs_waddstr_range.");
+    return;
+  }
+  owl_fmtext_build_index(f);
+  idx = f->index;
+
+  p.w = w;
+  p.default_attrs = default_attrs;
+  p.default_fgcolor = default_fgcolor;
+  p.default_bgcolor = default_bgcolor;
+  p.set = false;
+  _owl_fmtext_paint_set(&p, OWL_FMTEXT_ATTR_NONE, OWL_COLOR_DEFAULT, OWL_COLOR_DEFAULT);
+
+  /* only lines ending in a newline are drawn */
+  for (line = MAX(aline, 0); line < aline + lines && line < idx->lines->len - 1; line++) {
+    col = 0;
+    chwidth = 0;
+    started = wide = done = false;
+    nlrun = NULL;
+    for (r = g_array_index(idx->lines, int, line);
+         !done && r < g_array_index(idx->lines, int, line + 1); r++) {
+      run = &g_array_index(idx->runs, owl_fmtext_run, r);
+      pending = NULL;
+      for (ptr = s + run->start; ptr < s + run->end; ptr = g_utf8_next_char(ptr)) {
+        c = g_utf8_get_char(ptr);
+        if (c == '\n') {
+          nlrun = run;
+          done = true;
+          break;
+        }
+        /* tabs become spaces without attributes, one column at a time */
+        n = c == '\t' ? OWL_TAB_WIDTH - (col % OWL_TAB_WIDTH) : 1;
+        if (c == '\t' && pending) {
+          _owl_fmtext_paint(&p, pending, ptr - pending, run->attr, run->fgcolor, run->bgcolor);
+          pending = NULL;
+        }
+        for (; n > 0; n--) {
+          chwidth = c == '\t' ? 1 : mk_wcwidth(c);
+          if (col + chwidth > bcol) {
+            /* a narrow character just past the end still goes in */
+            if (started && chwidth <= 1) {
+              if (c == '\t')
+                _owl_fmtext_paint_spaces(&p, 1);
+              else if (!pending)
+                pending = ptr;
+              if (c != '\t')
+                ptr = g_utf8_next_char(ptr);
+            }
+            wide = chwidth > 1;
+            done = true;
+            break;
+          }
+          if (col >= acol && !started) {
+            started = true;
+            padding = col - acol;
+            _owl_fmtext_paint_spaces(&p, padding);
+          }
+          if (started) {
+            if (c == '\t')
+              _owl_fmtext_paint_spaces(&p, 1);
+            else if (!pending)
+              pending = ptr;
+          }
+          col += chwidth;
+          chwidth = 0;
+        }
+        if (done) break;
+      }
+      if (pending)
+        _owl_fmtext_paint(&p, pending, ptr - pending, run->attr, run->fgcolor, run->bgcolor);
+    }
+
+    if (started && nlrun) {
+      _owl_fmtext_paint(&p, "\n", 1, nlrun->attr, nlrun->fgcolor, nlrun->bgcolor);
+    } else if (!started || wide) {
+      _owl_fmtext_paint(&p, "\n", 1, OWL_FMTEXT_ATTR_NONE, OWL_COLOR_DEFAULT, OWL_COLOR_DEFAULT);
+    }
+  }
+  wbkgdset(w, 0);
+}
 
 /* Expands tabs. Tabs are expanded as if given an initial indent of start. */
 void owl_fmtext_expand_tabs(const owl_fmtext *in, owl_fmtext *out, int start) {
@@ -533,6 +781,7 @@ int owl_fmtext_num_bytes(const owl_fmtext *f)
 void owl_fmtext_copy(owl_fmtext *dst, const owl_fmtext *src)
 {
   dst->buff = g_string_new(src->buff->str);
+  dst->index = NULL;
 }
 
 /* Search 'f' for the regex 're' for matches starting at
@@ -784,6 +1033,7 @@ void owl_fmtext_append_list(owl_fmtext *f, const GPtrArray *l, const char *join_
 /* Free all memory allocated by the object */
 void owl_fmtext_cleanup(owl_fmtext *f)
 {
+  owl_fmtext_free_index(f);
   if (f->buff) g_string_free(f->buff, true);
   f->buff = NULL;
 }
@@ -1,5 +1,5 @@
 #include "owl.h"
-#include "filterproc.h"
+#include "zcryptlib.h"
 #include <stdio.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
@@ -347,43 +347,21 @@ void owl_function_zwrite(owl_zwrite *z, const char *msg) {
 }
 #endif
 
-/* send, log and display outgoing zcrypt zephyrs.  If 'msg' is NULL
- * the message is expected to be set from the zwrite line itself
- */
-void owl_function_zcrypt(owl_zwrite *z, const char *msg)
+/* Sends and displays a zcrypt zephyr once it is encrypted; data is a
+ * copy of its zwrite, with the plaintext as the message */
+static void owl_function_zcrypt_send(char *cryptmsg, void *data)
 {
-  char *cryptmsg;
-  const char *argv[7];
-  char *zcrypt;
-  int rv, status;
+  owl_zwrite *z = data;
   char *old_msg;
 
-  /* create the zwrite and send the message */
-  owl_zwrite_populate_zsig(z);
-  if (msg) {
-    owl_zwrite_set_message(z, msg);
-  }
-  old_msg = g_strdup(owl_zwrite_get_message(z));
-
-  zcrypt = g_build_filename(owl_get_bindir(), "zcrypt", NULL);
-  argv[0] = zcrypt;
-  argv[1] = "-E";
-  argv[2] = "-c"; argv[3] = owl_zwrite_get_class(z);
-  argv[4] = "-i"; argv[5] = owl_zwrite_get_instance(z);
-  argv[6] = NULL;
-
-  rv = call_filter(argv, owl_zwrite_get_message(z), &cryptmsg, &status);
-
-  g_free(zcrypt);
-
-  if (rv || status) {
-    g_free(cryptmsg);
-    g_free(old_msg);
+  if (!cryptmsg) {
     owl_function_error("Error in zcrypt, possibly no key found.  Message not sent.");
     owl_function_beep();
+    owl_zwrite_delete(z);
     return;
   }
 
+  old_msg = g_strdup(owl_zwrite_get_message(z));
   owl_zwrite_set_message_raw(z, cryptmsg);
   owl_zwrite_set_opcode(z, "crypt");
 
@@ -397,6 +375,37 @@ void owl_function_zcrypt(owl_zwrite *z, const char *msg)
   /* Clean up. */
   g_free(cryptmsg);
   g_free(old_msg);
+  owl_zwrite_delete(z);
+}
+
+/* send, log and display outgoing zcrypt zephyrs.  If 'msg' is NULL
+ * the message is expected to be set from the zwrite line itself.
+ * gpg may take a while over AES, so the zephyr goes out from the main
+ * loop once it is encrypted, and z need not outlive this call.
+ */
+void owl_function_zcrypt(owl_zwrite *z, const char *msg)
+{
+  owl_zwrite *copy;
+
+  /* create the zwrite and send the message */
+  owl_zwrite_populate_zsig(z);
+  if (msg) {
+    owl_zwrite_set_message(z, msg);
+  }
+
+  copy = owl_zwrite_new_from_line(z->zwriteline);
+  if (!copy) {
+    owl_function_error("Error in zcrypt.  Message not sent.");
+    return;
+  }
+  owl_zwrite_set_zsig(copy, owl_zwrite_get_zsig(z));
+  owl_zwrite_set_message_raw(copy, owl_zwrite_get_message(z));
+
+  zcrypt_encrypt_message_async(zcrypt_keyring_get_default(),
+                               owl_zwrite_get_class(copy),
+                               owl_zwrite_get_instance(copy),
+                               owl_zwrite_get_message(copy),
+                               NULL, owl_function_zcrypt_send, copy);
 }
 
 void owl_callback_loopwrite(owl_editwin *e, bool success)
@@ -558,8 +567,18 @@ void owl_function_delete_and_expunge_message(int n)
   owl_messagelist *ml = owl_global_get_msglist(&g);
   owl_view *v = owl_global_get_current_view(&g);
   int lastmsgid = owl_function_get_curmsg_id(v);
+  owl_message *m = owl_messagelist_get_element(ml, n);
+  GHashTable *doomed;
 
-  /* delete and expunge the message */
+  if (m == NULL)
+    return;
+
+  /* drop it from the views, then delete and expunge the message */
+  doomed = g_hash_table_new(g_direct_hash, g_direct_equal);
+  g_hash_table_insert(doomed, m, m);
+  owl_view_forget_messages(doomed);
+  owl_snapshot_forget_messages(doomed);
+  g_hash_table_destroy(doomed);
   owl_messagelist_delete_and_expunge_element(ml, n);
 
   owl_function_redisplay_to_nearest(lastmsgid, v);
@@ -660,8 +679,6 @@ int owl_function_get_curmsg_id(const owl_view *v)
 void owl_function_redisplay_to_nearest(int msgid, owl_view *v)
 {
   int curmsg;
-  /* update all views (we only have one right now) */
-  owl_view_recalculate(v);
 
   /* find where the new position should be */
   if (msgid < 0) {
@@ -691,6 +708,20 @@ void owl_function_expunge(void)
   owl_messagelist *ml = owl_global_get_msglist(&g);
   owl_view *v = owl_global_get_current_view(&g);
   int lastmsgid = owl_function_get_curmsg_id(v);
+  GHashTable *doomed;
+  owl_message *m;
+  int i;
+
+  /* drop the deleted messages from the views first */
+  doomed = g_hash_table_new(g_direct_hash, g_direct_equal);
+  for (i = 0; i < owl_messagelist_get_size(ml); i++) {
+    m = owl_messagelist_get_element(ml, i);
+    if (owl_message_is_delete(m))
+      g_hash_table_insert(doomed, m, m);
+  }
+  owl_view_forget_messages(doomed);
+  owl_snapshot_forget_messages(doomed);
+  g_hash_table_destroy(doomed);
 
   /* expunge the message list */
   owl_messagelist_expunge(ml);
@@ -1141,6 +1172,7 @@ void owl_function_full_redisplay(void)
 {
   /* Ask every widget to redraw itself. */
   _dirty_everything(owl_window_get_screen(), NULL);
+  owl_mainwin_invalidate(owl_global_get_mainwin(&g));
   /* Force ncurses to redisplay everything. */
   clearok(stdscr, TRUE);
 }
@@ -1287,9 +1319,9 @@ void owl_function_info(void)
 #ifdef HAVE_LIBZEPHYR
     n = owl_message_get_notice(m);
     if (n != NULL) {
-      char *tmpbuff, *tmpbuff2;
+      const owl_zephyr_notice *zn = owl_message_get_zephyr_notice(m);
+      char *tmpbuff;
       int i, fields;
-      const char *f;
 
       if (!owl_message_is_pseudo(m)) {
 	owl_fmtext_append_normal(&fm, "  Kind      : ");
@@ -1329,15 +1361,12 @@ void owl_function_info(void)
 	owl_fmtext_appendf_normal(&fm, "  Num other : %i\n", n->z_num_other_fields);
 	owl_fmtext_appendf_normal(&fm, "  Msg Len   : %i\n", n->z_message_len);
 
-	fields=owl_zephyr_get_num_fields(n);
+	fields=owl_zephyr_notice_get_num_fields(zn);
 	owl_fmtext_appendf_normal(&fm, "  Fields    : %i\n", fields);
 
-	for (i = 0, f = owl_zephyr_first_raw_field(n); f != NULL;
-	     i++, f = owl_zephyr_next_raw_field(n, f)) {
-          tmpbuff = owl_zephyr_field_as_utf8(n, f);
-          tmpbuff2 = owl_text_indent(tmpbuff, 14, false);
-          owl_fmtext_appendf_normal(&fm, "  Field %i   : %s\n", i + 1, tmpbuff2);
-          g_free(tmpbuff2);
+	for (i = 1; i <= fields; i++) {
+          tmpbuff = owl_text_indent(owl_zephyr_notice_get_field(zn, i), 14, false);
+          owl_fmtext_appendf_normal(&fm, "  Field %i   : %s\n", i, tmpbuff);
           g_free(tmpbuff);
 	}
         tmpbuff = owl_text_indent(n->z_default_format, 14, false);
@@ -1683,6 +1712,54 @@ void owl_function_status(void)
   owl_fmtext_cleanup(&fm);
 }
 
+void owl_function_show_memory(void)
+{
+  const owl_strpool_stats *st = owl_strpool_get_stats();
+  const owl_fmtext_cache_stats *fst = owl_message_get_fmtext_cache_stats();
+  owl_fmtext fm;
+
+  owl_fmtext_init_null(&fm);
+  owl_fmtext_append_normal(&fm, "Shared message fields:\n");
+  owl_fmtext_appendf_normal(&fm, "  Distinct strings : %u\n", st->strings);
+  owl_fmtext_appendf_normal(&fm, "  Bytes held       : %lu\n", (unsigned long)st->bytes_used);
+  owl_fmtext_appendf_normal(&fm, "  Bytes saved      : %lu\n", (unsigned long)st->bytes_saved);
+  owl_fmtext_appendf_normal(&fm, "  Lookups          : %lu\n", st->lookups);
+  owl_fmtext_appendf_normal(&fm, "  Hit rate         : %.1f%%\n",
+                            st->lookups ? 100.0 * st->hits / st->lookups : 0.0);
+
+  owl_fmtext_append_normal(&fm, "\nFormatted message cache:\n");
+  owl_fmtext_appendf_normal(&fm, "  Messages         : %u\n", fst->entries);
+  owl_fmtext_appendf_normal(&fm, "  Bytes held       : %lu (limit %lu)\n",
+                            (unsigned long)fst->bytes,
+                            (unsigned long)owl_global_get_format_cache_size(&g) * 1024);
+  owl_fmtext_appendf_normal(&fm, "  Hits             : %lu\n", fst->hits);
+  owl_fmtext_appendf_normal(&fm, "  Misses           : %lu\n", fst->misses);
+  owl_fmtext_appendf_normal(&fm, "  Evictions        : %lu\n", fst->evictions);
+
+  owl_function_popless_fmtext(&fm);
+  owl_fmtext_cleanup(&fm);
+}
+
+void owl_function_show_zephyr_stats(void)
+{
+  const owl_zephyr_stats *st = owl_zephyr_get_stats();
+  const owl_zephyr_stats *rt = owl_zephyr_get_rates();
+  owl_fmtext fm;
+
+  owl_fmtext_init_null(&fm);
+  owl_fmtext_append_normal(&fm, "Zephyr traffic:        total per second\n");
+  owl_fmtext_appendf_normal(&fm, "  Notices       : %10lu %10lu\n", st->notices, rt->notices);
+  owl_fmtext_appendf_normal(&fm, "  Acks          : %10lu %10lu\n", st->acks, rt->acks);
+  owl_fmtext_appendf_normal(&fm, "  Pings dropped : %10lu %10lu\n", st->pings_dropped, rt->pings_dropped);
+  owl_fmtext_appendf_normal(&fm, "  Pseudologins  : %10lu %10lu\n", st->pseudologins, rt->pseudologins);
+  owl_fmtext_appendf_normal(&fm, "  Dispatches    : %10lu %10lu\n", st->dispatches, rt->dispatches);
+  owl_fmtext_appendf_normal(&fm, "\nDispatch budget: %d microseconds\n",
+                            owl_global_get_zephyr_dispatch_budget(&g));
+
+  owl_function_popless_fmtext(&fm);
+  owl_fmtext_cleanup(&fm);
+}
+
 void owl_function_show_term(void)
 {
   owl_fmtext fm;
@@ -2213,13 +2290,13 @@ CALLER_OWN char *owl_function_classinstfilt(const char *c, const char *i, int re
 
   buf = g_string_new("");
   owl_string_appendf_quoted(buf,
-                            related ? "class ^(un)*%q(\\.d)*$" : "class ^%q$",
+                            related ? "class " OWL_REGEX_UN_PREFIX "%q" OWL_REGEX_D_SUFFIX : "class ^%q$",
                             tmpclass);
 
   if (tmpinstance) {
     owl_string_appendf_quoted(buf,
                               related ?
-                              " and ( instance ^(un)*%q(\\.d)*$ )" :
+                              " and ( instance " OWL_REGEX_UN_PREFIX "%q" OWL_REGEX_D_SUFFIX " )" :
                               " and instance ^%q$",
                               tmpinstance);
   }
@@ -2619,7 +2696,7 @@ void owl_function_zpunt(const char *class, const char *inst, const char *recip,
   } else {
     quoted=owl_text_quote(class, OWL_REGEX_QUOTECHARS, OWL_REGEX_QUOTEWITH);
     g_ptr_array_add(argv, g_strdup("class"));
-    g_ptr_array_add(argv, g_strdup_printf("^(un)*%s(\\.d)*$", quoted));
+    g_ptr_array_add(argv, g_strdup_printf(OWL_REGEX_UN_PREFIX "%s" OWL_REGEX_D_SUFFIX, quoted));
     g_free(quoted);
   }
   if (!strcmp(inst, "*")) {
@@ -2630,7 +2707,7 @@ void owl_function_zpunt(const char *class, const char *inst, const char *recip,
     quoted=owl_text_quote(inst, OWL_REGEX_QUOTECHARS, OWL_REGEX_QUOTEWITH);
     g_ptr_array_add(argv, g_strdup("and"));
     g_ptr_array_add(argv, g_strdup("instance"));
-    g_ptr_array_add(argv, g_strdup_printf("^(un)*%s(\\.d)*$", quoted));
+    g_ptr_array_add(argv, g_strdup_printf(OWL_REGEX_UN_PREFIX "%s" OWL_REGEX_D_SUFFIX, quoted));
     g_free(quoted);
   }
   if (!strcmp(recip, "*")) {
@@ -2975,6 +3052,55 @@ void owl_function_dump(const char *filename)
   owl_function_makemsg("Messages dumped to %s", filename);
 }
 
+/*
+ * Acts on an incoming message which has been added to the message
+ * list: autoreplies, bells, alerts and the buddy list.
+ */
+void owl_function_incoming_message(const owl_message *m)
+{
+  const owl_filter *f;
+
+  /* do we need to autoreply? */
+  if (owl_global_is_zaway(&g) && !owl_message_get_attribute_value(m, "isauto")) {
+    if (owl_message_is_type_zephyr(m)) {
+      owl_zephyr_zaway(m);
+    }
+  }
+
+  /* ring the bell if it's a personal */
+  if (!strcmp(owl_global_get_personalbell(&g), "on")) {
+    if (!owl_message_is_loginout(m) &&
+        !owl_message_is_mail(m) &&
+        owl_message_is_personal(m)) {
+      owl_function_beep();
+    }
+  } else if (!strcmp(owl_global_get_personalbell(&g), "off")) {
+    /* do nothing */
+  } else {
+    f=owl_global_get_filter(&g, owl_global_get_personalbell(&g));
+    if (f && owl_filter_message_match(f, m)) {
+      owl_function_beep();
+    }
+  }
+
+  /* if it matches the alert filter, do the alert action */
+  f=owl_global_get_filter(&g, owl_global_get_alert_filter(&g));
+  if (f && owl_filter_message_match(f, m)) {
+    owl_function_command_norv(owl_global_get_alert_action(&g));
+  }
+
+  /* if it's a zephyr login or logout, update the zbuddylist */
+  if (owl_message_is_type_zephyr(m) && owl_message_is_loginout(m)) {
+    if (owl_message_is_login(m)) {
+      owl_zbuddylist_adduser(owl_global_get_zephyr_buddylist(&g), owl_message_get_sender(m));
+    } else if (owl_message_is_logout(m)) {
+      owl_zbuddylist_deluser(owl_global_get_zephyr_buddylist(&g), owl_message_get_sender(m));
+    } else {
+      owl_function_error("Internal error: received login notice that is neither login nor logout");
+    }
+  }
+}
+
 void owl_function_do_newmsgproc(void)
 {
   if (owl_global_get_newmsgproc(&g) && strcmp(owl_global_get_newmsgproc(&g), "")) {
@@ -32,6 +32,7 @@ void owl_global_init(owl_global *g) {
   g->startupargs=NULL;
 
   owl_variable_dict_setup(&(g->vars));
+  owl_global_resolve_varstubs(g);
 
   g->rightshift=0;
 
@@ -44,6 +45,8 @@ void owl_global_init(owl_global *g) {
 
   owl_dict_create(&(g->filters));
   g->filterlist = NULL;
+  g->filter_generation = 0;
+  g->color_generation = 0;
   g->puntlist = g_ptr_array_new();
   g->messagequeue = g_queue_new();
   owl_dict_create(&(g->styledict));
@@ -55,6 +58,7 @@ void owl_global_init(owl_global *g) {
   owl_regex_init(&g->search_re);
   g->starttime=time(NULL); /* assumes we call init only a start time */
   g->lastinputtime=g->starttime;
+  g->lastinput_usec = g_get_monotonic_time();
   g->last_wakeup_time = g->starttime;
   g->newmsgproc_pid=0;
   
@@ -80,6 +84,7 @@ void owl_global_init(owl_global *g) {
   g_free(cd);
 
   g->msglist = owl_messagelist_new();
+  g->viewcache = g_queue_new();
 
   _owl_global_init_windows(g);
 
@@ -92,7 +97,6 @@ void owl_global_init(owl_global *g) {
   g->zaldlist = NULL;
   g->pseudologin_notify = 0;
 
-  owl_message_init_fmtext_cache();
   g->kill_buffer = NULL;
 
   g->interrupt_count = 0;
@@ -260,6 +264,10 @@ owl_messagelist *owl_global_get_msglist(owl_global *g) {
   return g->msglist;
 }
 
+GQueue *owl_global_get_viewcache(owl_global *g) {
+  return g->viewcache;
+}
+
 /* keyhandler */
 
 owl_keyhandler *owl_global_get_keyhandler(owl_global *g) {
@@ -470,6 +478,12 @@ time_t owl_global_get_lastinputtime(const owl_global *g) {
 
 void owl_global_set_lastinputtime(owl_global *g, time_t time) {
   g->lastinputtime = time;
+  g->lastinput_usec = g_get_monotonic_time();
+}
+
+/* Microseconds since the last keypress, finer than the idle time */
+gint64 owl_global_get_input_idle_usec(const owl_global *g) {
+  return g_get_monotonic_time() - g->lastinput_usec;
 }
 
 time_t owl_global_get_idletime(const owl_global *g) {
@@ -552,15 +566,40 @@ void owl_global_add_filter(owl_global *g, owl_filter *f) {
   e->g = g;
   e->f = f;
 
+  owl_view_invalidate_filter(owl_filter_get_name(f));
   owl_dict_insert_element(&(g->filters), owl_filter_get_name(f),
                           e, owl_global_delete_filter_ent);
   g->filterlist = g_list_append(g->filterlist, f);
+  g->filter_generation++;
+  g->color_generation++;
 }
 
 void owl_global_remove_filter(owl_global *g, const char *name) {
-  owl_global_filter_ent *e = owl_dict_remove_element(&(g->filters), name);
-  if (e)
+  owl_global_filter_ent *e;
+
+  owl_view_invalidate_filter(name);
+  e = owl_dict_remove_element(&(g->filters), name);
+  if (e) {
     owl_global_delete_filter_ent(e);
+    g->filter_generation++;
+    g->color_generation++;
+  }
+}
+
+/* Compiled filters that inline other filters are stale once this
+ * changes. */
+int owl_global_get_filter_generation(const owl_global *g) {
+  return g->filter_generation;
+}
+
+/* Colors messages have taken from filters are stale once this
+ * changes. */
+int owl_global_get_color_generation(const owl_global *g) {
+  return g->color_generation;
+}
+
+void owl_global_invalidate_colors(owl_global *g) {
+  g->color_generation++;
 }
 
 /* nextmsgid */
@@ -569,6 +608,12 @@ int owl_global_get_nextmsgid(owl_global *g) {
   return(g->nextmsgid++);
 }
 
+/* Makes 'id' the next message id.  Only for restoring saved messages,
+ * whose ids must not go back past ones handed out. */
+void owl_global_set_nextmsgid(owl_global *g, int id) {
+  g->nextmsgid = id;
+}
+
 /* current view */
 
 owl_view *owl_global_get_current_view(owl_global *g) {
@@ -622,7 +667,9 @@ void owl_global_set_search_re(owl_global *g, const owl_regex *re) {
   /* TODO: Emit a signal so we don't depend on the viewwin and mainwin */
   if (owl_global_get_viewwin(g))
     owl_viewwin_dirty(owl_global_get_viewwin(g));
-  owl_mainwin_redisplay(owl_global_get_mainwin(g));
+  /* highlighting is applied as rows are painted, so rows which are
+   * otherwise unchanged need repainting too */
+  owl_mainwin_invalidate(owl_global_get_mainwin(g));
 }
 
 const owl_regex *owl_global_get_search_re(const owl_global *g) {
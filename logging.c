@@ -1,11 +1,30 @@
 #include "owl.h"
 #include <stdio.h>
+#include <sys/uio.h>
+
+/* The logging thread keeps the most recently used log files open, and
+ * collects the entries for each one to write together. */
+#define OWL_LOG_MAX_OPEN_FILES 32
+/* an open file's entries are written once this many bytes build up,
+ * or after this long */
+#define OWL_LOG_FLUSH_BYTES (32 * 1024)
+#define OWL_LOG_FLUSH_MSEC 500
+/* entries per writev, well within IOV_MAX */
+#define OWL_LOG_IOV_LEN 64
 
 typedef struct _owl_log_entry { /* noproto */
   char *filename;
   char *message;
 } owl_log_entry;
 
+typedef struct _owl_log_file { /* noproto */
+  char *filename;
+  int fd;
+  GPtrArray *pending;           /* owl_log_entry, oldest first */
+  size_t pending_bytes;
+  GList link;                   /* in open_file_lru */
+} owl_log_file;
+
 typedef struct _owl_log_options { /* noproto */
   bool drop_failed_logs;
   bool display_initial_log_count;
@@ -16,6 +35,12 @@ static GMainLoop *log_loop;
 static GThread *logging_thread;
 static bool defer_logs; /* to be accessed only on the disk-writing thread */
 static GQueue *deferred_entry_queue;
+/* only touched on the disk-writing thread */
+static GHashTable *open_files;          /* filename -> owl_log_file */
+static GQueue open_file_lru = G_QUEUE_INIT; /* most recently used first */
+static GSource *flush_source;
+
+static void owl_log_file_flush(owl_log_file *f, bool closing);
 
 static void owl_log_error_main_thread(gpointer data)
 {
@@ -89,21 +114,6 @@ static void owl_log_deferred_enqueue_first_message(const char *buffer, const cha
   g_queue_push_head(deferred_entry_queue, owl_log_new_entry(buffer, filename));
 }
 
-/* write out the entry if possible
- * return 0 on success, errno on failure to open
- */
-static int owl_log_try_write_entry(owl_log_entry *msg)
-{
-  FILE *file = NULL;
-  file = fopen(msg->filename, "a");
-  if (!file) {
-    return errno;
-  }
-  fprintf(file, "%s", msg->message);
-  fclose(file);
-  return 0;
-}
-
 static void owl_log_entry_delete(void *data)
 {
   owl_log_entry *msg = (owl_log_entry*)data;
@@ -112,6 +122,139 @@ static void owl_log_entry_delete(void *data)
   g_slice_free(owl_log_entry, msg);
 }
 
+static bool owl_log_is_deferrable_error(int errnum)
+{
+  return errnum == EPERM || errnum == EACCES || errnum == ETIMEDOUT;
+}
+
+static void owl_log_file_close(owl_log_file *f)
+{
+  g_queue_unlink(&open_file_lru, &f->link);
+  g_hash_table_remove(open_files, f->filename);
+  close(f->fd);
+  g_ptr_array_free(f->pending, true);
+  g_free(f->filename);
+  g_slice_free(owl_log_file, f);
+}
+
+/* Writes out the entries collected for f.  Returns 0 on success, and
+ * errno on failure, in which case the entries not written, or the
+ * unwritten ends of them, are left in f->pending. */
+static int owl_log_file_write_pending(owl_log_file *f)
+{
+  struct iovec iov[OWL_LOG_IOV_LEN];
+  owl_log_entry *msg;
+  ssize_t ret;
+  size_t len;
+  char *rest;
+  int n, done = 0;
+
+  while (done < f->pending->len) {
+    for (n = 0; n < G_N_ELEMENTS(iov) && done + n < f->pending->len; n++) {
+      msg = f->pending->pdata[done + n];
+      iov[n].iov_base = msg->message;
+      iov[n].iov_len = strlen(msg->message);
+    }
+    ret = writev(f->fd, iov, n);
+    if (ret < 0 && errno == EINTR) continue;
+    if (ret < 0) {
+      ret = errno;
+      g_ptr_array_remove_range(f->pending, 0, done);
+      return ret;
+    }
+    /* step past what got written; a short write leaves the tail of one */
+    while (done < f->pending->len) {
+      msg = f->pending->pdata[done];
+      len = strlen(msg->message);
+      if ((size_t)ret < len) {
+        if (ret > 0) {
+          rest = g_strdup(msg->message + ret);
+          g_free(msg->message);
+          msg->message = rest;
+        }
+        break;
+      }
+      ret -= len;
+      done++;
+    }
+  }
+  g_ptr_array_set_size(f->pending, 0);
+  f->pending_bytes = 0;
+  return 0;
+}
+
+/* Returns the open log file for filename, opening it if need be.  On
+ * failure returns NULL and sets *errnum. */
+static owl_log_file *owl_log_get_file(const char *filename, int *errnum)
+{
+  owl_log_file *f;
+  int fd;
+
+  if (!open_files)
+    open_files = g_hash_table_new(g_str_hash, g_str_equal);
+
+  f = g_hash_table_lookup(open_files, filename);
+  if (f) {
+    g_queue_unlink(&open_file_lru, &f->link);
+    g_queue_push_head_link(&open_file_lru, &f->link);
+    return f;
+  }
+
+  fd = open(filename, O_WRONLY | O_APPEND | O_CREAT, 0666);
+  if (fd < 0) {
+    *errnum = errno;
+    return NULL;
+  }
+  /* make room, writing out whatever the evicted file still holds */
+  while (g_queue_get_length(&open_file_lru) >= OWL_LOG_MAX_OPEN_FILES)
+    owl_log_file_flush(open_file_lru.tail->data, true);
+
+  f = g_slice_new(owl_log_file);
+  f->filename = g_strdup(filename);
+  f->fd = fd;
+  f->pending = g_ptr_array_new_with_free_func(owl_log_entry_delete);
+  f->pending_bytes = 0;
+  f->link.data = f;
+  f->link.prev = f->link.next = NULL;
+  g_queue_push_head_link(&open_file_lru, &f->link);
+  g_hash_table_insert(open_files, f->filename, f);
+  return f;
+}
+
+/* write out the entry if possible
+ * return 0 on success, errno on failure to open or write.  On a failed
+ * write, msg is left holding whatever of it did not get written, and
+ * entries collected for the file before it go back to the head of the
+ * deferred queue.
+ */
+static int owl_log_try_write_entry(owl_log_entry *msg)
+{
+  owl_log_file *f;
+  owl_log_entry *rest;
+  char *tail;
+  int i, ret = 0;
+
+  f = owl_log_get_file(msg->filename, &ret);
+  if (!f)
+    return ret;
+  g_ptr_array_add(f->pending, owl_log_new_entry(msg->message, msg->filename));
+  ret = owl_log_file_write_pending(f);
+  if (ret != 0) {
+    /* the copy of msg is last, and a failure leaves it pending */
+    rest = f->pending->pdata[f->pending->len - 1];
+    tail = rest->message;
+    rest->message = msg->message;
+    msg->message = tail;
+    for (i = f->pending->len - 2; i >= 0; i--) {
+      rest = f->pending->pdata[i];
+      owl_log_deferred_enqueue_first_message(rest->message, rest->filename);
+    }
+    g_ptr_array_set_size(f->pending, 0);
+    owl_log_file_close(f);
+  }
+  return ret;
+}
+
 #if GLIB_CHECK_VERSION(2, 32, 0)
 #else
 static void owl_log_entry_delete_gfunc(gpointer data, gpointer user_data)
@@ -127,6 +270,89 @@ static void owl_log_file_error(owl_log_entry *msg, int errnum)
                 msg->filename);
 }
 
+static void owl_log_start_deferring(const char *filename, int errnum)
+{
+  defer_logs = true;
+  owl_log_error("Unable to open file for logging (%s): \n"
+                "%s.  \n"
+                "Consider renewing your tickets.  Logging has been \n"
+                "suspended, and your messages will be saved.  To \n"
+                "resume logging, use the command :flush-logs.\n\n",
+                filename,
+                g_strerror(errnum));
+}
+
+/* Writes out the entries collected for f, and closes it if 'closing'
+ * is set or the write fails.  On EPERM, EACCES, or ETIMEDOUT, goes into
+ * deferred logging mode with the unwritten entries at the head of the
+ * queue; on other errors they are dropped.
+ *
+ * N.B. This function is called only on the disk-writing thread. */
+static void owl_log_file_flush(owl_log_file *f, bool closing)
+{
+  owl_log_entry *msg;
+  int i, ret;
+
+  ret = owl_log_file_write_pending(f);
+  if (ret == 0) {
+    if (closing) owl_log_file_close(f);
+    return;
+  }
+
+  if (owl_log_is_deferrable_error(ret)) {
+    if (!defer_logs)
+      owl_log_start_deferring(f->filename, ret);
+    for (i = f->pending->len - 1; i >= 0; i--) {
+      msg = f->pending->pdata[i];
+      owl_log_deferred_enqueue_first_message(msg->message, msg->filename);
+    }
+  } else {
+    owl_log_error("Unable to write to log file: %s (file %s, %u entries lost)",
+                  g_strerror(ret), f->filename, f->pending->len);
+  }
+  g_ptr_array_set_size(f->pending, 0);
+  owl_log_file_close(f);
+}
+
+/* Writes out every open file, closing them all if 'closing' is set. */
+static void owl_log_flush_files(bool closing)
+{
+  GList *l, *next;
+
+  if (flush_source) {
+    g_source_destroy(flush_source);
+    g_source_unref(flush_source);
+    flush_source = NULL;
+  }
+  for (l = open_file_lru.head; l; l = next) {
+    next = l->next;
+    owl_log_file_flush(l->data, closing);
+  }
+}
+
+static gboolean owl_log_flush_timeout(gpointer data)
+{
+  g_source_unref(flush_source);
+  flush_source = NULL;
+  owl_log_flush_files(false);
+  return FALSE;
+}
+
+/* Adds msg to the entries collected for f, writing them out if there
+ * are enough, and otherwise making sure they are written soon. */
+static void owl_log_file_add_entry(owl_log_file *f, owl_log_entry *msg)
+{
+  g_ptr_array_add(f->pending, owl_log_new_entry(msg->message, msg->filename));
+  f->pending_bytes += strlen(msg->message);
+  if (f->pending_bytes >= OWL_LOG_FLUSH_BYTES) {
+    owl_log_file_flush(f, false);
+  } else if (!flush_source) {
+    flush_source = g_timeout_source_new(OWL_LOG_FLUSH_MSEC);
+    g_source_set_callback(flush_source, owl_log_flush_timeout, NULL, NULL);
+    g_source_attach(flush_source, log_context);
+  }
+}
+
 /* If we are deferring log messages, enqueue this entry for writing.
  * Otherwise, try to write this log message, and, if it fails with
  * EPERM, EACCES, or ETIMEDOUT, go into deferred logging mode and
@@ -137,21 +363,16 @@ static void owl_log_file_error(owl_log_entry *msg, int errnum)
  * N.B. This function is called only on the disk-writing thread. */
 static void owl_log_eventually_write_entry(gpointer data)
 {
-  int ret;
+  int ret = 0;
   owl_log_entry *msg = (owl_log_entry*)data;
+  owl_log_file *f;
   if (defer_logs) {
     owl_log_deferred_enqueue_message(msg->message, msg->filename);
+  } else if ((f = owl_log_get_file(msg->filename, &ret)) != NULL) {
+    owl_log_file_add_entry(f, msg);
   } else {
-    ret = owl_log_try_write_entry(msg);
-    if (ret == EPERM || ret == EACCES || ret == ETIMEDOUT) {
-      defer_logs = true;
-      owl_log_error("Unable to open file for logging (%s): \n"
-                    "%s.  \n"
-                    "Consider renewing your tickets.  Logging has been \n"
-                    "suspended, and your messages will be saved.  To \n"
-                    "resume logging, use the command :flush-logs.\n\n",
-                    msg->filename,
-                    g_strerror(ret));
+    if (owl_log_is_deferrable_error(ret)) {
+      owl_log_start_deferring(msg->filename, ret);
       /* If we were not in deferred logging mode, either the queue should be
        * empty, or we are attempting to log a message that we just popped off
        * the head of the queue.  Either way, we should enqueue this message as
@@ -184,6 +405,10 @@ static void owl_log_write_deferred_entries(gpointer data)
     }
   }
 
+  /* start over with fresh descriptors, in case the old ones went
+   * stale along with the tickets, or the files were moved */
+  owl_log_flush_files(true);
+
   defer_logs = false;
   while (!g_queue_is_empty(deferred_entry_queue) && !defer_logs) {
     logged_message_count++;
@@ -203,6 +428,8 @@ static void owl_log_write_deferred_entries(gpointer data)
     }
     owl_log_entry_delete(entry);
   }
+  /* so that what is reported below is on disk */
+  owl_log_flush_files(false);
   if (logged_message_count > 0) {
     if (opts->display_initial_log_count) {
       /* first clear the "attempting to flush" message from the status bar */
@@ -292,6 +519,7 @@ static void owl_log_quit_func(gpointer data)
   opts.drop_failed_logs = true;
   opts.display_initial_log_count = false;
   owl_log_write_deferred_entries(&opts);
+  owl_log_flush_files(true);
 #if GLIB_CHECK_VERSION(2, 32, 0)
   g_queue_free_full(deferred_entry_queue, owl_log_entry_delete);
 #else
@@ -1,13 +1,23 @@
 #include "owl.h"
+#include <poll.h>
+
+/* longest the prefetcher may run before yielding to the main loop */
+#define OWL_MAINWIN_PREFETCH_SLICE_USEC 5000
 
 static void owl_mainwin_redraw(owl_window *w, WINDOW *recwin, void *user_data);
 static void owl_mainwin_resized(owl_window *w, void *user_data);
+static void owl_mainwin_start_prefetch(owl_mainwin *mw);
 
 CALLER_OWN owl_mainwin *owl_mainwin_new(owl_window *window)
 {
   owl_mainwin *mw = g_slice_new(owl_mainwin);
   mw->curtruncated=0;
   mw->lastdisplayed=-1;
+  mw->prefetch_source = 0;
+  mw->prefetch_dist = 0;
+  mw->drawn_serial = 0;
+  mw->drawn = g_array_new(false, false, sizeof(owl_mainwin_entry));
+  mw->layout = g_array_new(false, false, sizeof(owl_mainwin_entry));
   mw->window = g_object_ref(window);
   /* for now, just assume this object lasts forever */
   g_signal_connect(window, "redraw", G_CALLBACK(owl_mainwin_redraw), mw);
@@ -24,15 +34,15 @@ static void owl_mainwin_resized(owl_window *w, void *user_data)
 {
   owl_mainwin *mw = user_data;
 
-  /* in case any styles rely on the current width */
-  owl_messagelist_invalidate_formats(owl_global_get_msglist(&g));
+  /* formats are cached per terminal width, so styles relying on the
+   * width are rerun as messages come back on screen */
 
   /* recalculate the topmsg to make sure the current message is on
    * screen */
   owl_function_calculate_topmsg(OWL_DIRECTION_NONE);
 
-  /* Schedule a redraw */
-  owl_window_dirty(mw->window);
+  /* Schedule a redraw, of everything */
+  owl_mainwin_invalidate(mw);
 }
 
 void owl_mainwin_redisplay(owl_mainwin *mw)
@@ -40,20 +50,176 @@ void owl_mainwin_redisplay(owl_mainwin *mw)
   owl_window_dirty(mw->window);
 }
 
+/* Forgets what the window holds, so that the next redraw paints all
+ * of it, e.g. after color pairs have been reassigned. */
+void owl_mainwin_invalidate(owl_mainwin *mw)
+{
+  mw->drawn_serial = 0;
+  owl_window_dirty(mw->window);
+}
+
+/* Works out which messages go where on a window of recwinlines rows,
+ * into mw->layout. */
+static void owl_mainwin_layout(owl_mainwin *mw, const owl_view *v, int recwinlines)
+{
+  owl_mainwin_entry e;
+  owl_message *m;
+  int i, lines, y, isfull, viewsize;
+  int topmsg, curmsg, markedmsgid;
+
+  topmsg = owl_global_get_topmsg(&g);
+  curmsg = owl_global_get_curmsg(&g);
+  markedmsgid = owl_global_get_markedmsgid(&g);
+  viewsize = owl_view_get_size(v);
+
+  g_array_set_size(mw->layout, 0);
+  isfull=0;
+  mw->curtruncated=0;
+  mw->lasttruncated=0;
+
+  for (i=topmsg, y=0; i<viewsize; i++) {
+    if (isfull) break;
+    m=owl_view_get_element(v, i);
+    e.id = owl_message_get_id(m);
+    e.y = y;
+
+    /* if it's the current message, account for a vert_offset */
+    if (i==curmsg) {
+      e.start=owl_global_get_curmsg_vert_offset(&g);
+      lines=owl_message_get_numlines(m)-e.start;
+    } else {
+      e.start=0;
+      lines=owl_message_get_numlines(m);
+    }
+
+    /* if we match filters set the color */
+    owl_message_get_colors(m, &e.fgcolor, &e.bgcolor);
+
+    /* if we'll fill the screen print a partial message */
+    if ((y+lines > recwinlines) && (i==curmsg)) mw->curtruncated=1;
+    if (y+lines > recwinlines) mw->lasttruncated=1;
+    if (y+lines > recwinlines-1) {
+      isfull=1;
+      e.nrows = recwinlines-y;
+    } else {
+      e.nrows = MAX(lines, 0);
+    }
+    y += e.nrows;
+
+    /* is it the current message and/or deleted? */
+    e.mark[0] = e.mark[1] = e.mark[2] = '\0';
+    if (owl_global_get_rightshift(&g)==0) {   /* this lame and should be fixed */
+      if (i==curmsg) {
+        e.mark[0] = owl_global_get_curmsg_vert_offset(&g)>0 ? '+' : '-';
+        if (owl_message_is_delete(m)) {
+          e.mark[1] = 'D';
+        } else if (markedmsgid == owl_message_get_id(m)) {
+          e.mark[1] = '*';
+        } else {
+          e.mark[1] = '>';
+        }
+      } else if (owl_message_is_delete(m)) {
+        e.mark[0] = ' ';
+        e.mark[1] = 'D';
+      } else if (markedmsgid == owl_message_get_id(m)) {
+        e.mark[0] = ' ';
+        e.mark[1] = '*';
+      }
+    }
+
+    owl_message_format(m);
+    owl_message_pin_format(m);
+    e.serial = owl_message_get_format_serial(m);
+    g_array_append_val(mw->layout, e);
+  }
+  mw->lastdisplayed=i-1;
+}
+
+static bool owl_mainwin_entry_equal(const owl_mainwin_entry *a, const owl_mainwin_entry *b)
+{
+  return a->id == b->id && a->serial == b->serial && a->y == b->y &&
+    a->start == b->start && a->nrows == b->nrows &&
+    a->fgcolor == b->fgcolor && a->bgcolor == b->bgcolor &&
+    !strcmp(a->mark, b->mark);
+}
+
+/* If messages on the window are still to be shown, but higher or
+ * lower, scrolls the window to put them there, and moves the drawn
+ * entries with them. */
+static void owl_mainwin_scroll(owl_mainwin *mw, WINDOW *recwin, int recwinlines)
+{
+  owl_mainwin_entry *e, *d;
+  int i, j, shift = 0;
+  bool found = false;
+
+  for (i = 0; i < mw->layout->len && !found; i++) {
+    e = &g_array_index(mw->layout, owl_mainwin_entry, i);
+    for (j = 0; j < mw->drawn->len; j++) {
+      d = &g_array_index(mw->drawn, owl_mainwin_entry, j);
+      if (d->id == e->id) {
+        /* where the first line of the message was and now goes */
+        shift = (d->y - d->start) - (e->y - e->start);
+        found = true;
+        break;
+      }
+    }
+  }
+  if (shift == 0 || ABS(shift) >= recwinlines)
+    return;
+
+  scrollok(recwin, TRUE);
+  wscrl(recwin, shift);
+  scrollok(recwin, FALSE);
+
+  /* keep the entries still wholly on the window */
+  for (i = 0, j = 0; i < mw->drawn->len; i++) {
+    d = &g_array_index(mw->drawn, owl_mainwin_entry, i);
+    d->y -= shift;
+    if (d->y >= 0 && d->y + d->nrows <= recwinlines)
+      g_array_index(mw->drawn, owl_mainwin_entry, j++) = *d;
+  }
+  g_array_set_size(mw->drawn, j);
+}
+
+static void owl_mainwin_draw_entry(const owl_mainwin_entry *e, owl_message *m, WINDOW *recwin)
+{
+  int r;
+
+  for (r = 0; r < e->nrows; r++) {
+    wmove(recwin, e->y + r, 0);
+    wclrtoeol(recwin);
+  }
+  wmove(recwin, e->y, 0);
+  owl_message_curs_waddstr(m, recwin,
+                           e->start,
+                           e->start+e->nrows,
+                           owl_global_get_rightshift(&g),
+                           owl_global_get_cols(&g)+owl_global_get_rightshift(&g)-1,
+                           e->fgcolor, e->bgcolor);
+
+  wattrset(recwin, A_NORMAL);
+  if (e->mark[0]) {
+    wmove(recwin, e->y, 0);
+    /* the current message's mark is bold */
+    if (e->mark[0] != ' ') wattron(recwin, A_BOLD);
+    waddstr(recwin, e->mark);
+    wattroff(recwin, A_BOLD);
+  }
+}
+
+/* Draws the messages on the window.  What is already there from the
+ * last redraw is kept, scrolled if it moved, and only messages which
+ * are new to their rows or look different are painted. */
 static void owl_mainwin_redraw(owl_window *w, WINDOW *recwin, void *user_data)
 {
+  const owl_mainwin_entry *e, *d;
   owl_message *m;
-  int i, lines, isfull, viewsize;
-  int x, y, savey, recwinlines, start;
-  int topmsg, curmsg, markedmsgid, fgcolor, bgcolor;
+  int i, j, recwinlines, viewsize, topmsg, end;
   const owl_view *v;
-  GList *fl;
-  const owl_filter *f;
+  GArray *tmp;
   owl_mainwin *mw = user_data;
 
   topmsg = owl_global_get_topmsg(&g);
-  curmsg = owl_global_get_curmsg(&g);
-  markedmsgid = owl_global_get_markedmsgid(&g);
   v = owl_global_get_current_view(&g);
 
   if (v==NULL) {
@@ -61,114 +227,140 @@ static void owl_mainwin_redraw(owl_window *w, WINDOW *recwin, void *user_data)
     return;
   }
 
-  werase(recwin);
+  owl_message_unpin_formats();
 
   recwinlines=owl_global_get_recwin_lines(&g);
   viewsize=owl_view_get_size(v);
 
+  if (owl_window_get_serial(w) != mw->drawn_serial ||
+      recwinlines != mw->drawn_lines ||
+      owl_global_get_cols(&g) != mw->drawn_cols ||
+      owl_global_get_rightshift(&g) != mw->drawn_rightshift) {
+    /* let curses scroll with the terminal's own line operations */
+    idlok(recwin, TRUE);
+    werase(recwin);
+    g_array_set_size(mw->drawn, 0);
+    mw->drawn_serial = owl_window_get_serial(w);
+    mw->drawn_lines = recwinlines;
+    mw->drawn_cols = owl_global_get_cols(&g);
+    mw->drawn_rightshift = owl_global_get_rightshift(&g);
+  }
+
   /* if there are no messages or if topmsg is past the end of the messages,
    * just draw a blank screen */
   if (viewsize==0 || topmsg>=viewsize) {
     if (viewsize==0) {
       owl_global_set_topmsg(&g, 0);
     }
+    werase(recwin);
+    g_array_set_size(mw->drawn, 0);
     mw->curtruncated=0;
     mw->lastdisplayed=-1;
     return;
   }
 
-  /* write the messages out */
-  isfull=0;
-  mw->curtruncated=0;
-  mw->lasttruncated=0;
+  owl_mainwin_layout(mw, v, recwinlines);
+  owl_mainwin_scroll(mw, recwin, recwinlines);
 
-  for (i=topmsg; i<viewsize; i++) {
-    if (isfull) break;
-    m=owl_view_get_element(v, i);
+  /* write out the messages which aren't already there */
+  end = 0;
+  for (i = 0, j = 0; i < mw->layout->len; i++) {
+    e = &g_array_index(mw->layout, owl_mainwin_entry, i);
+    end = e->y + e->nrows;
+    while (j < mw->drawn->len && g_array_index(mw->drawn, owl_mainwin_entry, j).y < e->y)
+      j++;
+    d = j < mw->drawn->len ? &g_array_index(mw->drawn, owl_mainwin_entry, j) : NULL;
+    if (d && owl_mainwin_entry_equal(d, e))
+      continue;
+    m = owl_view_get_element(v, topmsg + i);
+    owl_mainwin_draw_entry(e, m, recwin);
+  }
+  if (end < recwinlines) {
+    wmove(recwin, end, 0);
+    wclrtobot(recwin);
+  }
 
-    /* hold on to y in case this is the current message or deleted */
-    getyx(recwin, y, x);
-    savey=y;
+  tmp = mw->drawn;
+  mw->drawn = mw->layout;
+  mw->layout = tmp;
 
-    /* if it's the current message, account for a vert_offset */
-    if (i==owl_global_get_curmsg(&g)) {
-      start=owl_global_get_curmsg_vert_offset(&g);
-      lines=owl_message_get_numlines(m)-start;
-    } else {
-      start=0;
-      lines=owl_message_get_numlines(m);
-    }
+  owl_mainwin_start_prefetch(mw);
+}
 
-    /* if we match filters set the color */
-    fgcolor=OWL_COLOR_DEFAULT;
-    bgcolor=OWL_COLOR_DEFAULT;
-    for (fl = g.filterlist; fl; fl = g_list_next(fl)) {
-      f = fl->data;
-      if ((owl_filter_get_fgcolor(f)!=OWL_COLOR_DEFAULT) ||
-          (owl_filter_get_bgcolor(f)!=OWL_COLOR_DEFAULT)) {
-        if (owl_filter_message_match(f, m)) {
-          if (owl_filter_get_fgcolor(f)!=OWL_COLOR_DEFAULT) fgcolor=owl_filter_get_fgcolor(f);
-          if (owl_filter_get_bgcolor(f)!=OWL_COLOR_DEFAULT) bgcolor=owl_filter_get_bgcolor(f);
-	}
-      }
-    }
+/* Returns true if a key is waiting.  *hangup is set if stdin is gone,
+ * when there is no point waiting for keys. */
+static bool owl_mainwin_input_pending(bool *hangup)
+{
+  struct pollfd pfd;
 
-    /* if we'll fill the screen print a partial message */
-    if ((y+lines > recwinlines) && (i==owl_global_get_curmsg(&g))) mw->curtruncated=1;
-    if (y+lines > recwinlines) mw->lasttruncated=1;
-    if (y+lines > recwinlines-1) {
-      isfull=1;
-      owl_message_curs_waddstr(m, recwin,
-			       start,
-			       start+recwinlines-y,
-			       owl_global_get_rightshift(&g),
-			       owl_global_get_cols(&g)+owl_global_get_rightshift(&g)-1,
-			       fgcolor, bgcolor);
-    } else {
-      /* otherwise print the whole thing */
-      owl_message_curs_waddstr(m, recwin,
-			       start,
-			       start+lines,
-			       owl_global_get_rightshift(&g),
-			       owl_global_get_cols(&g)+owl_global_get_rightshift(&g)-1,
-			       fgcolor, bgcolor);
-    }
+  pfd.fd = STDIN_FILENO;
+  pfd.events = POLLIN;
+  pfd.revents = 0;
+  *hangup = false;
+  if (poll(&pfd, 1, 0) <= 0)
+    return false;
+  *hangup = (pfd.revents & (POLLHUP | POLLERR | POLLNVAL)) != 0;
+  return (pfd.revents & POLLIN) != 0;
+}
 
+/* Formats the messages just above and below the screen while BarnOwl
+ * is otherwise idle, so that scrolling finds them already formatted.
+ * Works in short slices and gives way as soon as a key is pressed;
+ * the next redraw starts it over around the new screen.  What it
+ * formats is pinned along with the screen until then, so it pushes
+ * out older formats but never its own work. */
+static gboolean owl_mainwin_prefetch(gpointer data)
+{
+  owl_mainwin *mw = data;
+  owl_view *v = owl_global_get_current_view(&g);
+  const owl_fmtext_cache_stats *stats = owl_message_get_fmtext_cache_stats();
+  size_t budget = (size_t)owl_global_get_format_cache_size(&g) * 1024;
+  gint64 deadline = g_get_monotonic_time() + OWL_MAINWIN_PREFETCH_SLICE_USEC;
+  int limit = owl_global_get_format_prefetch(&g);
+  int topmsg = owl_global_get_topmsg(&g);
+  int size = owl_view_get_size(v);
+  int i, idx[2];
+  bool pending, hangup;
+  owl_message *m;
 
-    /* is it the current message and/or deleted? */
-    getyx(recwin, y, x);
-    wattrset(recwin, A_NORMAL);
-    if (owl_global_get_rightshift(&g)==0) {   /* this lame and should be fixed */
-      if (m==owl_view_get_element(v, curmsg)) {
-	wmove(recwin, savey, 0);
-	wattron(recwin, A_BOLD);	
-	if (owl_global_get_curmsg_vert_offset(&g)>0) {
-	  waddstr(recwin, "+");
-	} else {
-	  waddstr(recwin, "-");
-	}
-	if (owl_message_is_delete(m)) {
-	  waddstr(recwin, "D");
-	} else if (markedmsgid == owl_message_get_id(m)) {
-	  waddstr(recwin, "*");
-	} else {
-	  waddstr(recwin, ">");
-	}
-	wmove(recwin, y, x);
-	wattroff(recwin, A_BOLD);
-      } else if (owl_message_is_delete(m)) {
-	wmove(recwin, savey, 0);
-	waddstr(recwin, " D");
-	wmove(recwin, y, x);
-      } else if (markedmsgid == owl_message_get_id(m)) {
-	wmove(recwin, savey, 0);
-	waddstr(recwin, " *");
-	wmove(recwin, y, x);
-      }
+  while (mw->prefetch_dist < limit) {
+    pending = owl_mainwin_input_pending(&hangup);
+    /* with stdin gone this would be ready to run forever */
+    if (hangup)
+      break;
+    if (pending || g_get_monotonic_time() > deadline)
+      return TRUE;
+
+    mw->prefetch_dist++;
+    idx[0] = (mw->lastdisplayed < 0 ? topmsg : mw->lastdisplayed) + mw->prefetch_dist;
+    idx[1] = topmsg - mw->prefetch_dist;
+    if (idx[0] >= size && idx[1] < 0)
+      break;
+    for (i = 0; i < 2; i++) {
+      if (idx[i] < 0 || idx[i] >= size) continue;
+      m = owl_view_get_element(v, idx[i]);
+      if (!owl_message_is_formatted(m))
+        owl_message_format(m);
+      owl_message_pin_format(m);
     }
-    wattroff(recwin, A_BOLD);
+
+    /* only the screen and what we prefetched are left; any more would
+     * push those out */
+    if (stats->bytes > budget)
+      break;
   }
-  mw->lastdisplayed=i-1;
+
+  mw->prefetch_source = 0;
+  return FALSE;
+}
+
+static void owl_mainwin_start_prefetch(owl_mainwin *mw)
+{
+  mw->prefetch_dist = 0;
+  if (mw->prefetch_source || owl_global_get_format_prefetch(&g) <= 0)
+    return;
+  mw->prefetch_source = g_idle_add_full(G_PRIORITY_LOW, owl_mainwin_prefetch,
+                                        mw, NULL);
 }
 
 
@@ -1,54 +1,212 @@
 #include "owl.h"
-#include "filterproc.h"
 #include <sys/socket.h>
 #include <arpa/inet.h>
 
-static owl_fmtext_cache fmtext_cache[OWL_FMTEXT_CACHE_SIZE];
-static owl_fmtext_cache * fmtext_cache_next = fmtext_cache;
+static GQueue fmtext_lru = G_QUEUE_INIT;       /* most recent first */
+static owl_fmtext_cache_stats fmtext_stats;
+static unsigned int fmtext_pin_epoch;
+static unsigned int fmtext_serial;
+/* the color generation colors_cacheable was worked out for */
+static int colors_generation = -1;
+static bool colors_cacheable;
 
-void owl_message_init_fmtext_cache(void)
+/* Unpins every formatted message; see owl_message_pin_format. */
+void owl_message_unpin_formats(void)
 {
-    int i;
-    for(i = 0; i < OWL_FMTEXT_CACHE_SIZE; i++) {
-        owl_fmtext_init_null(&(fmtext_cache[i].fmtext));
-        fmtext_cache[i].message = NULL;
-    }
+  fmtext_pin_epoch++;
 }
 
-static owl_fmtext_cache *owl_message_next_fmtext(void)
+/* Keeps m's formatted text from being evicted until the next
+ * owl_message_unpin_formats, e.g. while m is on screen. */
+void owl_message_pin_format(owl_message *m)
 {
-    owl_fmtext_cache * f = fmtext_cache_next;
-    if(fmtext_cache_next->message != NULL) {
-        owl_message_invalidate_format(fmtext_cache_next->message);
-    }
-    fmtext_cache_next++;
-    if(fmtext_cache_next - fmtext_cache == OWL_FMTEXT_CACHE_SIZE)
-        fmtext_cache_next = fmtext_cache;
-    return f;
+  if (m->fmtext)
+    m->fmtext->pin_epoch = fmtext_pin_epoch;
 }
 
-void owl_message_init(owl_message *m)
+const owl_fmtext_cache_stats *owl_message_get_fmtext_cache_stats(void)
 {
-  /* ctime_r requires a 26-byte buffer */
-  char timestr[26];
+  return &fmtext_stats;
+}
+
+static void owl_message_drop_fmtext(owl_message *m);
+
+/* Evicts least recently used formats until we are within budget.
+ * Pinned formats and the most recent one, which a caller is about to
+ * use, are kept regardless. */
+static void owl_message_trim_fmtext_cache(void)
+{
+  size_t budget = (size_t)owl_global_get_format_cache_size(&g) * 1024;
+  owl_fmtext_cache *c;
+  GList *l, *prev;
+
+  for (l = fmtext_lru.tail; l != fmtext_lru.head && fmtext_stats.bytes > budget; l = prev) {
+    prev = l->prev;
+    c = l->data;
+    if (c->pin_epoch == fmtext_pin_epoch)
+      continue;
+    fmtext_stats.evictions++;
+    owl_message_drop_fmtext(c->message);
+  }
+}
 
+void owl_message_init(owl_message *m)
+{
   m->id=owl_global_get_nextmsgid(&g);
   owl_message_set_direction_none(m);
   m->delete=0;
 
-#ifdef HAVE_LIBZEPHYR
-  m->has_notice = false;
-#endif
+  m->notice = NULL;
 
+  m->hostname = NULL;
   owl_message_set_hostname(m, "");
-  m->attributes = g_ptr_array_new();
+  memset(m->fields, 0, sizeof(m->fields));
+  m->spill_offset = -1;
+  m->spill_len = 0;
+  m->plainbody = NULL;
+  m->textsig = NULL;
+  m->textsig_words = 0;
+  m->attributes = NULL;
   
   /* save the time */
-  m->time = time(NULL);
-  ctime_r(&m->time, timestr);
-  m->timestr = g_strndup(timestr, strlen(timestr) - 1);
+  m->timestr = NULL;
+  owl_message_set_time(m, time(NULL));
 
+  m->colors_generation = -1;
+  m->decrypt_job = NULL;
   m->fmtext = NULL;
+  m->numlines = 0;
+  m->numlines_style = NULL;
+  m->numlines_width = 0;
+}
+
+static const char *const owl_message_field_names[OWL_MESSAGE_NFIELDS] = {
+  "class", "instance", "sender", "recipient", "realm",
+  "opcode", "body", "zsig", "type",
+};
+
+/* Returns the slot of the attribute 'key' in m->fields, or -1 if it
+ * goes in m->attributes */
+static int owl_message_field_slot(GQuark key)
+{
+  static GQuark quarks[OWL_MESSAGE_NFIELDS];
+  int i;
+
+  if (!quarks[0]) {
+    for (i = 0; i < OWL_MESSAGE_NFIELDS; i++)
+      quarks[i] = g_quark_from_static_string(owl_message_field_names[i]);
+  }
+  for (i = 0; i < OWL_MESSAGE_NFIELDS; i++) {
+    if (quarks[i] == key) return i;
+  }
+  return -1;
+}
+
+/* Binary search of m->attributes. Returns the index of 'key', or
+ * the index it should be inserted at if absent. */
+static int owl_message_find_attribute(const owl_message *m, GQuark key, bool *found)
+{
+  const owl_message_attribute *a;
+  int lo = 0, hi = m->attributes ? m->attributes->len : 0, mid;
+
+  *found = false;
+  while (lo < hi) {
+    mid = (lo + hi) / 2;
+    a = &g_array_index(m->attributes, owl_message_attribute, mid);
+    if (a->key == key) {
+      *found = true;
+      return mid;
+    } else if (a->key < key) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+/* Fields which repeat across many messages are shared through the
+ * string pool rather than copied into each message. */
+static const bool owl_message_field_pooled[OWL_MESSAGE_NFIELDS] = {
+  [OWL_MESSAGE_FIELD_CLASS] = true,
+  [OWL_MESSAGE_FIELD_INSTANCE] = true,
+  [OWL_MESSAGE_FIELD_SENDER] = true,
+  [OWL_MESSAGE_FIELD_REALM] = true,
+  [OWL_MESSAGE_FIELD_OPCODE] = true,
+  [OWL_MESSAGE_FIELD_TYPE] = true,
+};
+
+static void owl_message_clear_field(owl_message *m, int slot)
+{
+  if (owl_message_field_pooled[slot])
+    owl_strpool_unref(m->fields[slot]);
+  else
+    g_free((char *)m->fields[slot]);
+  m->fields[slot] = NULL;
+}
+
+/* Works out m->plainbody from the body as it is in memory; searches
+ * then needn't strip the formatting. */
+void owl_message_strip_body(owl_message *m)
+{
+  const char *body = m->fields[OWL_MESSAGE_FIELD_BODY];
+
+  g_free(m->plainbody);
+  m->plainbody = NULL;
+  if (body && strchr(body, '@')) {
+    m->plainbody = owl_function_ztext_stylestrip(body);
+    if (!strcmp(m->plainbody, body)) {
+      g_free(m->plainbody);
+      m->plainbody = NULL;
+    }
+  }
+}
+
+/* Drops what can be worked out again from m's body and packet, as the
+ * body goes out to the message store.  The packet itself stays. */
+void owl_message_drop_body_caches(owl_message *m)
+{
+  g_free(m->plainbody);
+  m->plainbody = NULL;
+#ifdef HAVE_LIBZEPHYR
+  if (m->notice)
+    owl_zephyr_notice_drop_utf8(m->notice);
+#endif
+}
+
+static void owl_message_set_field(owl_message *m, int slot, const char *value)
+{
+  char *converted = owl_validate_or_convert(value);
+
+  owl_message_clear_field(m, slot);
+  owl_message_clear_textsig(m);
+  m->colors_generation = -1;
+  if (slot == OWL_MESSAGE_FIELD_BODY)
+    m->spill_offset = -1;
+  if (owl_message_field_pooled[slot] && converted) {
+    m->fields[slot] = owl_strpool_ref(converted);
+    g_free(converted);
+  } else {
+    m->fields[slot] = converted;
+  }
+  if (slot == OWL_MESSAGE_FIELD_BODY)
+    owl_message_strip_body(m);
+}
+
+/* Returns a core field, NULL if unset.  Bodies are brought back from
+ * the message store here; that doesn't change the message as far as
+ * callers can tell, hence the cast. */
+static const char *owl_message_peek_field(const owl_message *m, int slot)
+{
+  if (slot == OWL_MESSAGE_FIELD_BODY && !m->fields[slot] && m->spill_offset >= 0)
+    owl_msgstore_load((owl_message *)m);
+  return m->fields[slot];
+}
+
+static const char *owl_message_get_field(const owl_message *m, int slot)
+{
+  const char *value = owl_message_peek_field(m, slot);
+  return value ? value : "";
 }
 
 /* add the named attribute to the message.  If an attribute with the
@@ -56,27 +214,31 @@ void owl_message_init(owl_message *m)
  */
 void owl_message_set_attribute(owl_message *m, const char *attrname, const char *attrvalue)
 {
-  int i;
-  owl_pair *p = NULL, *pair = NULL;
-
-  attrname = g_intern_string(attrname);
+  GQuark key = g_quark_from_string(attrname);
+  owl_message_attribute *a, new_attr;
+  int slot, i;
+  bool found;
 
-  /* look for an existing pair with this key, */
-  for (i = 0; i < m->attributes->len; i++) {
-    p = m->attributes->pdata[i];
-    if (owl_pair_get_key(p) == attrname) {
-      g_free(owl_pair_get_value(p));
-      pair = p;
-      break;
-    }
+  slot = owl_message_field_slot(key);
+  if (slot >= 0) {
+    owl_message_set_field(m, slot, attrvalue);
+    return;
   }
 
-  if(pair ==  NULL) {
-    pair = g_slice_new(owl_pair);
-    owl_pair_create(pair, attrname, NULL);
-    g_ptr_array_add(m->attributes, pair);
+  m->colors_generation = -1;
+  i = owl_message_find_attribute(m, key, &found);
+  if (found) {
+    a = &g_array_index(m->attributes, owl_message_attribute, i);
+    g_free(a->value);
+    a->value = owl_validate_or_convert(attrvalue);
+    return;
   }
-  owl_pair_set_value(pair, owl_validate_or_convert(attrvalue));
+
+  if (!m->attributes)
+    m->attributes = g_array_sized_new(false, false, sizeof(owl_message_attribute), 4);
+  new_attr.key = key;
+  new_attr.value = owl_validate_or_convert(attrvalue);
+  g_array_insert_val(m->attributes, i, new_attr);
 }
 
 /* return the value associated with the named attribute, or NULL if
@@ -84,29 +246,68 @@ void owl_message_set_attribute(owl_message *m, const char *attrname, const char
  */
 const char *owl_message_get_attribute_value(const owl_message *m, const char *attrname)
 {
-  int i;
-  owl_pair *p;
   GQuark quark;
 
   quark = g_quark_try_string(attrname);
   if (quark == 0)
     /* don't bother inserting into string table */
     return NULL;
-  attrname = g_quark_to_string(quark);
+  return owl_message_get_attribute_value_quark(m, quark);
+}
+
+/* like owl_message_get_attribute_value, for callers which already
+ * hold the quark of the attribute name */
+const char *owl_message_get_attribute_value_quark(const owl_message *m, GQuark key)
+{
+  int i;
+  bool found;
+
+  i = owl_message_field_slot(key);
+  if (i >= 0) return owl_message_peek_field(m, i);
+
+  i = owl_message_find_attribute(m, key, &found);
+  if (!found) return NULL;
+  return g_array_index(m->attributes, owl_message_attribute, i).value;
+}
+
+/* Calls fn on each attribute of the message: the core fields which
+ * are set, in a fixed order, then the rest sorted by quark. */
+void owl_message_foreach_attribute(const owl_message *m, void (*fn)(const char *key, const char *value, void *data), void *data)
+{
+  const owl_message_attribute *a;
+  int i;
 
+  for (i = 0; i < OWL_MESSAGE_NFIELDS; i++) {
+    if (owl_message_peek_field(m, i))
+      fn(owl_message_field_names[i], m->fields[i], data);
+  }
+  if (!m->attributes) return;
   for (i = 0; i < m->attributes->len; i++) {
-    p = m->attributes->pdata[i];
-    if (owl_pair_get_key(p) == attrname) {
-      return(owl_pair_get_value(p));
-    }
+    a = &g_array_index(m->attributes, owl_message_attribute, i);
+    fn(g_quark_to_string(a->key), a->value, data);
   }
+}
 
-  /*
-  owl_function_debugmsg("No attribute %s found for message %i",
-			attrname,
-			owl_message_get_id(m));
-  */
-  return(NULL);
+static void owl_message_attribute_tofmtext(const char *key, const char *value, void *data)
+{
+  owl_fmtext *fm = data;
+  char *buff, *tmpbuff;
+
+  buff = g_strdup(value);
+  if (buff) {
+    tmpbuff = owl_text_indent(buff, 19, false);
+    g_free(buff);
+    buff = g_strdup_printf("  %-15.15s: %s\n", key, tmpbuff);
+    g_free(tmpbuff);
+  }
+
+  if(buff == NULL) {
+    buff = g_strdup_printf("  %-15.15s: %s\n", key, "<error>");
+    if(buff == NULL)
+      buff=g_strdup("   <error>\n");
+  }
+  owl_fmtext_append_normal(fm, buff);
+  g_free(buff);
 }
 
 /* We cheat and indent it for now, since we really want this for
@@ -114,40 +315,28 @@ const char *owl_message_get_attribute_value(const owl_message *m, const char *at
  * function to indent fmtext.
  */
 void owl_message_attributes_tofmtext(const owl_message *m, owl_fmtext *fm) {
-  int i;
-  owl_pair *p;
-  char *buff, *tmpbuff;
-
   owl_fmtext_init_null(fm);
+  owl_message_foreach_attribute(m, owl_message_attribute_tofmtext, fm);
+}
 
-  for (i = 0; i < m->attributes->len; i++) {
-    p = m->attributes->pdata[i];
-
-    buff = g_strdup(owl_pair_get_value(p));
-    if (buff) {
-      tmpbuff = owl_text_indent(buff, 19, false);
-      g_free(buff);
-      buff = g_strdup_printf("  %-15.15s: %s\n", owl_pair_get_key(p), tmpbuff);
-      g_free(tmpbuff);
-    }
+/* Throws away m's formatted text, but not its line count */
+static void owl_message_drop_fmtext(owl_message *m)
+{
+  owl_fmtext_cache *c = m->fmtext;
 
-    if(buff == NULL) {
-      buff = g_strdup_printf("  %-15.15s: %s\n", owl_pair_get_key(p), "<error>");
-      if(buff == NULL)
-        buff=g_strdup("   <error>\n");
-    }
-    owl_fmtext_append_normal(fm, buff);
-    g_free(buff);
-  }
+  if (!c) return;
+  g_queue_unlink(&fmtext_lru, &c->link);
+  fmtext_stats.entries--;
+  fmtext_stats.bytes -= c->size;
+  owl_fmtext_cleanup(&c->fmtext);
+  g_slice_free(owl_fmtext_cache, c);
+  m->fmtext = NULL;
 }
 
 void owl_message_invalidate_format(owl_message *m)
 {
-  if(m->fmtext) {
-    m->fmtext->message = NULL;
-    owl_fmtext_clear(&(m->fmtext->fmtext));
-    m->fmtext=NULL;
-  }
+  owl_message_drop_fmtext(m);
+  m->numlines_style = NULL;
 }
 
 owl_fmtext *owl_message_get_fmtext(owl_message *m)
@@ -156,135 +345,155 @@ owl_fmtext *owl_message_get_fmtext(owl_message *m)
   return(&(m->fmtext->fmtext));
 }
 
+/* Returns a number which changes whenever m's formatted text is made
+ * anew, or 0 if it has none. */
+unsigned int owl_message_get_format_serial(const owl_message *m)
+{
+  return m->fmtext ? m->fmtext->serial : 0;
+}
+
+/* Returns true if m has formatted text for the current style and
+ * terminal width, so owl_message_format won't need to run the style. */
+bool owl_message_is_formatted(const owl_message *m)
+{
+  const owl_fmtext_cache *c = m->fmtext;
+
+  return c &&
+    c->style == owl_view_get_style(owl_global_get_current_view(&g)) &&
+    c->width == owl_global_get_cols(&g);
+}
+
 void owl_message_format(owl_message *m)
 {
   const owl_style *s;
   const owl_view *v;
+  owl_fmtext_cache *c = m->fmtext;
+  int width = owl_global_get_cols(&g);
+
+  /* for now we assume there's just the one view and use that style */
+  v=owl_global_get_current_view(&g);
+  s=owl_view_get_style(v);
+
+  if (owl_message_is_formatted(m)) {
+    fmtext_stats.hits++;
+    g_queue_unlink(&fmtext_lru, &c->link);
+    g_queue_push_head_link(&fmtext_lru, &c->link);
+    return;
+  }
 
-  if (!m->fmtext) {
-    m->fmtext = owl_message_next_fmtext();
-    m->fmtext->message = m;
-    /* for now we assume there's just the one view and use that style */
-    v=owl_global_get_current_view(&g);
-    s=owl_view_get_style(v);
-
-    owl_style_get_formattext(s, &(m->fmtext->fmtext), m);
+  fmtext_stats.misses++;
+  if (c) {
+    g_queue_unlink(&fmtext_lru, &c->link);
+    fmtext_stats.bytes -= c->size;
+    owl_fmtext_clear(&c->fmtext);
+  } else {
+    c = g_slice_new0(owl_fmtext_cache);
+    c->message = m;
+    c->link.data = c;
+    owl_fmtext_init_null(&c->fmtext);
+    m->fmtext = c;
+    fmtext_stats.entries++;
   }
+  c->style = s;
+  c->width = width;
+  c->serial = ++fmtext_serial;
+  c->pin_epoch = fmtext_pin_epoch - 1;
+
+  /* c is off the LRU list while the style runs, so that nothing it
+   * formats can evict it */
+  owl_style_get_formattext(s, &c->fmtext, m);
+
+  m->numlines = owl_fmtext_num_lines(&c->fmtext);
+  m->numlines_style = s;
+  m->numlines_width = width;
+
+  c->size = sizeof(*c) + c->fmtext.buff->allocated_len +
+    owl_fmtext_build_index(&c->fmtext);
+  fmtext_stats.bytes += c->size;
+  g_queue_push_head_link(&fmtext_lru, &c->link);
+  owl_message_trim_fmtext_cache();
 }
 
 void owl_message_set_class(owl_message *m, const char *class)
 {
-  owl_message_set_attribute(m, "class", class);
+  owl_message_set_field(m, OWL_MESSAGE_FIELD_CLASS, class);
 }
 
 const char *owl_message_get_class(const owl_message *m)
 {
-  const char *class;
-
-  class=owl_message_get_attribute_value(m, "class");
-  if (!class) return("");
-  return(class);
+  return owl_message_get_field(m, OWL_MESSAGE_FIELD_CLASS);
 }
 
 void owl_message_set_instance(owl_message *m, const char *inst)
 {
-  owl_message_set_attribute(m, "instance", inst);
+  owl_message_set_field(m, OWL_MESSAGE_FIELD_INSTANCE, inst);
 }
 
 const char *owl_message_get_instance(const owl_message *m)
 {
-  const char *instance;
-
-  instance=owl_message_get_attribute_value(m, "instance");
-  if (!instance) return("");
-  return(instance);
+  return owl_message_get_field(m, OWL_MESSAGE_FIELD_INSTANCE);
 }
 
 void owl_message_set_sender(owl_message *m, const char *sender)
 {
-  owl_message_set_attribute(m, "sender", sender);
+  owl_message_set_field(m, OWL_MESSAGE_FIELD_SENDER, sender);
 }
 
 const char *owl_message_get_sender(const owl_message *m)
 {
-  const char *sender;
-
-  sender=owl_message_get_attribute_value(m, "sender");
-  if (!sender) return("");
-  return(sender);
+  return owl_message_get_field(m, OWL_MESSAGE_FIELD_SENDER);
 }
 
 void owl_message_set_zsig(owl_message *m, const char *zsig)
 {
-  owl_message_set_attribute(m, "zsig", zsig);
+  owl_message_set_field(m, OWL_MESSAGE_FIELD_ZSIG, zsig);
 }
 
 const char *owl_message_get_zsig(const owl_message *m)
 {
-  const char *zsig;
-
-  zsig=owl_message_get_attribute_value(m, "zsig");
-  if (!zsig) return("");
-  return(zsig);
+  return owl_message_get_field(m, OWL_MESSAGE_FIELD_ZSIG);
 }
 
 void owl_message_set_recipient(owl_message *m, const char *recip)
 {
-  owl_message_set_attribute(m, "recipient", recip);
+  owl_message_set_field(m, OWL_MESSAGE_FIELD_RECIPIENT, recip);
 }
 
 const char *owl_message_get_recipient(const owl_message *m)
 {
   /* this is stupid for outgoing messages, we need to fix it. */
-
-  const char *recip;
-
-  recip=owl_message_get_attribute_value(m, "recipient");
-  if (!recip) return("");
-  return(recip);
+  return owl_message_get_field(m, OWL_MESSAGE_FIELD_RECIPIENT);
 }
 
 void owl_message_set_realm(owl_message *m, const char *realm)
 {
-  owl_message_set_attribute(m, "realm", realm);
+  owl_message_set_field(m, OWL_MESSAGE_FIELD_REALM, realm);
 }
 
 const char *owl_message_get_realm(const owl_message *m)
 {
-  const char *realm;
-  
-  realm=owl_message_get_attribute_value(m, "realm");
-  if (!realm) return("");
-  return(realm);
+  return owl_message_get_field(m, OWL_MESSAGE_FIELD_REALM);
 }
 
 void owl_message_set_body(owl_message *m, const char *body)
 {
-  owl_message_set_attribute(m, "body", body);
+  owl_message_set_field(m, OWL_MESSAGE_FIELD_BODY, body);
 }
 
 const char *owl_message_get_body(const owl_message *m)
 {
-  const char *body;
-
-  body=owl_message_get_attribute_value(m, "body");
-  if (!body) return("");
-  return(body);
+  return owl_message_get_field(m, OWL_MESSAGE_FIELD_BODY);
 }
 
 
 void owl_message_set_opcode(owl_message *m, const char *opcode)
 {
-  owl_message_set_attribute(m, "opcode", opcode);
+  owl_message_set_field(m, OWL_MESSAGE_FIELD_OPCODE, opcode);
 }
 
 const char *owl_message_get_opcode(const owl_message *m)
 {
-  const char *opcode;
-
-  opcode=owl_message_get_attribute_value(m, "opcode");
-  if (!opcode) return("");
-  return(opcode);
+  return owl_message_get_field(m, OWL_MESSAGE_FIELD_OPCODE);
 }
 
 
@@ -343,6 +552,22 @@ int owl_message_is_private(const owl_message *m)
   return !strcmp(res, "true");
 }
 
+void owl_message_set_time(owl_message *m, time_t t)
+{
+  /* ctime_r requires a 26-byte buffer */
+  char timestr[26];
+
+  g_free(m->timestr);
+  m->time = t;
+  ctime_r(&m->time, timestr);
+  m->timestr = g_strndup(timestr, strlen(timestr) - 1);
+}
+
+time_t owl_message_get_time(const owl_message *m)
+{
+  return m->time;
+}
+
 const char *owl_message_get_timestr(const owl_message *m)
 {
   if (m->timestr) return(m->timestr);
@@ -357,26 +582,26 @@ CALLER_OWN char *owl_message_format_time(const owl_message *m)
 
 void owl_message_set_type_admin(owl_message *m)
 {
-  owl_message_set_attribute(m, "type", "admin");
+  owl_message_set_field(m, OWL_MESSAGE_FIELD_TYPE, "admin");
 }
 
 void owl_message_set_type_loopback(owl_message *m)
 {
-  owl_message_set_attribute(m, "type", "loopback");
+  owl_message_set_field(m, OWL_MESSAGE_FIELD_TYPE, "loopback");
 }
 
 void owl_message_set_type_zephyr(owl_message *m)
 {
-  owl_message_set_attribute(m, "type", "zephyr");
+  owl_message_set_field(m, OWL_MESSAGE_FIELD_TYPE, "zephyr");
 }
 
 void owl_message_set_type(owl_message *m, const char* type)
 {
-  owl_message_set_attribute(m, "type", type);
+  owl_message_set_field(m, OWL_MESSAGE_FIELD_TYPE, type);
 }
 
 int owl_message_is_type(const owl_message *m, const char *type) {
-  const char * t = owl_message_get_attribute_value(m, "type");
+  const char * t = m->fields[OWL_MESSAGE_FIELD_TYPE];
   if(!t) return 0;
   return !strcasecmp(t, type);
 }
@@ -449,20 +674,28 @@ int owl_message_is_direction_none(const owl_message *m)
 int owl_message_get_numlines(owl_message *m)
 {
   if (m == NULL) return(0);
-  owl_message_format(m);
-  return(owl_fmtext_num_lines(&(m->fmtext->fmtext)));
+  /* the count outlives the formatted text, so this usually doesn't
+   * need to run the style */
+  if (m->numlines_style != owl_view_get_style(owl_global_get_current_view(&g)) ||
+      m->numlines_width != owl_global_get_cols(&g))
+    owl_message_format(m);
+  return m->numlines;
 }
 
 void owl_message_mark_delete(owl_message *m)
 {
   if (m == NULL) return;
   m->delete=1;
+  m->colors_generation = -1;
+  owl_snapshot_note_delete(m);
 }
 
 void owl_message_unmark_delete(owl_message *m)
 {
   if (m == NULL) return;
   m->delete=0;
+  m->colors_generation = -1;
+  owl_snapshot_note_delete(m);
 }
 
 const char *owl_message_get_zwriteline(const owl_message *m)
@@ -484,10 +717,16 @@ int owl_message_is_delete(const owl_message *m)
   return(0);
 }
 
+/* True while m's body is a placeholder for the text being decrypted */
+bool owl_message_is_decrypting(const owl_message *m)
+{
+  return m->decrypt_job != NULL;
+}
+
 #ifdef HAVE_LIBZEPHYR
 const ZNotice_t *owl_message_get_notice(const owl_message *m)
 {
-  return m->has_notice ? &m->notice : NULL;
+  return m->notice ? &m->notice->notice : NULL;
 }
 #else
 void *owl_message_get_notice(const owl_message *m)
@@ -496,9 +735,17 @@ void *owl_message_get_notice(const owl_message *m)
 }
 #endif
 
+const owl_zephyr_notice *owl_message_get_zephyr_notice(const owl_message *m)
+{
+  return m->notice;
+}
+
 void owl_message_set_hostname(owl_message *m, const char *hostname)
 {
-  m->hostname = g_intern_string(hostname);
+  const char *old = m->hostname;
+
+  m->hostname = owl_strpool_ref(hostname);
+  owl_strpool_unref(old);
 }
 
 const char *owl_message_get_hostname(const owl_message *m)
@@ -506,23 +753,54 @@ const char *owl_message_get_hostname(const owl_message *m)
   return(m->hostname);
 }
 
+/* Finds the colors m is drawn in, from the last colored filter in the
+ * filter list it matches for each.  The answer is kept with m until a
+ * filter is added, removed or recolored or m changes, unless some
+ * colored filter calls perl. */
+void owl_message_get_colors(owl_message *m, int *fgcolor, int *bgcolor)
+{
+  int generation = owl_global_get_color_generation(&g);
+  const owl_filter *f;
+  GList *fl;
+
+  if (generation != colors_generation) {
+    colors_cacheable = true;
+    for (fl = g.filterlist; fl; fl = g_list_next(fl)) {
+      f = fl->data;
+      if ((owl_filter_get_fgcolor(f)!=OWL_COLOR_DEFAULT ||
+           owl_filter_get_bgcolor(f)!=OWL_COLOR_DEFAULT) &&
+          owl_filter_calls_perl(f))
+        colors_cacheable = false;
+    }
+    colors_generation = generation;
+  }
+
+  if (!colors_cacheable || m->colors_generation != generation) {
+    m->fgcolor=OWL_COLOR_DEFAULT;
+    m->bgcolor=OWL_COLOR_DEFAULT;
+    for (fl = g.filterlist; fl; fl = g_list_next(fl)) {
+      f = fl->data;
+      if ((owl_filter_get_fgcolor(f)!=OWL_COLOR_DEFAULT) ||
+          (owl_filter_get_bgcolor(f)!=OWL_COLOR_DEFAULT)) {
+        if (owl_filter_message_match(f, m)) {
+          if (owl_filter_get_fgcolor(f)!=OWL_COLOR_DEFAULT) m->fgcolor=owl_filter_get_fgcolor(f);
+          if (owl_filter_get_bgcolor(f)!=OWL_COLOR_DEFAULT) m->bgcolor=owl_filter_get_bgcolor(f);
+        }
+      }
+    }
+    m->colors_generation = generation;
+  }
+  *fgcolor = m->fgcolor;
+  *bgcolor = m->bgcolor;
+}
+
 void owl_message_curs_waddstr(owl_message *m, WINDOW *win, int aline, int bline, int acol, int bcol, int fgcolor, int bgcolor)
 {
-  owl_fmtext a, b;
-
   /* this will ensure that our cached copy is up to date */
   owl_message_format(m);
 
-  owl_fmtext_init_null(&a);
-  owl_fmtext_init_null(&b);
-  
-  owl_fmtext_truncate_lines(&(m->fmtext->fmtext), aline, bline-aline, &a);
-  owl_fmtext_truncate_cols(&a, acol, bcol, &b);
-
-  owl_fmtext_curs_waddstr(&b, win, OWL_FMTEXT_ATTR_NONE, fgcolor, bgcolor);
-
-  owl_fmtext_cleanup(&a);
-  owl_fmtext_cleanup(&b);
+  owl_fmtext_curs_waddstr_range(&(m->fmtext->fmtext), win, aline, bline-aline,
+                                acol, bcol, OWL_FMTEXT_ATTR_NONE, fgcolor, bgcolor);
 }
 
 int owl_message_is_personal(const owl_message *m)
@@ -618,7 +896,7 @@ int owl_message_get_id(const owl_message *m)
 }
 
 const char *owl_message_get_type(const owl_message *m) {
-  const char * type = owl_message_get_attribute_value(m, "type");
+  const char * type = m->fields[OWL_MESSAGE_FIELD_TYPE];
   if(!type) {
     return "generic";
   }
@@ -664,14 +942,51 @@ const char *owl_message_get_header(const owl_message *m) {
   return owl_message_get_attribute_value(m, "adminheader");
 }
 
+/* The fields searched in the fields search_scope */
+static const int owl_message_search_fields[] = {
+  OWL_MESSAGE_FIELD_SENDER,
+  OWL_MESSAGE_FIELD_RECIPIENT,
+  OWL_MESSAGE_FIELD_CLASS,
+  OWL_MESSAGE_FIELD_INSTANCE,
+  OWL_MESSAGE_FIELD_OPCODE,
+  OWL_MESSAGE_FIELD_REALM,
+  OWL_MESSAGE_FIELD_ZSIG,
+  OWL_MESSAGE_FIELD_BODY,
+};
+
+/* Returns the body as displayed, with zephyr formatting stripped */
+const char *owl_message_get_plain_body(const owl_message *m)
+{
+  /* bringing the body back works out plainbody again */
+  const char *body = owl_message_get_field(m, OWL_MESSAGE_FIELD_BODY);
+  return m->plainbody ? m->plainbody : body;
+}
+
 /* return 1 if the message contains "string", 0 otherwise.  This is
  * case insensitive because the functions it uses are
  */
 int owl_message_search(owl_message *m, const owl_regex *re)
 {
+  const char *value;
+  int i;
+
+  if (owl_global_get_search_scope(&g) == OWL_SEARCHSCOPE_FIELDS) {
+    /* the text signature rules most messages out cheaply */
+    if (owl_regex_get_literal(re) && !owl_message_may_contain(m, owl_regex_get_literal(re), true))
+      return 0;
+    for (i = 0; i < G_N_ELEMENTS(owl_message_search_fields); i++) {
+      if (owl_message_search_fields[i] == OWL_MESSAGE_FIELD_BODY)
+        value = owl_message_get_plain_body(m);
+      else
+        value = owl_message_peek_field(m, owl_message_search_fields[i]);
+      if (value && !owl_regex_compare(re, value, NULL, NULL))
+        return 1;
+    }
+    return 0;
+  }
 
   owl_message_format(m); /* is this necessary? */
-  
+
   return owl_fmtext_search(&(m->fmtext->fmtext), re, 0) >= 0;
 }
 
@@ -738,27 +1053,23 @@ void owl_message_create_from_znotice(owl_message *m, const ZNotice_t *n)
 #else /* !ZNOTICE_SOCKADDR */
   struct hostent *hent;
 #endif /* ZNOTICE_SOCKADDR */
-  /* ctime_r requires a 26-byte buffer */
-  char timestr[26], *tmp, *tmp2;
-  int len;
+  owl_zephyr_notice *zn;
+  char *tmp, *tmp2;
 
   owl_message_init(m);
   
   owl_message_set_type_zephyr(m);
   owl_message_set_direction_in(m);
   
-  /* first save the full notice */
-  m->notice = *n;
-  m->has_notice = true;
+  /* first take over the notice; its fields are read in place */
+  zn = m->notice = owl_zephyr_notice_new(n);
+  n = &zn->notice;
 
   /* a little gross, we'll replace \r's with ' ' for now */
-  owl_zephyr_hackaway_cr(&(m->notice));
+  owl_zephyr_hackaway_cr(&zn->notice);
   
-  /* save the time, we need to nuke the string saved by message_init */
-  if (m->timestr) g_free(m->timestr);
-  m->time = n->z_time.tv_sec;
-  ctime_r(&m->time, timestr);
-  m->timestr = g_strndup(timestr, strlen(timestr) - 1);
+  /* save the time */
+  owl_message_set_time(m, n->z_time.tv_sec);
 
   /* set other info */
   owl_message_set_sender(m, n->z_sender);
@@ -770,20 +1081,19 @@ void owl_message_create_from_znotice(owl_message *m, const ZNotice_t *n)
   } else {
     owl_message_set_opcode(m, "");
   }
-  owl_message_set_zsig(m, owl_zephyr_get_zsig(n, &len));
+  /* field 1 is the zsig, unless it's the only one */
+  if (owl_zephyr_notice_get_num_fields(zn) > 1)
+    owl_message_set_zsig(m, owl_zephyr_notice_get_field(zn, 1));
+  else
+    owl_message_set_zsig(m, "");
 
   owl_message_set_realm(m, zuser_realm(n->z_recipient));
 
   /* Set the "isloginout" attribute if it's a login message */
   if (!strcasecmp(n->z_class, "login") || !strcasecmp(n->z_class, OWL_WEBZEPHYR_CLASS)) {
     if (!strcasecmp(n->z_opcode, "user_login") || !strcasecmp(n->z_opcode, "user_logout")) {
-      tmp=owl_zephyr_get_field(n, 1);
-      owl_message_set_attribute(m, "loginhost", tmp);
-      g_free(tmp);
-
-      tmp=owl_zephyr_get_field(n, 3);
-      owl_message_set_attribute(m, "logintty", tmp);
-      g_free(tmp);
+      owl_message_set_attribute(m, "loginhost", owl_zephyr_notice_get_field(zn, 1));
+      owl_message_set_attribute(m, "logintty", owl_zephyr_notice_get_field(zn, 3));
     }
 
     if (!strcasecmp(n->z_opcode, "user_login")) {
@@ -820,7 +1130,7 @@ void owl_message_create_from_znotice(owl_message *m, const ZNotice_t *n)
 #endif /* ZNOTICE_SOCKADDR */
 
   /* set the body */
-  tmp=owl_zephyr_get_message(n, m);
+  tmp=owl_zephyr_get_message(zn, m);
   if (owl_global_is_newlinestrip(&g)) {
     tmp2=owl_util_stripnewlines(tmp);
     owl_message_set_body(m, tmp2);
@@ -830,39 +1140,9 @@ void owl_message_create_from_znotice(owl_message *m, const ZNotice_t *n)
   }
   g_free(tmp);
 
-  /* if zcrypt is enabled try to decrypt the message */
-  if (owl_global_is_zcrypt(&g) && !strcasecmp(n->z_opcode, "crypt")) {
-    const char *argv[] = {
-      NULL,
-      "-D",
-      "-c", owl_message_get_class(m),
-      "-i", owl_message_get_instance(m),
-      NULL
-    };
-    char *out = NULL;
-    int rv;
-    int status;
-    char *zcrypt;
-
-    zcrypt = g_build_filename(owl_get_bindir(), "zcrypt", NULL);
-    argv[0] = zcrypt;
-
-    rv = call_filter(argv, owl_message_get_body(m), &out, &status);
-    g_free(zcrypt);
-
-    if(!rv && !status) {
-      int len = strlen(out);
-      if(len >= 8 && !strcmp(out + len - 8, "**END**\n")) {
-        out[len - 8] = 0;
-      }
-      owl_message_set_body(m, out);
-    } else {
-      /* Replace the opcode. Otherwise the UI and other bits of code think the
-       * message was encrypted. */
-      owl_message_set_opcode(m, "failed-decrypt");
-    }
-    g_free(out);
-  }
+  /* if zcrypt is enabled, decrypt the message in the background */
+  if (owl_global_is_zcrypt(&g) && !strcasecmp(n->z_opcode, "crypt"))
+    owl_zcrypt_start(m);
 
   owl_message_save_ccs(m);
 }
@@ -877,10 +1157,6 @@ void owl_message_create_pseudo_zlogin(owl_message *m, int direction, const char
 {
   char *longuser;
 
-#ifdef HAVE_LIBZEPHYR
-  memset(&(m->notice), 0, sizeof(ZNotice_t));
-#endif
-  
   longuser=long_zuser(user);
   
   owl_message_init(m);
@@ -965,22 +1241,24 @@ void owl_message_create_from_zwrite(owl_message *m, const owl_zwrite *z, const c
 void owl_message_cleanup(owl_message *m)
 {
   int i;
-  owl_pair *p;
-#ifdef HAVE_LIBZEPHYR    
-  if (m->has_notice) {
-    ZFreeNotice(&(m->notice));
-  }
-#endif
+  owl_message_attribute *a;
+  if (m->notice) owl_zephyr_notice_delete(m->notice);
   if (m->timestr) g_free(m->timestr);
+  if (m->decrypt_job) owl_zcrypt_forget(m);
 
   /* free all the attributes */
-  for (i = 0; i < m->attributes->len; i++) {
-    p = m->attributes->pdata[i];
-    g_free(owl_pair_get_value(p));
-    g_slice_free(owl_pair, p);
+  for (i = 0; i < OWL_MESSAGE_NFIELDS; i++)
+    owl_message_clear_field(m, i);
+  owl_strpool_unref(m->hostname);
+  g_free(m->plainbody);
+  owl_message_clear_textsig(m);
+  if (m->attributes) {
+    for (i = 0; i < m->attributes->len; i++) {
+      a = &g_array_index(m->attributes, owl_message_attribute, i);
+      g_free(a->value);
+    }
+    g_array_free(m->attributes, true);
   }
-
-  g_ptr_array_free(m->attributes, true);
  
   owl_message_invalidate_format(m);
 }
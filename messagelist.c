@@ -66,6 +66,34 @@ void owl_messagelist_append_element(owl_messagelist *ml, void *element)
   g_ptr_array_add(ml->list, element);
 }
 
+/* Adds element to ml in message id order, unless it is there already */
+void owl_messagelist_insert_element(owl_messagelist *ml, owl_message *m)
+{
+  int first = 0, last = ml->list->len - 1, mid, id = owl_message_get_id(m);
+  int msg_id;
+
+  while (first <= last) {
+    mid = (first + last) / 2;
+    msg_id = owl_message_get_id(ml->list->pdata[mid]);
+    if (msg_id == id)
+      return;
+    else if (msg_id < id)
+      first = mid + 1;
+    else
+      last = mid - 1;
+  }
+  g_ptr_array_add(ml->list, m);
+  memmove(ml->list->pdata + first + 1, ml->list->pdata + first,
+          (ml->list->len - 1 - first) * sizeof(gpointer));
+  ml->list->pdata[first] = m;
+}
+
+/* Removes, without freeing, the n'th element of ml */
+void owl_messagelist_remove_element(owl_messagelist *ml, int n)
+{
+  g_ptr_array_remove_index(ml->list, n);
+}
+
 /* do we really still want this? */
 int owl_messagelist_delete_element(owl_messagelist *ml, int n)
 {
@@ -81,6 +109,18 @@ int owl_messagelist_undelete_element(owl_messagelist *ml, int n)
   return(0);
 }
 
+/* Removes, without freeing, every message in the set 'msgs'. */
+void owl_messagelist_remove_set(owl_messagelist *ml, GHashTable *msgs)
+{
+  int i, j;
+
+  for (i = j = 0; i < ml->list->len; i++) {
+    if (!g_hash_table_lookup(msgs, ml->list->pdata[i]))
+      ml->list->pdata[j++] = ml->list->pdata[i];
+  }
+  g_ptr_array_set_size(ml->list, j);
+}
+
 void owl_messagelist_delete_and_expunge_element(owl_messagelist *ml, int n)
 {
   owl_message_delete(g_ptr_array_remove_index(ml->list, n));
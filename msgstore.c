@@ -0,0 +1,166 @@
+#include "owl.h"
+#include <sys/mman.h>
+
+/* Bodies of all but the most recent messages are moved out to an
+ * append-only file, mapped into memory, and copied back in when
+ * something reads them.  The file is unlinked as soon as it is
+ * created, so it goes away with BarnOwl.  What is derived from a body
+ * goes with it, but a zephyr's packet, which perl and the info
+ * display read, and every message's text signature stay. */
+
+/* the mapping grows in steps of this many bytes */
+#define OWL_MSGSTORE_MAP_STEP (1 << 20)
+
+static int store_fd = -1;
+static bool store_failed = false;
+static gint64 store_size = 0;           /* bytes written */
+static char *store_map = NULL;
+static gint64 store_mapped = 0;         /* bytes mapped */
+static int store_last_id = -1;          /* messages up to this id were spilled */
+static GQueue store_warm = G_QUEUE_INIT; /* ids of bodies copied back in */
+static guint store_trim_source = 0;
+
+static bool owl_msgstore_open(void)
+{
+  char *path = NULL;
+  GError *err = NULL;
+
+  if (store_fd >= 0) return true;
+  if (store_failed) return false;
+
+  store_fd = g_file_open_tmp("barnowl-store-XXXXXX", &path, &err);
+  if (store_fd < 0) {
+    owl_function_error("Unable to create message store: %s", err->message);
+    g_error_free(err);
+    store_failed = true;
+    return false;
+  }
+  unlink(path);
+  g_free(path);
+  return true;
+}
+
+/* Moves m's body out to the store.  Returns false if it can't be. */
+bool owl_msgstore_spill(owl_message *m)
+{
+  const char *body = m->fields[OWL_MESSAGE_FIELD_BODY];
+  size_t len;
+  ssize_t ret;
+
+  if (!body) return true;
+  if (m->spill_offset < 0) {
+    if (!owl_msgstore_open()) return false;
+    len = strlen(body);
+    ret = pwrite(store_fd, body, len, store_size);
+    if (ret < 0 || (size_t)ret != len) {
+      owl_function_debugmsg("msgstore: short write: %s", strerror(errno));
+      return false;
+    }
+    m->spill_offset = store_size;
+    m->spill_len = len;
+    store_size += len;
+  }
+  g_free((char *)m->fields[OWL_MESSAGE_FIELD_BODY]);
+  m->fields[OWL_MESSAGE_FIELD_BODY] = NULL;
+  owl_message_drop_body_caches(m);
+  return true;
+}
+
+static bool owl_msgstore_map(gint64 end)
+{
+  gint64 size;
+  void *map;
+
+  if (end <= store_mapped) return true;
+  size = (store_size + OWL_MSGSTORE_MAP_STEP - 1) & ~(gint64)(OWL_MSGSTORE_MAP_STEP - 1);
+  if (ftruncate(store_fd, size) < 0)
+    return false;
+  map = mmap(NULL, size, PROT_READ, MAP_SHARED, store_fd, 0);
+  if (map == MAP_FAILED) {
+    owl_function_debugmsg("msgstore: mmap: %s", strerror(errno));
+    return false;
+  }
+  if (store_map)
+    munmap(store_map, store_mapped);
+  store_map = map;
+  store_mapped = size;
+  return true;
+}
+
+/* Spills the oldest bodies brought back in, beyond 'keep' of them */
+static void owl_msgstore_trim_warm(int keep)
+{
+  owl_messagelist *ml = owl_global_get_msglist(&g);
+  owl_message *m;
+
+  while (g_queue_get_length(&store_warm) > keep) {
+    m = owl_messagelist_get_by_id(ml, GPOINTER_TO_INT(g_queue_pop_head(&store_warm)));
+    /* it may have been expunged in the meantime */
+    if (m) owl_msgstore_spill(m);
+  }
+}
+
+static gboolean owl_msgstore_trim_idle(gpointer data)
+{
+  store_trim_source = 0;
+  owl_msgstore_trim_warm(owl_global_get_resident_messages(&g));
+  return FALSE;
+}
+
+/* Copies m's body back in from the store.  This is reached from
+ * getters, whose callers may hold on to other bodies, so the ones
+ * brought back in earlier are spilled again from an idle callback or
+ * by owl_msgstore_spill_old, never here. */
+void owl_msgstore_load(owl_message *m)
+{
+  gint64 end = m->spill_offset + m->spill_len;
+
+  if (m->fields[OWL_MESSAGE_FIELD_BODY] || m->spill_offset < 0) return;
+  if (!owl_msgstore_map(end)) {
+    m->fields[OWL_MESSAGE_FIELD_BODY] = g_strdup("");
+    return;
+  }
+  m->fields[OWL_MESSAGE_FIELD_BODY] = g_strndup(store_map + m->spill_offset, m->spill_len);
+  owl_message_strip_body(m);
+
+  /* when spilling is turned off, whatever comes back in stays */
+  if (owl_global_get_resident_messages(&g) <= 0) return;
+  g_queue_push_tail(&store_warm, GINT_TO_POINTER(owl_message_get_id(m)));
+  if (!store_trim_source)
+    store_trim_source = g_idle_add(owl_msgstore_trim_idle, NULL);
+}
+
+/* Returns the index in ml of the first message with an id above id */
+static int owl_msgstore_index_after(const owl_messagelist *ml, int id)
+{
+  int first = 0, last = owl_messagelist_get_size(ml) - 1, mid;
+
+  while (first <= last) {
+    mid = (first + last) / 2;
+    if (owl_message_get_id(owl_messagelist_get_element(ml, mid)) <= id)
+      first = mid + 1;
+    else
+      last = mid - 1;
+  }
+  return first;
+}
+
+/* Spills the bodies of all but the last resident_messages messages
+ * of ml, which is the global message list.  Where it got to is kept
+ * as a message id, which expunging doesn't move. */
+void owl_msgstore_spill_old(owl_messagelist *ml)
+{
+  int keep = owl_global_get_resident_messages(&g);
+  int end = owl_messagelist_get_size(ml) - keep;
+  owl_message *m;
+  int i;
+
+  if (keep <= 0) return;
+  owl_msgstore_trim_warm(keep);
+  for (i = owl_msgstore_index_after(ml, store_last_id); i < end; i++) {
+    m = owl_messagelist_get_element(ml, i);
+    if (!owl_msgstore_spill(m))
+      break;
+    store_last_id = owl_message_get_id(m);
+  }
+}
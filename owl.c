@@ -141,94 +141,97 @@ void owl_shutdown_curses(void) {
   tcsetattr(STDIN_FILENO, TCSAFLUSH, owl_global_get_startup_tio(&g));
 }
 
+/* Bounds on the work done per dispatch, so that keyboard input isn't
+ * starved while a flood of messages comes in. */
+#define OWL_PROCESS_BATCH_MAX  256
+#define OWL_PROCESS_BATCH_USEC 20000
+
 /*
- * Process a new message passed to us on the message queue from some
- * protocol. This includes adding it to the message list, updating the
- * view and scrolling if appropriate, logging it, and so on.
- *
- * Either a pointer is kept to the message internally, or it is freed
- * if unneeded. The caller no longer ``owns'' the message's memory.
- *
- * Returns 1 if the message was added to the message list, and 0 if it
- * was ignored due to user settings or otherwise.
+ * Returns false if the message should be dropped due to user settings.
  */
-static int owl_process_message(owl_message *m) {
-  const owl_filter *f;
-  /* if this message it on the puntlist, nuke it and continue */
-  if (owl_global_message_is_puntable(&g, m)) {
-    owl_message_delete(m);
-    return 0;
-  }
-
+static bool owl_process_message_is_wanted(const owl_message *m) {
   /*  login or logout that should be ignored? */
   if (owl_global_is_ignorelogins(&g)
       && owl_message_is_loginout(m)) {
-    owl_message_delete(m);
-    return 0;
+    return false;
   }
 
   if (!owl_global_is_displayoutgoing(&g)
       && owl_message_is_direction_out(m)) {
-    owl_message_delete(m);
-    return 0;
+    return false;
   }
+  return true;
+}
 
-  /* add it to the global list */
-  owl_messagelist_append_element(owl_global_get_msglist(&g), m);
-  /* add it to any necessary views; right now there's only the current view */
-  owl_view_consider_message(owl_global_get_current_view(&g), m);
-
-  if(owl_message_is_direction_in(m)) {
-    /* let perl know about it*/
-    owl_perlconfig_getmsg(m, NULL);
-
-    /* do we need to autoreply? */
-    if (owl_global_is_zaway(&g) && !owl_message_get_attribute_value(m, "isauto")) {
-      if (owl_message_is_type_zephyr(m)) {
-        owl_zephyr_zaway(m);
-      }
-    }
-
-    /* ring the bell if it's a personal */
-    if (!strcmp(owl_global_get_personalbell(&g), "on")) {
-      if (!owl_message_is_loginout(m) &&
-          !owl_message_is_mail(m) &&
-          owl_message_is_personal(m)) {
-        owl_function_beep();
-      }
-    } else if (!strcmp(owl_global_get_personalbell(&g), "off")) {
-      /* do nothing */
-    } else {
-      f=owl_global_get_filter(&g, owl_global_get_personalbell(&g));
-      if (f && owl_filter_message_match(f, m)) {
-        owl_function_beep();
+/*
+ * Process a batch of new messages passed to us on the message queue
+ * from some protocol. This includes adding them to the message list,
+ * updating the view, letting perl know about them, and so on.
+ *
+ * Either a pointer is kept to each message internally, or it is freed
+ * if unneeded. The caller no longer ``owns'' the messages' memory.
+ * On return msgs holds the messages which were added to the message
+ * list; the others were ignored due to user settings or otherwise.
+ */
+static void owl_process_messages(GPtrArray *msgs) {
+  const GPtrArray *pl = owl_global_get_puntlist(&g);
+  GPtrArray *ready = msgs;
+  owl_message *m;
+  int i, j, fgcolor, bgcolor, decrypting = 0;
+
+  /* nuke anything on the puntlist. Each punt filter goes over the
+   * whole batch in turn, rather than each message over the list. */
+  for (i = 0; i < pl->len; i++) {
+    for (j = 0; j < msgs->len; j++) {
+      if (msgs->pdata[j] && owl_filter_message_match(pl->pdata[i], msgs->pdata[j])) {
+        owl_message_delete(msgs->pdata[j]);
+        msgs->pdata[j] = NULL;
       }
     }
+  }
 
-    /* if it matches the alert filter, do the alert action */
-    f=owl_global_get_filter(&g, owl_global_get_alert_filter(&g));
-    if (f && owl_filter_message_match(f, m)) {
-      owl_function_command_norv(owl_global_get_alert_action(&g));
+  for (i = j = 0; i < msgs->len; i++) {
+    m = msgs->pdata[i];
+    if (!m) continue;
+    if (!owl_process_message_is_wanted(m)) {
+      owl_message_delete(m);
+      continue;
     }
 
-    /* if it's a zephyr login or logout, update the zbuddylist */
-    if (owl_message_is_type_zephyr(m) && owl_message_is_loginout(m)) {
-      if (owl_message_is_login(m)) {
-        owl_zbuddylist_adduser(owl_global_get_zephyr_buddylist(&g), owl_message_get_sender(m));
-      } else if (owl_message_is_logout(m)) {
-        owl_zbuddylist_deluser(owl_global_get_zephyr_buddylist(&g), owl_message_get_sender(m));
-      } else {
-        owl_function_error("Internal error: received login notice that is neither login nor logout");
-      }
-    }
+    /* add it to the global list */
+    owl_messagelist_append_element(owl_global_get_msglist(&g), m);
+    /* add it to any necessary views; right now there's only the current view */
+    owl_view_consider_message(owl_global_get_current_view(&g), m);
+    /* and work out its colors while the filters are warm */
+    owl_message_get_colors(m, &fgcolor, &bgcolor);
+
+    /* the rest waits for decrypting messages to be decrypted; see
+     * zdecrypt.c */
+    if (owl_message_is_decrypting(m))
+      decrypting++;
+    else if (owl_message_is_direction_in(m))
+      owl_function_incoming_message(m);
+    msgs->pdata[j++] = m;
   }
-
-  /* let perl know about it */
-  owl_perlconfig_newmsg(m, NULL);
+  g_ptr_array_set_size(msgs, j);
+  owl_snapshot_add_messages(msgs);
+  owl_msgstore_spill_old(owl_global_get_msglist(&g));
+  if (msgs->len)
+    owl_textindex_start();
+
+  /* let perl know about them */
+  if (decrypting) {
+    ready = g_ptr_array_sized_new(msgs->len - decrypting);
+    for (i = 0; i < msgs->len; i++)
+      if (!owl_message_is_decrypting(msgs->pdata[i]))
+        g_ptr_array_add(ready, msgs->pdata[i]);
+  }
+  owl_perlconfig_new_messages(ready);
+  if (ready != msgs)
+    g_ptr_array_free(ready, true);
   /* redraw the sepbar; TODO: don't violate layering */
-  owl_global_sepbar_dirty(&g);
-
-  return 1;
+  if (msgs->len)
+    owl_global_sepbar_dirty(&g);
 }
 
 static gboolean owl_process_messages_prepare(GSource *source, int *timeout) {
@@ -241,19 +244,28 @@ static gboolean owl_process_messages_check(GSource *source) {
 }
 
 /*
- * Process any new messages we have waiting in the message queue.
+ * Process any new messages we have waiting in the message queue, in
+ * batches, until it is empty or we have run for long enough. Whatever
+ * is left is picked up on the next main loop iteration.
  */
 static gboolean owl_process_messages_dispatch(GSource *source, GSourceFunc callback, gpointer user_data) {
   int newmsgs=0;
   int followlast = owl_global_should_followlast(&g);
-  owl_message *m;
+  int oldsize = owl_view_get_size(owl_global_get_current_view(&g));
+  gint64 deadline = g_get_monotonic_time() + OWL_PROCESS_BATCH_USEC;
+  GPtrArray *batch = g_ptr_array_sized_new(OWL_PROCESS_BATCH_MAX);
 
   /* Grab incoming messages. */
-  while (owl_global_messagequeue_pending(&g)) {
-    m = owl_global_messagequeue_popmsg(&g);
-    if (owl_process_message(m))
+  do {
+    g_ptr_array_set_size(batch, 0);
+    while (batch->len < OWL_PROCESS_BATCH_MAX && owl_global_messagequeue_pending(&g))
+      g_ptr_array_add(batch, owl_global_messagequeue_popmsg(&g));
+    owl_process_messages(batch);
+    if (batch->len)
       newmsgs = 1;
-  }
+  } while (owl_global_messagequeue_pending(&g) &&
+           g_get_monotonic_time() < deadline);
+  g_ptr_array_free(batch, true);
 
   if (newmsgs) {
     /* follow the last message if we're supposed to */
@@ -263,9 +275,10 @@ static gboolean owl_process_messages_dispatch(GSource *source, GSourceFunc callb
     /* do the newmsgproc thing */
     owl_function_do_newmsgproc();
 
-    /* redisplay if necessary */
-    /* this should be optimized to not run if the new messages won't be displayed */
-    owl_mainwin_redisplay(owl_global_get_mainwin(&g));
+    /* redisplay if the new messages may be on screen; the main
+     * window only repaints rows which changed */
+    if (followlast || owl_mainwin_get_last_msg(owl_global_get_mainwin(&g)) >= oldsize - 1)
+      owl_mainwin_redisplay(owl_global_get_mainwin(&g));
   }
   return TRUE;
 }
@@ -606,6 +619,10 @@ int main(int argc, char **argv, char **env)
   g_source_unref(source);
 
   owl_log_init();
+  /* bring back the saved history, now that the punt list is set up */
+  owl_snapshot_load();
+  owl_snapshot_start();
+  owl_textindex_start();
 
   owl_function_debugmsg("startup: entering main loop");
   owl_select_run_loop();
@@ -615,5 +632,6 @@ int main(int argc, char **argv, char **env)
   owl_signal_shutdown();
   owl_shutdown_curses();
   owl_log_shutdown();
+  owl_snapshot_shutdown();
   return 0;
 }
@@ -28,6 +28,10 @@
 #include <fcntl.h>
 #include <netdb.h>
 #include <regex.h>
+#ifdef HAVE_PCRE2
+#define PCRE2_CODE_UNIT_WIDTH 8
+#include <pcre2.h>
+#endif
 #include <time.h>
 #include <signal.h>
 #include <stdlib.h>
@@ -126,6 +130,9 @@ extern const char *version;
 #define OWL_SCROLLMODE_PAGED       4
 #define OWL_SCROLLMODE_PAGEDCENTER 5
 
+#define OWL_SEARCHSCOPE_FIELDS     0
+#define OWL_SEARCHSCOPE_FORMATTED  1
+
 #define OWL_TAB               3  /* This *HAS* to be the size of TABSTR below */
 #define OWL_TABSTR        "   "
 #define OWL_MSGTAB            7
@@ -161,6 +168,7 @@ extern const char *version;
 #define OWL_OUTPUT_ADMINMSG     2
 
 #define OWL_FILTER_MAX_DEPTH    300
+#define OWL_FILTER_MAX_PROGRAM  16384  /* instructions, once inlined */
 
 #define OWL_KEYMAP_MAXSTACK     20
 
@@ -182,6 +190,11 @@ extern const char *version;
 #define OWL_ZEPHYR_NOSTRIP_DAEMON4      "daemon."
 
 #define OWL_REGEX_QUOTECHARS    "!+*.?[]^\\${}()|"
+#define OWL_REGEX_METACHARS     "+*.?[]^\\${}()|"
+/* what class and instance filters put around a name to take in its
+ * un- and .d variants */
+#define OWL_REGEX_UN_PREFIX     "^(un)*"
+#define OWL_REGEX_D_SUFFIX      "(\\.d)*$"
 #define OWL_REGEX_QUOTEWITH     "\\"
 
 #if defined(HAVE_DES_STRING_TO_KEY) && defined(HAVE_DES_KEY_SCHED) && defined(HAVE_DES_ECB_ENCRYPT)
@@ -255,19 +268,23 @@ typedef struct _owl_input {
   gunichar uch;
 } owl_input;
 
+typedef struct _owl_fmtext_index owl_fmtext_index;
+
 typedef struct _owl_fmtext {
   GString *buff;
+  owl_fmtext_index *index;      /* for drawing, or NULL; see fmtext.c */
 } owl_fmtext;
 
 typedef struct _owl_dict_el {
-  char *k;			/* key   */
+  char *k;			/* key, or NULL for an empty slot */
   void *v;			/* value */
+  guint hash;			/* g_str_hash of k */
 } owl_dict_el;
 
 typedef struct _owl_dict {
   int size;
-  int avail;
-  owl_dict_el *els;		/* invariant: sorted by k */
+  int avail;			/* slots, a power of two */
+  owl_dict_el *els;		/* open-addressed by hash */
 } owl_dict;
 typedef owl_dict owl_vardict;	/* dict of variables */
 typedef owl_dict owl_cmddict;	/* dict of commands */
@@ -336,39 +353,143 @@ typedef struct _owl_pair {
 
 struct _owl_fmtext_cache;
 
-typedef struct _owl_message {
-  int id;
-  int direction;
+/* Attributes which get a slot of their own in owl_message */
+#define OWL_MESSAGE_FIELD_CLASS     0
+#define OWL_MESSAGE_FIELD_INSTANCE  1
+#define OWL_MESSAGE_FIELD_SENDER    2
+#define OWL_MESSAGE_FIELD_RECIPIENT 3
+#define OWL_MESSAGE_FIELD_REALM     4
+#define OWL_MESSAGE_FIELD_OPCODE    5
+#define OWL_MESSAGE_FIELD_BODY      6
+#define OWL_MESSAGE_FIELD_ZSIG      7
+#define OWL_MESSAGE_FIELD_TYPE      8
+#define OWL_MESSAGE_NFIELDS         9
+
+typedef struct _owl_strpool_stats {
+  unsigned long lookups;
+  unsigned long hits;
+  unsigned int strings;         /* distinct strings in the pool */
+  size_t bytes_used;            /* held by those strings */
+  size_t bytes_saved;           /* by sharing rather than copying */
+} owl_strpool_stats;
+
+typedef struct _owl_message_attribute {
+  GQuark key;
+  char *value;
+} owl_message_attribute;
+
+/* A zephyr as it was received, kept with its message for the raw
+ * fields.  It owns the packet libzephyr read it into; the fields of
+ * z_message are indexed as views into that, and each is converted to
+ * UTF-8 at most once.  See owl_zephyr_notice_new. */
+typedef struct _owl_zephyr_notice owl_zephyr_notice;
+
 #ifdef HAVE_LIBZEPHYR
-  bool has_notice;
+typedef struct _owl_zephyr_field_view {
+  int offset;                   /* into z_message */
+  int len;
+  const char *utf8;             /* NULL until asked for */
+  bool utf8_owned;              /* or else it points into the packet */
+} owl_zephyr_field_view;
+
+struct _owl_zephyr_notice {
   ZNotice_t notice;
+  int nfields;
+  owl_zephyr_field_view fields[];
+};
 #endif
+
+typedef struct _owl_message {
+  int id;
+  int direction;
+  owl_zephyr_notice *notice;    /* NULL unless a received zephyr */
   struct _owl_fmtext_cache * fmtext;
+  /* line count of the formatted text, kept when fmtext is evicted,
+   * and the style and width it is for */
+  int numlines;
+  const struct _owl_style *numlines_style;
+  int numlines_width;
   int delete;
-  const char *hostname;
-  GPtrArray *attributes;          /* this is a list of pairs */
+  const char *hostname;          /* pooled, see owl_strpool_ref */
+  /* core attributes, NULL if unset.  Low-cardinality ones are pooled. */
+  const char *fields[OWL_MESSAGE_NFIELDS];
+  /* where the body was written in the message store, or -1; see
+   * msgstore.c.  The body field is NULL while it is only there. */
+  gint64 spill_offset;
+  int spill_len;
+  /* the body with zephyr formatting stripped, if that differs */
+  char *plainbody;
+  /* trigram signature of the core fields, or NULL; see textindex.c */
+  guint64 *textsig;
+  int textsig_words;
+  GArray *attributes;   /* other owl_message_attributes sorted by key, or NULL */
   char *timestr;
   time_t time;
+  /* colors from the colored filters, if colors_generation is current */
+  int colors_generation;
+  int fgcolor, bgcolor;
+  /* the decryption under way, or NULL; see zdecrypt.c */
+  struct _owl_zcrypt_job *decrypt_job;
 } owl_message;
 
-#define OWL_FMTEXT_CACHE_SIZE 1000
-/* We cache the saved fmtexts for the last bunch of messages we
-   rendered */
+/* We cache the formatted text of recently rendered messages, in
+   least recently used order, up to the format_cache_size variable */
 typedef struct _owl_fmtext_cache {
-    owl_message * message;
-    owl_fmtext fmtext;
+  owl_message *message;
+  owl_fmtext fmtext;
+  const struct _owl_style *style;  /* style and width fmtext was made with */
+  int width;
+  size_t size;                  /* bytes charged against the budget */
+  unsigned int serial;          /* changes whenever fmtext is remade */
+  unsigned int pin_epoch;       /* on screen if this is the current epoch */
+  GList link;                   /* in the LRU queue */
 } owl_fmtext_cache;
 
+typedef struct _owl_fmtext_cache_stats {
+  unsigned long hits;
+  unsigned long misses;
+  unsigned long evictions;
+  unsigned int entries;
+  size_t bytes;
+} owl_fmtext_cache_stats;
+
+/* counts of zephyr traffic, kept by zephyr.c */
+typedef struct _owl_zephyr_stats {
+  unsigned long notices;        /* received from libzephyr, of every kind */
+  unsigned long acks;
+  unsigned long pings_dropped;  /* pings skipped since rxping is off */
+  unsigned long pseudologins;   /* locate replies for pseudologins */
+  unsigned long dispatches;
+} owl_zephyr_stats;
+
 typedef struct _owl_style {
   char *name;
   SV *perlobj;
 } owl_style;
 
+/* A message as the main window drew it */
+typedef struct _owl_mainwin_entry {
+  int id;
+  unsigned int serial;          /* of the format drawn */
+  int y;                        /* first row */
+  int start;                    /* first line of the message shown */
+  int nrows;
+  int fgcolor, bgcolor;
+  char mark[3];                 /* drawn over the first two columns */
+} owl_mainwin_entry;
+
 typedef struct _owl_mainwin {
   int curtruncated;
   int lasttruncated;
   int lastdisplayed;
   owl_window *window;
+  guint prefetch_source;        /* idle source formatting off-screen messages */
+  int prefetch_dist;            /* how far from the screen it has got */
+  /* what the window holds, so a redraw only touches what changed */
+  guint drawn_serial;           /* of the window; 0 if nothing can be reused */
+  int drawn_lines, drawn_cols, drawn_rightshift;
+  GArray *drawn;                /* owl_mainwin_entry, top to bottom */
+  GArray *layout;               /* scratch for the next redraw */
 } owl_mainwin;
 
 typedef struct _owl_editwin owl_editwin;
@@ -408,14 +529,76 @@ typedef struct _owl_messagelist {
   GPtrArray *list;
 } owl_messagelist;
 
+/* How owl_regex_compare matches: with the regex engine, or, for
+ * regexes which are plain text, by comparing with the text */
+#define OWL_REGEX_KIND_ENGINE   0
+#define OWL_REGEX_KIND_EXACT    1       /* ^text$ */
+#define OWL_REGEX_KIND_PREFIX   2       /* ^text */
+#define OWL_REGEX_KIND_SUFFIX   3       /* text$ */
+#define OWL_REGEX_KIND_CONTAINS 4       /* text */
+#define OWL_REGEX_KIND_DECORATED 5      /* ^(un)*text(\.d)*$ */
+#define OWL_REGEX_KIND_ANY      6       /* .* */
+
 typedef struct _owl_regex {
   int negate;
   char *string;
+  char *literal;        /* lowercased text every match contains, or NULL */
+  int kind;             /* OWL_REGEX_KIND_* */
+  char *text;           /* casefolded text for the plain kinds */
+  bool posix;           /* compiled by regcomp into re */
+#ifdef HAVE_PCRE2
+  pcre2_code *code;
+  pcre2_match_data *match;
+#endif
   regex_t re;
 } owl_regex;
 
+/* Kinds of filterelement */
+#define OWL_FILTERELEMENT_TRUE    0
+#define OWL_FILTERELEMENT_FALSE   1
+#define OWL_FILTERELEMENT_RE      2
+#define OWL_FILTERELEMENT_FILTER  3
+#define OWL_FILTERELEMENT_PERL    4
+#define OWL_FILTERELEMENT_GROUP   5
+#define OWL_FILTERELEMENT_NOT     6
+#define OWL_FILTERELEMENT_AND     7
+#define OWL_FILTERELEMENT_OR      8
+
+/* Message fields a regex filterelement can match against.  CLASS
+ * through TYPE are core message fields. */
+#define OWL_FILTER_FIELD_ATTRIBUTE 0
+#define OWL_FILTER_FIELD_CLASS     1
+#define OWL_FILTER_FIELD_INSTANCE  2
+#define OWL_FILTER_FIELD_SENDER    3
+#define OWL_FILTER_FIELD_RECIPIENT 4
+#define OWL_FILTER_FIELD_BODY      5
+#define OWL_FILTER_FIELD_OPCODE    6
+#define OWL_FILTER_FIELD_REALM     7
+#define OWL_FILTER_FIELD_TYPE      8
+#define OWL_FILTER_FIELD_HOSTNAME  9
+#define OWL_FILTER_FIELD_DELETED   10
+#define OWL_FILTER_FIELD_DIRECTION 11
+#define OWL_FILTER_FIELD_LOGIN     12
+
+/* Instructions of a compiled filter. All of them act on a single
+ * match register. */
+#define OWL_FILTER_OP_TRUE          0
+#define OWL_FILTER_OP_FALSE         1
+#define OWL_FILTER_OP_RE            2
+#define OWL_FILTER_OP_PERL          3
+#define OWL_FILTER_OP_NOT           4
+#define OWL_FILTER_OP_JUMP_IF_FALSE 5
+#define OWL_FILTER_OP_JUMP_IF_TRUE  6
+#define OWL_FILTER_OP_SET           7  /* field is one of several values */
+
+/* Why owl_filter_compile gave up on a filter. */
+#define OWL_FILTER_COMPILE_OK       0
+#define OWL_FILTER_COMPILE_LOOP     1
+#define OWL_FILTER_COMPILE_TOODEEP  2
+#define OWL_FILTER_COMPILE_TOOLARGE 3
+
 typedef struct _owl_filterelement {
-  int (*match_message)(const struct _owl_filterelement *fe, const owl_message *m);
+  int type;          /* OWL_FILTERELEMENT_* */
   /* Append a string representation of the filterelement onto buf*/
   void (*print_elt)(const struct _owl_filterelement *fe, GString *buf);
   /* Operands for and,or,not*/
@@ -424,13 +607,32 @@ typedef struct _owl_filterelement {
   owl_regex re;
   /* Used by regexes, filter references, and perl */
   char *field;
+  /* For regex filters: field resolved at parse time, and the
+   * attribute quark for OWL_FILTER_FIELD_ATTRIBUTE */
+  int fieldid;
+  GQuark attr;
+  /* the field is covered by message text signatures and the regex
+   * requires some literal text */
+  bool indexed;
 } owl_filterelement;
 
+typedef struct _owl_filter_insn {
+  int op;                               /* OWL_FILTER_OP_* */
+  int target;                           /* for jumps */
+  const owl_filterelement *fe;          /* for regexes, sets and perl */
+  GHashTable *set;                      /* for sets: casefolded values */
+} owl_filter_insn;
+
 typedef struct _owl_filter {
   char *name;
   owl_filterelement * root;
   int fgcolor;
   int bgcolor;
+  /* root compiled into a flat program, with other filters inlined */
+  GArray *program;
+  /* filter generation the program was compiled against, or -1 if it
+   * does not refer to other filters and never needs recompiling */
+  int generation;
 } owl_filter;
 
 typedef struct _owl_view {
@@ -439,6 +641,7 @@ typedef struct _owl_view {
   owl_messagelist *ml;
   const owl_style *style;
   int cachedmsgid;
+  bool stale;                   /* filter was redefined since ml was built */
 } owl_view;
 
 typedef struct _owl_history {
@@ -514,6 +717,8 @@ typedef struct _owl_global {
   owl_keyhandler kh;
   owl_dict filters;
   GList *filterlist;
+  int filter_generation;        /* bumped whenever a filter is added or removed */
+  int color_generation;         /* ...or added, removed or recolored */
   GPtrArray *puntlist;
   owl_vardict vars;
   owl_cmddict cmds;
@@ -525,6 +730,7 @@ typedef struct _owl_global {
   int curmsg_vert_offset;
   owl_view current_view;
   owl_messagelist *msglist;
+  GQueue *viewcache;            /* message lists of recently used views */
   WINDOW *input_pad;
   owl_mainpanel mainpanel;
   gulong typwin_erase_id;
@@ -542,6 +748,7 @@ typedef struct _owl_global {
   int debug;
   time_t starttime;
   time_t lastinputtime;
+  gint64 lastinput_usec;    /* monotonic, as of the last keypress */
   time_t last_wakeup_time;
   char *startupargs;
   int nextmsgid;
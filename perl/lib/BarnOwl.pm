@@ -387,6 +387,19 @@ sub _receive_msg_legacy_wrap {
     return &BarnOwl::Hooks::_receive_msg($m);
 }
 
+# Called with an arrayref of the messages just added to the message
+# list. Incoming ones are received before each one is announced as new.
+sub _new_msgs {
+    my ($msgs) = @_;
+    for my $m (@$msgs) {
+        eval {
+            _receive_msg_legacy_wrap($m) if $m->is_incoming;
+            BarnOwl::Hooks::_new_msg($m);
+        };
+        BarnOwl::error("Perl Error: '$@'") if $@;
+    }
+}
+
 =head2 new_command NAME FUNC [{ARGS}]
 
 Add a new owl command. When owl executes the command NAME, FUNC will
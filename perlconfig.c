@@ -68,15 +68,19 @@ CALLER_OWN HV *owl_new_hv(const owl_dict *d, SV *(*to_sv)(const void *))
   return ret;
 }
 
+static void owl_perlconfig_store_attribute(const char *key, const char *value, void *data)
+{
+  HV *h = data;
+  (void)hv_store(h, key, strlen(key), owl_new_sv(value), 0);
+}
+
 CALLER_OWN SV *owl_perlconfig_message2hashref(const owl_message *m)
 {
   HV *h, *stash;
   SV *hr;
   const char *type;
-  char *ptr, *utype, *blessas;
-  const char *f;
-  int i;
-  const owl_pair *pair;
+  char *utype, *blessas;
+  int i, nfields;
   const owl_filter *wrap;
 
   if (!m) return &PL_sv_undef;
@@ -94,13 +98,11 @@ CALLER_OWN SV *owl_perlconfig_message2hashref(const owl_message *m)
   if (owl_message_is_type_zephyr(m) && owl_message_is_direction_in(m)) {
     /* Handle zephyr-specific fields... */
     AV *av_zfields = newAV();
-    if (owl_message_get_notice(m)) {
-      for (f = owl_zephyr_first_raw_field(owl_message_get_notice(m)); f != NULL;
-           f = owl_zephyr_next_raw_field(owl_message_get_notice(m), f)) {
-        ptr = owl_zephyr_field_as_utf8(owl_message_get_notice(m), f);
-        av_push(av_zfields, owl_new_sv(ptr));
-        g_free(ptr);
-      }
+    const owl_zephyr_notice *zn = owl_message_get_zephyr_notice(m);
+    if (zn) {
+      nfields = owl_zephyr_notice_get_num_fields(zn);
+      for (i = 1; i <= nfields; i++)
+        av_push(av_zfields, owl_new_sv(owl_zephyr_notice_get_field(zn, i)));
       (void)hv_store(h, "auth", strlen("auth"),
                      owl_new_sv(owl_zephyr_get_authstr(owl_message_get_notice(m))), 0);
     } else {
@@ -111,11 +113,7 @@ CALLER_OWN SV *owl_perlconfig_message2hashref(const owl_message *m)
     (void)hv_store(h, "fields", strlen("fields"), newRV_noinc((SV*)av_zfields), 0);
   }
 
-  for (i = 0; i < m->attributes->len; i++) {
-    pair = m->attributes->pdata[i];
-    (void)hv_store(h, owl_pair_get_key(pair), strlen(owl_pair_get_key(pair)),
-                   owl_new_sv(owl_pair_get_value(pair)),0);
-  }
+  owl_message_foreach_attribute(m, owl_perlconfig_store_attribute, h);
   
   MSG2H(h, type);
   MSG2H(h, direction);
@@ -404,25 +402,36 @@ CALLER_OWN char *owl_perlconfig_execute(const char *line)
   return(out);
 }
 
-void owl_perlconfig_getmsg(const owl_message *m, const char *subname)
+/* Hands a batch of new messages to perl in a single call. Incoming
+ * ones go through the receive hooks, then all of them through the new
+ * message hooks. */
+void owl_perlconfig_new_messages(const GPtrArray *msgs)
 {
-  char *ptr = NULL;
-  if (owl_perlconfig_is_function("BarnOwl::Hooks::_receive_msg")) {
-    ptr = owl_perlconfig_call_with_message(subname?subname
-                                           :"BarnOwl::_receive_msg_legacy_wrap", m);
-  }
-  g_free(ptr);
-}
+  AV *av;
+  SV *msgref;
+  int i;
 
-/* Called on all new messages; receivemsg is only called on incoming ones */
-void owl_perlconfig_newmsg(const owl_message *m, const char *subname)
-{
-  char *ptr = NULL;
-  if (owl_perlconfig_is_function("BarnOwl::Hooks::_new_msg")) {
-    ptr = owl_perlconfig_call_with_message(subname?subname
-                                           :"BarnOwl::Hooks::_new_msg", m);
+  if (msgs->len == 0 || !owl_perlconfig_is_function("BarnOwl::_new_msgs"))
+    return;
+
+  av = newAV();
+  for (i = 0; i < msgs->len; i++) {
+    msgref = owl_perlconfig_message2hashref(msgs->pdata[i]);
+    if (msgref != &PL_sv_undef)
+      av_push(av, msgref);
   }
-  g_free(ptr);
+
+  OWL_PERL_CALL(call_pv("BarnOwl::_new_msgs", G_VOID|G_EVAL);
+                ,
+                XPUSHs(sv_2mortal(newRV_noinc((SV *)av)));
+                ,
+                "Perl Error: '%s'"
+                ,
+                false
+                ,
+                true
+                ,
+                );
 }
 
 void owl_perlconfig_new_command(const char *name)
@@ -4,13 +4,276 @@ void owl_regex_init(owl_regex *re)
 {
   re->negate=0;
   re->string=NULL;
+  re->literal=NULL;
+  re->text=NULL;
+  re->kind=OWL_REGEX_KIND_ENGINE;
 }
 
-int owl_regex_create(owl_regex *re, const char *string)
+/* Returns the longest run of text, lowercased, that every match of
+ * the extended regex 'pattern' has to contain, or NULL if there is
+ * none of at least three characters.  This errs towards NULL: it gives
+ * up on alternation and groups, and on anything outside ASCII, which
+ * REG_ICASE may fold differently. */
+static CALLER_OWN char *owl_regex_required_literal(const char *pattern)
+{
+  GString *run = g_string_new("");
+  char *best = NULL;
+  const char *p;
+  char c;
+
+  for (p = pattern; *p; p++) {
+    c = '\0';
+    if (*p == '\\' && p[1] && strchr(OWL_REGEX_QUOTECHARS, p[1]))
+      c = *++p;
+    else if (!strchr(OWL_REGEX_QUOTECHARS, *p) && !(*p & 0x80))
+      c = *p;
+
+    /* a character a quantifier may drop doesn't count */
+    if (c && p[1] != '*' && p[1] != '?' && p[1] != '{') {
+      g_string_append_c(run, g_ascii_tolower(c));
+      continue;
+    }
+
+    if (run->len >= 3 && (!best || run->len > strlen(best))) {
+      g_free(best);
+      best = g_strdup(run->str);
+    }
+    g_string_truncate(run, 0);
+    if (c) continue;
+
+    if (*p == '|' || *p == '(' || *p == ')') {
+      g_free(best);
+      best = NULL;
+      break;
+    } else if (*p == '\\' && p[1]) {
+      /* \w and the like */
+      p++;
+    } else if (*p == '[') {
+      /* skip the bracket expression; a leading ']' is literal */
+      p++;
+      if (*p == '^') p++;
+      if (*p == ']') p++;
+      while (*p && *p != ']') p++;
+      if (!*p) break;
+    } else if (*p == '{') {
+      while (*p && *p != '}') p++;
+      if (!*p) break;
+    }
+  }
+
+  if (!*p && run->len >= 3 && (!best || run->len > strlen(best))) {
+    g_free(best);
+    best = g_strdup(run->str);
+  }
+  g_string_free(run, true);
+  return best;
+}
+
+static bool owl_regex_is_ascii(const char *s)
+{
+  for (; *s; s++) {
+    if (*s & 0x80) return false;
+  }
+  return true;
+}
+
+/* Unescapes the plain text between p and end, or returns NULL if it
+ * is not plain text.  If 'anchored' is non-NULL, a final $ is allowed
+ * and reported there. */
+static CALLER_OWN char *owl_regex_unescape(const char *p, const char *end, bool *anchored)
+{
+  GString *text = g_string_new("");
+
+  for (; p < end; p++) {
+    if (*p == '\\' && p + 1 < end && strchr(OWL_REGEX_QUOTECHARS, p[1])) {
+      g_string_append_c(text, *++p);
+    } else if (anchored && *p == '$' && p + 1 == end) {
+      *anchored = true;
+    } else if (strchr(OWL_REGEX_METACHARS, *p)) {
+      g_string_free(text, true);
+      return NULL;
+    } else {
+      g_string_append_c(text, *p);
+    }
+  }
+  return g_string_free(text, false);
+}
+
+/* Recognizes regexes which can be matched without the regex engine:
+ * plain text, perhaps anchored; the ^(un)*text(\.d)*$ that class and
+ * instance filters use; and .* on its own.  Sets *kind and returns the
+ * text, casefolded, or returns NULL if the engine is needed. */
+static CALLER_OWN char *owl_regex_classify(const char *pattern, int *kind)
+{
+  const char *p = pattern, *end = pattern + strlen(pattern);
+  bool start = false, anchored = false;
+  char *raw, *text;
+
+  if (!strcmp(pattern, ".*") || !strcmp(pattern, "^.*$")) {
+    *kind = OWL_REGEX_KIND_ANY;
+    return g_strdup("");
+  }
+
+  if (end - p >= strlen(OWL_REGEX_UN_PREFIX OWL_REGEX_D_SUFFIX) &&
+      g_str_has_prefix(p, OWL_REGEX_UN_PREFIX) &&
+      g_str_has_suffix(p, OWL_REGEX_D_SUFFIX)) {
+    *kind = OWL_REGEX_KIND_DECORATED;
+    raw = owl_regex_unescape(p + strlen(OWL_REGEX_UN_PREFIX),
+                             end - strlen(OWL_REGEX_D_SUFFIX), NULL);
+  } else {
+    if (*p == '^') {
+      start = true;
+      p++;
+    }
+    raw = owl_regex_unescape(p, end, &anchored);
+    if (start && anchored)
+      *kind = OWL_REGEX_KIND_EXACT;
+    else if (start)
+      *kind = OWL_REGEX_KIND_PREFIX;
+    else if (anchored)
+      *kind = OWL_REGEX_KIND_SUFFIX;
+    else
+      *kind = OWL_REGEX_KIND_CONTAINS;
+  }
+  if (!raw) return NULL;
+
+  /* folded text outside ASCII can only be compared as a whole */
+  if (!owl_regex_is_ascii(raw) && (!g_utf8_validate(raw, -1, NULL) ||
+             (*kind != OWL_REGEX_KIND_EXACT && *kind != OWL_REGEX_KIND_DECORATED))) {
+    g_free(raw);
+    return NULL;
+  }
+  text = g_utf8_casefold(raw, -1);
+  g_free(raw);
+  return text;
+}
+
+#ifdef HAVE_PCRE2
+/* Returns true if pattern uses anything PCRE2 reads differently from
+ * GNU extended regexes, which then keep the POSIX meaning:
+ * backslashes inside brackets, escapes like \d or \n which GNU takes
+ * literally, the GNU word anchors, (?...) groups, possessive
+ * quantifiers and {,n}. */
+static bool owl_regex_needs_posix(const char *pattern)
+{
+  const char *p;
+
+  for (p = pattern; *p; p++) {
+    if (*p == '\\' && p[1]) {
+      p++;
+      if (g_ascii_isalnum(*p) && !strchr("wWsSbB123456789", *p)) return true;
+      if (strchr("<>`'", *p)) return true;
+    } else if (*p == '[') {
+      if (g_str_has_prefix(p, "[[:<:]]") || g_str_has_prefix(p, "[[:>:]]"))
+        return true;
+      /* a ] first in the brackets is literal */
+      p++;
+      if (*p == '^') p++;
+      if (*p == ']') p++;
+      for (; *p && *p != ']'; p++) {
+        if (*p == '\\') return true;
+        if (*p == '[' && p[1] == ':') {
+          const char *close = strstr(p + 2, ":]");
+          if (close) p = close + 1;
+        }
+      }
+      if (!*p) return false;
+    } else if (*p == '(' && p[1] == '?') {
+      return true;
+    } else if (strchr("*+?}", *p) && p[1] == '+') {
+      return true;
+    } else if (*p == '{' && p[1] == ',') {
+      return true;
+    }
+  }
+  return false;
+}
+#endif
+
+/* Compiles pattern with the regex engine.  With PCRE2 that is tried
+ * first, JIT-compiled where the platform allows, and POSIX regcomp
+ * takes whatever PCRE2 can't, or would read differently. */
+static int owl_regex_engine_compile(owl_regex *re, const char *pattern)
 {
   int ret;
   size_t errbuf_size;
   char *errbuf;
+#ifdef HAVE_PCRE2
+  int errcode;
+  PCRE2_SIZE erroffset;
+  uint32_t options = PCRE2_CASELESS | PCRE2_UTF | PCRE2_UCP |
+    PCRE2_DOTALL | PCRE2_DOLLAR_ENDONLY;
+#ifdef PCRE2_MATCH_INVALID_UTF
+  options |= PCRE2_MATCH_INVALID_UTF;
+#endif
+
+  re->code = NULL;
+  re->match = NULL;
+  if (!owl_regex_needs_posix(pattern)) {
+    re->code = pcre2_compile((PCRE2_SPTR)pattern, PCRE2_ZERO_TERMINATED,
+                             options, &errcode, &erroffset, NULL);
+  }
+  if (re->code) {
+    pcre2_jit_compile(re->code, PCRE2_JIT_COMPLETE);
+    re->match = pcre2_match_data_create_from_pattern(re->code, NULL);
+    re->posix = false;
+    return 0;
+  }
+#endif
+
+  ret=regcomp(&(re->re), pattern, REG_EXTENDED|REG_ICASE);
+  if (ret) {
+    errbuf_size = regerror(ret, NULL, NULL, 0);
+    errbuf = g_new(char, errbuf_size);
+    regerror(ret, NULL, errbuf, errbuf_size);
+    owl_function_error("Error in regular expression: %s", errbuf);
+    g_free(errbuf);
+    return(-1);
+  }
+  re->posix = true;
+  return(0);
+}
+
+/* Returns 0 if the regex engine matches string, with the extent of
+ * the match in *start and *end */
+static int owl_regex_engine_exec(const owl_regex *re, const char *string, int *start, int *end)
+{
+  regmatch_t match;
+  int ret;
+#ifdef HAVE_PCRE2
+  PCRE2_SIZE *ovector;
+
+  if (!re->posix) {
+    if (pcre2_match(re->code, (PCRE2_SPTR)string, PCRE2_ZERO_TERMINATED,
+                    0, 0, re->match, NULL) < 0)
+      return 1;
+    ovector = pcre2_get_ovector_pointer(re->match);
+    *start = ovector[0];
+    *end = ovector[1];
+    return 0;
+  }
+#endif
+
+  ret=regexec(&(re->re), string, 1, &match, 0);
+  *start = match.rm_so;
+  *end = match.rm_eo;
+  return ret ? 1 : 0;
+}
+
+static void owl_regex_engine_free(owl_regex *re)
+{
+#ifdef HAVE_PCRE2
+  if (!re->posix) {
+    pcre2_match_data_free(re->match);
+    pcre2_code_free(re->code);
+    return;
+  }
+#endif
+  regfree(&(re->re));
+}
+
+int owl_regex_create(owl_regex *re, const char *string)
+{
   const char *ptr;
   
   re->string=g_strdup(string);
@@ -23,18 +286,24 @@ int owl_regex_create(owl_regex *re, const char *string)
   }
 
   /* set the regex */
-  ret=regcomp(&(re->re), ptr, REG_EXTENDED|REG_ICASE);
-  if (ret) {
-    errbuf_size = regerror(ret, NULL, NULL, 0);
-    errbuf = g_new(char, errbuf_size);
-    regerror(ret, NULL, errbuf, errbuf_size);
-    owl_function_error("Error in regular expression: %s", errbuf);
-    g_free(errbuf);
+  if (owl_regex_engine_compile(re, ptr) != 0) {
     g_free(re->string);
     re->string=NULL;
     return(-1);
   }
 
+  re->text = owl_regex_classify(ptr, &re->kind);
+  if (!re->text)
+    re->kind = OWL_REGEX_KIND_ENGINE;
+  re->literal = owl_regex_required_literal(ptr);
+  if (!re->literal && re->text && re->kind != OWL_REGEX_KIND_ANY &&
+      strlen(re->text) >= 3 && owl_regex_is_ascii(re->text))
+    re->literal = g_strdup(re->text);
+  if (re->negate) {
+    /* a negated regex matches without its text */
+    g_free(re->literal);
+    re->literal = NULL;
+  }
   return(0);
 }
 
@@ -49,25 +318,97 @@ int owl_regex_create_quoted(owl_regex *re, const char *string)
   return ret;
 }
 
+/* Matches ^(un)*text(\.d)*$, for lowercase 'text', against s */
+static bool owl_regex_decorated_match(const char *s, const char *text, size_t len)
+{
+  const char *tail;
+
+  for (;;) {
+    if (!g_ascii_strncasecmp(s, text, len)) {
+      for (tail = s + len; tail[0] == '.' && g_ascii_tolower(tail[1]) == 'd'; tail += 2)
+        ;
+      if (!*tail) return true;
+    }
+    if (g_ascii_tolower(s[0]) != 'u' || g_ascii_tolower(s[1]) != 'n')
+      return false;
+    s += 2;
+  }
+}
+
+/* Matches a regex of one of the plain kinds without the regex engine.
+ * Returns 0 on a match, 1 on none, and -1 if the engine has to decide,
+ * for partial matches of text outside ASCII. */
+static int owl_regex_compare_plain(const owl_regex *re, const char *string, int *start, int *end)
+{
+  size_t len = strlen(re->text), slen;
+  const char *s = string, *p;
+  char *folded = NULL;
+  bool match = false;
+
+  if (!owl_regex_is_ascii(string)) {
+    if ((re->kind != OWL_REGEX_KIND_EXACT && re->kind != OWL_REGEX_KIND_DECORATED &&
+         re->kind != OWL_REGEX_KIND_ANY) || !g_utf8_validate(string, -1, NULL))
+      return -1;
+    s = folded = g_utf8_casefold(string, -1);
+  }
+  slen = strlen(s);
+
+  *start = 0;
+  *end = strlen(string);
+  switch (re->kind) {
+  case OWL_REGEX_KIND_ANY:
+    match = true;
+    break;
+  case OWL_REGEX_KIND_EXACT:
+    match = slen == len && !g_ascii_strcasecmp(s, re->text);
+    break;
+  case OWL_REGEX_KIND_DECORATED:
+    match = owl_regex_decorated_match(s, re->text, len);
+    break;
+  case OWL_REGEX_KIND_PREFIX:
+    match = slen >= len && !g_ascii_strncasecmp(s, re->text, len);
+    *end = len;
+    break;
+  case OWL_REGEX_KIND_SUFFIX:
+    match = slen >= len && !g_ascii_strncasecmp(s + slen - len, re->text, len);
+    *start = slen - len;
+    break;
+  case OWL_REGEX_KIND_CONTAINS:
+    *end = 0;
+    match = len == 0;
+    for (p = s; !match && p + len <= s + slen; p++) {
+      if (g_ascii_tolower(*p) == re->text[0] && !g_ascii_strncasecmp(p, re->text, len)) {
+        match = true;
+        *start = p - s;
+        *end = p - s + len;
+      }
+    }
+    break;
+  }
+  g_free(folded);
+  return match ? 0 : 1;
+}
+
 int owl_regex_compare(const owl_regex *re, const char *string, int *start, int *end)
 {
-  int out, ret;
-  regmatch_t match;
+  int out = -1, so = 0, eo = 0;
 
   /* if the regex is not set we match */
   if (!owl_regex_is_set(re)) {
     return(0);
   }
   
-  ret=regexec(&(re->re), string, 1, &match, 0);
-  out=ret;
+  if (re->kind != OWL_REGEX_KIND_ENGINE)
+    out = owl_regex_compare_plain(re, string, &so, &eo);
+  if (out < 0)
+    out = owl_regex_engine_exec(re, string, &so, &eo);
   if (re->negate) {
     out=!out;
-    match.rm_so = 0;
-    match.rm_eo = strlen(string);
+    so = 0;
+    eo = strlen(string);
   }
-  if (start != NULL) *start = match.rm_so;
-  if (end != NULL) *end = match.rm_eo;
+  if (start != NULL) *start = so;
+  if (end != NULL) *end = eo;
   return(out);
 }
 
@@ -82,6 +423,21 @@ const char *owl_regex_get_string(const owl_regex *re)
   return(re->string);
 }
 
+/* Returns the casefolded text if the regex matches exactly that,
+ * ignoring case, and NULL otherwise */
+const char *owl_regex_get_exact_text(const owl_regex *re)
+{
+  if (re->kind != OWL_REGEX_KIND_EXACT || re->negate) return(NULL);
+  return(re->text);
+}
+
+/* Returns text, lowercased, which any string the regex matches must
+ * contain, or NULL if nothing useful is known */
+const char *owl_regex_get_literal(const owl_regex *re)
+{
+  return(re->literal);
+}
+
 void owl_regex_copy(const owl_regex *a, owl_regex *b)
 {
   owl_regex_create(b, a->string);
@@ -91,6 +447,8 @@ void owl_regex_cleanup(owl_regex *re)
 {
     if (re->string) {
         g_free(re->string);
-        regfree(&(re->re));
+        g_free(re->literal);
+        g_free(re->text);
+        owl_regex_engine_free(re);
     }
 }
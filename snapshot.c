@@ -0,0 +1,681 @@
+#include "owl.h"
+#include <sys/mman.h>
+
+/* The global message list is saved to confdir/messages.snapshot so a
+ * restarted BarnOwl comes back with its history.  The file is a
+ * header followed by records, each a type byte, a payload length and
+ * the payload:
+ *
+ *   'M'  a message: id, direction, time, delete flag, hostname and
+ *        every attribute as key/value pairs
+ *   'D'  a change to the delete flag of a message
+ *   'X'  an expunged message
+ *   'U'  the attributes of a message again, after they changed, as
+ *        when a zephyr is decrypted
+ *
+ * New records are appended as things happen, and the file is
+ * rewritten from the message list at startup once it is mostly
+ * stale records.  Integers are in host byte order; the file is not
+ * meant to move between machines.
+ *
+ * Records are put together in the main thread and handed, in order,
+ * to a writer thread which does all of the file I/O. */
+
+#define OWL_SNAPSHOT_MAGIC "BOWLSNAP"
+#define OWL_SNAPSHOT_VERSION 1
+#define OWL_SNAPSHOT_HEADER_LEN (sizeof(OWL_SNAPSHOT_MAGIC) - 1 + sizeof(guint32))
+
+#define OWL_SNAPSHOT_MESSAGE 'M'
+#define OWL_SNAPSHOT_DELETE  'D'
+#define OWL_SNAPSHOT_EXPUNGE 'X'
+#define OWL_SNAPSHOT_UPDATE  'U'
+
+/* pending records are written out once this many bytes build up, or
+ * at the next idle */
+#define OWL_SNAPSHOT_FLUSH_BYTES (64 * 1024)
+
+/* what the writer thread is asked to do */
+#define OWL_SNAPSHOT_JOB_APPEND  0      /* add data to the file */
+#define OWL_SNAPSHOT_JOB_REWRITE 1      /* replace the file with data */
+#define OWL_SNAPSHOT_JOB_CLOSE   2
+
+typedef struct _owl_snapshot_job { /* noproto */
+  int type;
+  char *path;
+  GString *data;
+} owl_snapshot_job;
+
+/* only touched in the main thread */
+static GThreadPool *snapshot_writer = NULL;
+static bool snapshot_open = false;      /* the writer has been given jobs */
+static bool snapshot_failed = false;
+static bool snapshot_reusable = false;  /* the loaded file can be appended to */
+static GString *snapshot_pending = NULL;
+static guint snapshot_flush_source = 0;
+
+/* only touched in the writer thread */
+static int snapshot_fd = -1;
+static bool snapshot_write_failed = false;
+
+static char *owl_snapshot_get_path(void)
+{
+  return g_build_filename(owl_global_get_confdir(&g), "messages.snapshot", NULL);
+}
+
+static void owl_snapshot_put_int32(GString *buf, gint32 v)
+{
+  g_string_append_len(buf, (const char *)&v, sizeof(v));
+}
+
+static void owl_snapshot_put_string(GString *buf, const char *s)
+{
+  guint32 len = strlen(s);
+  g_string_append_len(buf, (const char *)&len, sizeof(len));
+  g_string_append_len(buf, s, len);
+}
+
+/* Starts a record; owl_snapshot_end_record fills in its length. */
+static gsize owl_snapshot_begin_record(GString *buf, char type)
+{
+  guint32 len = 0;
+  g_string_append_c(buf, type);
+  g_string_append_len(buf, (const char *)&len, sizeof(len));
+  return buf->len;
+}
+
+static void owl_snapshot_end_record(GString *buf, gsize start)
+{
+  guint32 len = buf->len - start;
+  memcpy(buf->str + start - sizeof(len), &len, sizeof(len));
+}
+
+typedef struct _owl_snapshot_attrs { /* noproto */
+  GString *buf;
+  const char *body;             /* saved in place of the body, if set */
+} owl_snapshot_attrs;
+
+static void owl_snapshot_put_attribute(const char *key, const char *value, void *data)
+{
+  owl_snapshot_attrs *attrs = data;
+  owl_snapshot_put_string(attrs->buf, key);
+  if (attrs->body && !strcmp(key, "body"))
+    value = attrs->body;
+  owl_snapshot_put_string(attrs->buf, value);
+}
+
+static void owl_snapshot_count_attribute(const char *key, const char *value, void *data)
+{
+  (*(guint32 *)data)++;
+}
+
+static int owl_snapshot_direction(const owl_message *m)
+{
+  if (owl_message_is_direction_in(m)) return OWL_MESSAGE_DIRECTION_IN;
+  if (owl_message_is_direction_out(m)) return OWL_MESSAGE_DIRECTION_OUT;
+  return OWL_MESSAGE_DIRECTION_NONE;
+}
+
+/* A message being decrypted is saved with its ciphertext rather than
+ * the placeholder; the 'U' record follows once it is decrypted. */
+static void owl_snapshot_put_attributes(GString *buf, const owl_message *m)
+{
+  owl_snapshot_attrs attrs = { buf, owl_zcrypt_get_ciphertext(m) };
+  guint32 nattrs = 0;
+
+  owl_message_foreach_attribute(m, owl_snapshot_count_attribute, &nattrs);
+  g_string_append_len(buf, (const char *)&nattrs, sizeof(nattrs));
+  owl_message_foreach_attribute(m, owl_snapshot_put_attribute, &attrs);
+}
+
+static void owl_snapshot_put_message(GString *buf, const owl_message *m)
+{
+  gsize start = owl_snapshot_begin_record(buf, OWL_SNAPSHOT_MESSAGE);
+  gint64 time = owl_message_get_time(m);
+
+  owl_snapshot_put_int32(buf, owl_message_get_id(m));
+  owl_snapshot_put_int32(buf, owl_snapshot_direction(m));
+  g_string_append_len(buf, (const char *)&time, sizeof(time));
+  g_string_append_c(buf, owl_message_is_delete(m) ? 1 : 0);
+  owl_snapshot_put_string(buf, owl_message_get_hostname(m));
+  owl_snapshot_put_attributes(buf, m);
+  owl_snapshot_end_record(buf, start);
+}
+
+static bool owl_snapshot_write_all(int fd, const char *data, gsize len)
+{
+  ssize_t ret;
+
+  while (len > 0) {
+    ret = write(fd, data, len);
+    if (ret < 0 && errno == EINTR) continue;
+    if (ret < 0) return false;
+    data += ret;
+    len -= ret;
+  }
+  return true;
+}
+
+/* Returns the whole file for the messages of ml */
+static GString *owl_snapshot_serialize(const owl_messagelist *ml)
+{
+  GString *buf = g_string_sized_new(OWL_SNAPSHOT_FLUSH_BYTES);
+  guint32 version = OWL_SNAPSHOT_VERSION;
+  int i;
+
+  g_string_append(buf, OWL_SNAPSHOT_MAGIC);
+  g_string_append_len(buf, (const char *)&version, sizeof(version));
+  for (i = 0; i < owl_messagelist_get_size(ml); i++)
+    owl_snapshot_put_message(buf, owl_messagelist_get_element(ml, i));
+  return buf;
+}
+
+/* Replaces the file at path with buf by way of a temporary file.
+ * Touches nothing else, so it is safe in the writer thread.  Returns
+ * false, with errno set, on error. */
+static bool owl_snapshot_write_file(const char *path, const GString *buf)
+{
+  char *tmppath = g_strconcat(path, ".tmp", NULL);
+  bool ok;
+  int fd, saved_errno;
+
+  fd = open(tmppath, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+  if (fd < 0) {
+    g_free(tmppath);
+    return false;
+  }
+  ok = owl_snapshot_write_all(fd, buf->str, buf->len);
+  if (close(fd) < 0)
+    ok = false;
+  if (ok && rename(tmppath, path) < 0)
+    ok = false;
+  if (!ok) {
+    saved_errno = errno;
+    unlink(tmppath);
+    errno = saved_errno;
+  }
+  g_free(tmppath);
+  return ok;
+}
+
+/* Writes every message of ml to a new snapshot at path, replacing
+ * whatever is there.  Returns false on error. */
+bool owl_snapshot_save(const char *path, const owl_messagelist *ml)
+{
+  GString *buf = owl_snapshot_serialize(ml);
+  bool ok = owl_snapshot_write_file(path, buf);
+
+  if (!ok)
+    owl_function_debugmsg("snapshot: writing %s: %s", path, strerror(errno));
+  g_string_free(buf, true);
+  return ok;
+}
+
+/* A cursor over a mapped record */
+typedef struct _owl_snapshot_reader {           /* noproto */
+  const char *p;
+  const char *end;
+} owl_snapshot_reader;
+
+static bool owl_snapshot_get(owl_snapshot_reader *r, void *out, gsize len)
+{
+  if (r->end - r->p < len) return false;
+  memcpy(out, r->p, len);
+  r->p += len;
+  return true;
+}
+
+/* Copies out a string; the caller frees it. */
+static char *owl_snapshot_get_string(owl_snapshot_reader *r)
+{
+  guint32 len;
+  char *s;
+
+  if (!owl_snapshot_get(r, &len, sizeof(len)) || r->end - r->p < len)
+    return NULL;
+  s = g_strndup(r->p, len);
+  r->p += len;
+  return s;
+}
+
+static bool owl_snapshot_get_attributes(owl_snapshot_reader *r, owl_message *m)
+{
+  guint32 nattrs, i;
+  char *key, *value;
+
+  if (!owl_snapshot_get(r, &nattrs, sizeof(nattrs)))
+    return false;
+  for (i = 0; i < nattrs; i++) {
+    if (!(key = owl_snapshot_get_string(r)))
+      return false;
+    if (!(value = owl_snapshot_get_string(r))) {
+      g_free(key);
+      return false;
+    }
+    owl_message_set_attribute(m, key, value);
+    g_free(key);
+    g_free(value);
+  }
+  return true;
+}
+
+static owl_message *owl_snapshot_get_message(owl_snapshot_reader *r, int id)
+{
+  gint32 direction;
+  gint64 time;
+  char delete;
+  char *value;
+  owl_message *m;
+
+  if (!owl_snapshot_get(r, &direction, sizeof(direction)) ||
+      !owl_snapshot_get(r, &time, sizeof(time)) ||
+      !owl_snapshot_get(r, &delete, sizeof(delete)))
+    return NULL;
+  if (!(value = owl_snapshot_get_string(r)))
+    return NULL;
+
+  owl_global_set_nextmsgid(&g, id);
+  m = g_slice_new(owl_message);
+  owl_message_init(m);
+  owl_message_set_direction(m, direction);
+  owl_message_set_time(m, time);
+  if (delete) owl_message_mark_delete(m);
+  owl_message_set_hostname(m, value);
+  g_free(value);
+
+  if (!owl_snapshot_get_attributes(r, m)) {
+    owl_message_delete(m);
+    return NULL;
+  }
+  return m;
+}
+
+/* Appends the messages saved at path to ml, which must not hold any
+ * messages newer than the ones saved.  Saved ids are kept when no
+ * message with those ids has been made yet, and shifted up past the
+ * ids in use otherwise.  Returns the number of messages loaded, or -1
+ * if the file can't be read at all.  A damaged tail is dropped.
+ * *stale, if non-NULL, is set to the number of records which did not
+ * end up as a message. */
+int owl_snapshot_load_file(const char *path, owl_messagelist *ml, int *stale)
+{
+  owl_snapshot_reader file, rec;
+  struct stat st;
+  char *map;
+  int fd, loaded = 0, records = 0;
+  int start = owl_messagelist_get_size(ml);
+  int offset = -1, lastid = -1;
+  GHashTable *doomed;
+  owl_message *m;
+  guint32 version, len;
+  gint32 id;
+  char type, delete;
+
+  if (stale) *stale = 0;
+  fd = open(path, O_RDONLY);
+  if (fd < 0) return -1;
+  if (fstat(fd, &st) < 0 || st.st_size < OWL_SNAPSHOT_HEADER_LEN) {
+    close(fd);
+    return -1;
+  }
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) return -1;
+
+  file.p = map;
+  file.end = map + st.st_size;
+  if (memcmp(file.p, OWL_SNAPSHOT_MAGIC, strlen(OWL_SNAPSHOT_MAGIC)) != 0) {
+    munmap(map, st.st_size);
+    return -1;
+  }
+  file.p += strlen(OWL_SNAPSHOT_MAGIC);
+  owl_snapshot_get(&file, &version, sizeof(version));
+  if (version != OWL_SNAPSHOT_VERSION) {
+    munmap(map, st.st_size);
+    return -1;
+  }
+
+  doomed = g_hash_table_new(g_direct_hash, g_direct_equal);
+  while (file.p < file.end) {
+    if (!owl_snapshot_get(&file, &type, sizeof(type)) ||
+        !owl_snapshot_get(&file, &len, sizeof(len)) ||
+        file.end - file.p < len)
+      break;
+    rec.p = file.p;
+    rec.end = file.p + len;
+    file.p += len;
+    records++;
+
+    if (!owl_snapshot_get(&rec, &id, sizeof(id)))
+      break;
+    if (offset < 0) {
+      offset = owl_global_get_nextmsgid(&g);
+      offset = offset > id ? offset - id : 0;
+    }
+    id += offset;
+
+    if (type == OWL_SNAPSHOT_MESSAGE) {
+      /* ids only go up; anything else is damage */
+      if (id <= lastid) break;
+      if (!(m = owl_snapshot_get_message(&rec, id)))
+        break;
+      owl_messagelist_append_element(ml, m);
+      lastid = id;
+      loaded++;
+    } else if (type == OWL_SNAPSHOT_DELETE) {
+      if (!owl_snapshot_get(&rec, &delete, sizeof(delete)))
+        break;
+      m = owl_messagelist_get_by_id(ml, id);
+      if (m && delete) owl_message_mark_delete(m);
+      else if (m) owl_message_unmark_delete(m);
+    } else if (type == OWL_SNAPSHOT_UPDATE) {
+      m = owl_messagelist_get_by_id(ml, id);
+      if (m && !owl_snapshot_get_attributes(&rec, m))
+        break;
+    } else if (type == OWL_SNAPSHOT_EXPUNGE) {
+      m = owl_messagelist_get_by_id(ml, id);
+      if (m && !g_hash_table_lookup(doomed, m)) {
+        g_hash_table_insert(doomed, m, m);
+        loaded--;
+      }
+    } else {
+      break;
+    }
+  }
+  munmap(map, st.st_size);
+
+  if (file.p < file.end)
+    owl_function_debugmsg("snapshot: %s is damaged after %d records", path, records);
+  if (lastid >= 0)
+    owl_global_set_nextmsgid(&g, lastid + 1);
+
+  if (g_hash_table_size(doomed)) {
+    GHashTableIter iter;
+    gpointer key;
+
+    owl_messagelist_remove_set(ml, doomed);
+    g_hash_table_iter_init(&iter, doomed);
+    while (g_hash_table_iter_next(&iter, &key, NULL))
+      owl_message_delete(key);
+  }
+  g_hash_table_destroy(doomed);
+
+  /* the file can only be appended to if it was read through, and
+   * records to come will use its ids */
+  snapshot_reusable = file.p == file.end && offset <= 0;
+  if (stale) *stale = records - (owl_messagelist_get_size(ml) - start);
+  return loaded;
+}
+
+/* Loads the saved history into the global message list, if the user
+ * keeps it.  This runs once the startup file has set up the punt
+ * list, which the saved messages go past like new ones; those it
+ * nukes are left out of the file when it is rewritten. */
+void owl_snapshot_load(void)
+{
+  owl_messagelist *ml = owl_global_get_msglist(&g);
+  const GPtrArray *pl = owl_global_get_puntlist(&g);
+  int start = owl_messagelist_get_size(ml);
+  GHashTable *doomed;
+  owl_message *m;
+  char *path;
+  int loaded, stale, i, j;
+
+  if (!owl_global_is_save_messages(&g)) return;
+
+  path = owl_snapshot_get_path();
+  loaded = owl_snapshot_load_file(path, ml, &stale);
+  if (loaded >= 0)
+    owl_function_debugmsg("snapshot: loaded %d messages from %s", loaded, path);
+  /* not worth appending to a file which is mostly dead records */
+  if (stale > loaded)
+    snapshot_reusable = false;
+  g_free(path);
+
+  doomed = g_hash_table_new(g_direct_hash, g_direct_equal);
+  for (i = start; i < owl_messagelist_get_size(ml); i++) {
+    m = owl_messagelist_get_element(ml, i);
+    for (j = 0; j < pl->len; j++) {
+      if (owl_filter_message_match(pl->pdata[j], m)) {
+        g_hash_table_insert(doomed, m, m);
+        break;
+      }
+    }
+  }
+  if (g_hash_table_size(doomed)) {
+    GHashTableIter iter;
+    gpointer key;
+
+    owl_messagelist_remove_set(ml, doomed);
+    g_hash_table_iter_init(&iter, doomed);
+    while (g_hash_table_iter_next(&iter, &key, NULL))
+      owl_message_delete(key);
+    snapshot_reusable = false;
+  }
+  g_hash_table_destroy(doomed);
+
+  for (i = start; i < owl_messagelist_get_size(ml); i++)
+    owl_view_consider_message(owl_global_get_current_view(&g),
+                              owl_messagelist_get_element(ml, i));
+  owl_msgstore_spill_old(ml);
+}
+
+static void owl_snapshot_error_main_thread(gpointer data)
+{
+  snapshot_failed = true;
+  owl_function_error("%s", (const char *)data);
+}
+
+/* Runs a job in the writer thread.  After an error the file is left
+ * alone, and the main thread stops making jobs once it hears. */
+static void owl_snapshot_run_job(gpointer data, gpointer user_data)
+{
+  owl_snapshot_job *job = data;
+  bool ok = true;
+
+  if (job->type == OWL_SNAPSHOT_JOB_CLOSE) {
+    if (snapshot_fd >= 0)
+      close(snapshot_fd);
+    snapshot_fd = -1;
+  } else if (!snapshot_write_failed) {
+    if (job->type == OWL_SNAPSHOT_JOB_REWRITE) {
+      if (snapshot_fd >= 0)
+        close(snapshot_fd);
+      snapshot_fd = -1;
+      ok = owl_snapshot_write_file(job->path, job->data);
+    }
+    if (ok && snapshot_fd < 0) {
+      snapshot_fd = open(job->path, O_WRONLY | O_APPEND);
+      ok = snapshot_fd >= 0;
+    }
+    if (ok && job->type == OWL_SNAPSHOT_JOB_APPEND)
+      ok = owl_snapshot_write_all(snapshot_fd, job->data->str, job->data->len);
+    if (!ok) {
+      owl_select_post_task(owl_snapshot_error_main_thread,
+                           g_strdup_printf("Unable to save messages to %s: %s",
+                                           job->path, strerror(errno)),
+                           g_free, g_main_context_default());
+      if (snapshot_fd >= 0)
+        close(snapshot_fd);
+      snapshot_fd = -1;
+      snapshot_write_failed = true;
+    }
+  }
+
+  g_free(job->path);
+  if (job->data)
+    g_string_free(job->data, true);
+  g_slice_free(owl_snapshot_job, job);
+}
+
+/* Hands a job to the writer thread; it takes data over */
+static void owl_snapshot_push_job(int type, GString *data)
+{
+  owl_snapshot_job *job = g_slice_new(owl_snapshot_job);
+
+  job->type = type;
+  job->path = owl_snapshot_get_path();
+  job->data = data;
+  g_thread_pool_push(snapshot_writer, job, NULL);
+}
+
+/* Gets the writer thread going, first having it write out the whole
+ * message list if the file on disk can't be added to. */
+static bool owl_snapshot_open(void)
+{
+  GError *err = NULL;
+
+  if (snapshot_open) return true;
+  if (snapshot_failed) return false;
+
+  if (!snapshot_writer) {
+    snapshot_writer = g_thread_pool_new(owl_snapshot_run_job, NULL, 1, FALSE, &err);
+    if (!snapshot_writer) {
+      owl_function_error("Unable to start saving messages: %s", err->message);
+      g_error_free(err);
+      snapshot_failed = true;
+      return false;
+    }
+  }
+  if (!snapshot_reusable)
+    owl_snapshot_push_job(OWL_SNAPSHOT_JOB_REWRITE,
+                          owl_snapshot_serialize(owl_global_get_msglist(&g)));
+  snapshot_reusable = false;
+  snapshot_open = true;
+  return true;
+}
+
+static void owl_snapshot_close(void)
+{
+  if (!snapshot_open) return;
+  owl_snapshot_push_job(OWL_SNAPSHOT_JOB_CLOSE, NULL);
+  snapshot_open = false;
+}
+
+/* Hands the pending records to the writer thread. */
+void owl_snapshot_flush(void)
+{
+  if (snapshot_flush_source) {
+    g_source_remove(snapshot_flush_source);
+    snapshot_flush_source = 0;
+  }
+  if (!snapshot_pending || !snapshot_pending->len || !snapshot_open)
+    return;
+  owl_snapshot_push_job(OWL_SNAPSHOT_JOB_APPEND, snapshot_pending);
+  snapshot_pending = NULL;
+}
+
+static gboolean owl_snapshot_flush_idle(gpointer data)
+{
+  snapshot_flush_source = 0;
+  owl_snapshot_flush();
+  return FALSE;
+}
+
+/* Returns the buffer to add records to, or NULL if the history isn't
+ * being saved. */
+static GString *owl_snapshot_begin(void)
+{
+  if (!owl_global_is_save_messages(&g)) {
+    owl_snapshot_flush();
+    owl_snapshot_close();
+    return NULL;
+  }
+  if (!owl_snapshot_open())
+    return NULL;
+  if (!snapshot_pending)
+    snapshot_pending = g_string_sized_new(OWL_SNAPSHOT_FLUSH_BYTES);
+  return snapshot_pending;
+}
+
+static void owl_snapshot_commit(void)
+{
+  if (snapshot_pending->len >= OWL_SNAPSHOT_FLUSH_BYTES)
+    owl_snapshot_flush();
+  else if (!snapshot_flush_source)
+    snapshot_flush_source = g_idle_add(owl_snapshot_flush_idle, NULL);
+}
+
+/* Called once the startup file has run.  Drops the saved history if
+ * the user doesn't want it kept, and otherwise gets the file ready. */
+void owl_snapshot_start(void)
+{
+  char *path;
+
+  if (owl_global_is_save_messages(&g)) {
+    owl_snapshot_open();
+    return;
+  }
+  path = owl_snapshot_get_path();
+  unlink(path);
+  g_free(path);
+}
+
+/* Records messages just added to the global message list */
+void owl_snapshot_add_messages(const GPtrArray *msgs)
+{
+  GString *buf;
+  int i;
+
+  if (!msgs->len || !(buf = owl_snapshot_begin())) return;
+  for (i = 0; i < msgs->len; i++)
+    owl_snapshot_put_message(buf, msgs->pdata[i]);
+  owl_snapshot_commit();
+}
+
+/* Records a change to m's delete flag */
+void owl_snapshot_note_delete(const owl_message *m)
+{
+  GString *buf;
+  gsize start;
+
+  if (!snapshot_open && !owl_global_is_save_messages(&g)) return;
+  if (!(buf = owl_snapshot_begin())) return;
+  start = owl_snapshot_begin_record(buf, OWL_SNAPSHOT_DELETE);
+  owl_snapshot_put_int32(buf, owl_message_get_id(m));
+  g_string_append_c(buf, owl_message_is_delete(m) ? 1 : 0);
+  owl_snapshot_end_record(buf, start);
+  owl_snapshot_commit();
+}
+
+/* Records a change to m's attributes */
+void owl_snapshot_note_update(const owl_message *m)
+{
+  GString *buf;
+  gsize start;
+
+  if (!snapshot_open && !owl_global_is_save_messages(&g)) return;
+  if (!(buf = owl_snapshot_begin())) return;
+  start = owl_snapshot_begin_record(buf, OWL_SNAPSHOT_UPDATE);
+  owl_snapshot_put_int32(buf, owl_message_get_id(m));
+  owl_snapshot_put_attributes(buf, m);
+  owl_snapshot_end_record(buf, start);
+  owl_snapshot_commit();
+}
+
+/* Records the expunging of the messages in the set 'doomed' */
+void owl_snapshot_forget_messages(GHashTable *doomed)
+{
+  GHashTableIter iter;
+  GString *buf;
+  gpointer key;
+  gsize start;
+
+  if (!g_hash_table_size(doomed) || !(buf = owl_snapshot_begin())) return;
+  g_hash_table_iter_init(&iter, doomed);
+  while (g_hash_table_iter_next(&iter, &key, NULL)) {
+    start = owl_snapshot_begin_record(buf, OWL_SNAPSHOT_EXPUNGE);
+    owl_snapshot_put_int32(buf, owl_message_get_id(key));
+    owl_snapshot_end_record(buf, start);
+  }
+  owl_snapshot_commit();
+}
+
+/* Writes out what is left and waits for the writer thread to finish */
+void owl_snapshot_shutdown(void)
+{
+  owl_snapshot_flush();
+  owl_snapshot_close();
+  if (snapshot_writer)
+    g_thread_pool_free(snapshot_writer, FALSE, TRUE);
+  snapshot_writer = NULL;
+}
@@ -0,0 +1,75 @@
+#include "owl.h"
+
+/* A pool of reference-counted shared strings, for message fields like
+ * class and sender which take few distinct values across many
+ * messages.  Equal strings from the pool are the same pointer. */
+
+typedef struct _owl_strpool_ent {               /* noproto */
+  char *str;
+  guint refs;
+} owl_strpool_ent;
+
+static GHashTable *strpool;
+static owl_strpool_stats strpool_stats;
+
+static void owl_strpool_ent_delete(gpointer data)
+{
+  owl_strpool_ent *e = data;
+  g_free(e->str);
+  g_slice_free(owl_strpool_ent, e);
+}
+
+/* Returns the pooled copy of 's', adding it if needed.  Release it
+ * with owl_strpool_unref. */
+const char *owl_strpool_ref(const char *s)
+{
+  owl_strpool_ent *e;
+  size_t size = strlen(s) + 1;
+
+  if (!strpool)
+    strpool = g_hash_table_new_full(g_str_hash, g_str_equal, NULL,
+                                    owl_strpool_ent_delete);
+
+  strpool_stats.lookups++;
+  e = g_hash_table_lookup(strpool, s);
+  if (e) {
+    e->refs++;
+    strpool_stats.hits++;
+    strpool_stats.bytes_saved += size;
+    return e->str;
+  }
+
+  e = g_slice_new(owl_strpool_ent);
+  e->str = g_strdup(s);
+  e->refs = 1;
+  g_hash_table_insert(strpool, e->str, e);
+  strpool_stats.strings++;
+  strpool_stats.bytes_used += size;
+  return e->str;
+}
+
+/* Drops a reference to a string returned by owl_strpool_ref.  NULL is
+ * ignored. */
+void owl_strpool_unref(const char *s)
+{
+  owl_strpool_ent *e;
+  size_t size;
+
+  if (!s || !strpool) return;
+  e = g_hash_table_lookup(strpool, s);
+  g_return_if_fail(e != NULL && e->str == s);
+
+  size = strlen(s) + 1;
+  if (--e->refs > 0) {
+    strpool_stats.bytes_saved -= size;
+    return;
+  }
+  strpool_stats.strings--;
+  strpool_stats.bytes_used -= size;
+  g_hash_table_remove(strpool, s);
+}
+
+const owl_strpool_stats *owl_strpool_get_stats(void)
+{
+  return &strpool_stats;
+}
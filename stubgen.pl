@@ -1,6 +1,10 @@
 print qq(/* THIS FILE WAS AUTOGENERATED BY STUBGEN.PL --- DO NOT EDIT BY HAND!!! */\n\n);
 print qq(#include "owl.h");
 
+# Each variable is looked up once, by owl_global_resolve_varstubs,
+# and the accessors go through the handle it leaves behind.
+my @resolve;
+
 foreach $file (@ARGV) {
     open(FILE, $file);
 
@@ -11,26 +15,35 @@ foreach $file (@ARGV) {
     my $varname = $2;
     my $altvarname = $2;
     $altvarname = $3 if ($3);
+    my $handle = "owl_varstub_$altvarname";
+    print "static owl_variable *$handle;\n";
+    push @resolve, "  $handle = owl_variable_get_var(&g->vars, \"$varname\");\n";
     if ($vartype =~ /^BOOL/) {
 	print "void owl_global_set_${altvarname}_on(owl_global *g) {\n";
-	print "  owl_variable_set_bool_on(owl_variable_get_var(&g->vars, \"$varname\"));\n}\n";
+	print "  owl_variable_set_bool_on($handle);\n}\n";
 	print "void owl_global_set_${altvarname}_off(owl_global *g) {\n";
-	print "  owl_variable_set_bool_off(owl_variable_get_var(&g->vars, \"$varname\"));\n}\n";
+	print "  owl_variable_set_bool_off($handle);\n}\n";
 	print "int owl_global_is_$altvarname(const owl_global *g) {\n";
-	print "  return owl_variable_get_bool(owl_variable_get_var(&g->vars, \"$varname\"));\n}\n";
+	print "  return owl_variable_get_bool($handle);\n}\n";
     } elsif ($vartype =~ /^PATH/ or $vartype =~ /^STRING/) {
 	print "void owl_global_set_$altvarname(owl_global *g, const char *text) {\n";
-	print "  owl_variable_set_string(owl_variable_get_var(&g->vars, \"$varname\"), text);\n}\n";
+	print "  owl_variable_set_string($handle, text);\n}\n";
 	print "const char *owl_global_get_$altvarname(const owl_global *g) {\n";
-	print "  return owl_variable_get_string(owl_variable_get_var(&g->vars, \"$varname\"));\n}\n";
+	print "  return owl_variable_get_string($handle);\n}\n";
     } elsif ($vartype =~ /^INT/ or $vartype =~ /^ENUM/) {
 	print "void owl_global_set_$altvarname(owl_global *g, int n) {\n";
-	print "  owl_variable_set_int(owl_variable_get_var(&g->vars, \"$varname\"), n);\n}\n";
+	print "  owl_variable_set_int($handle, n);\n}\n";
 	print "int owl_global_get_$altvarname(const owl_global *g) {\n";
-	print "  return owl_variable_get_int(owl_variable_get_var(&g->vars, \"$varname\"));\n}\n";
+	print "  return owl_variable_get_int($handle);\n}\n";
     } 
     }
     }
     close(FILE);
     print "\n";
 }
+
+print "/* Points the accessors above at the variables in g->vars.  Must be\n";
+print " * called again whenever one of them is replaced. */\n";
+print "void owl_global_resolve_varstubs(const owl_global *g) {\n";
+print @resolve;
+print "}\n";
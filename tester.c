@@ -3,6 +3,7 @@
 #include "owl.h"
 #undef WINDOW
 #include "filterproc.h"
+#include "zcryptlib.h"
 
 #include <stdio.h>
 
@@ -17,17 +18,28 @@ int owl_regtest(void);
 int owl_util_regtest(void);
 int owl_dict_regtest(void);
 int owl_variable_regtest(void);
+int owl_message_regtest(void);
 int owl_filter_regtest(void);
+int owl_view_regtest(void);
 int owl_obarray_regtest(void);
 int owl_editwin_regtest(void);
 int owl_fmtext_regtest(void);
 int owl_smartfilter_regtest(void);
 int owl_history_regtest(void);
 int call_filter_regtest(void);
+int zcrypt_regtest(void);
 int owl_smartstrip_regtest(void);
+int owl_zephyr_budget_regtest(void);
 
 extern void owl_perl_xs_init(pTHX);
 
+/* Timings are only taken when asked for, with BARNOWL_BENCHMARK set in
+ * the environment; the regression tests proper just check results. */
+static bool tester_benchmark(void)
+{
+  return g_getenv("BARNOWL_BENCHMARK") != NULL;
+}
+
 int main(int argc, char **argv, char **env)
 {
   FILE *rnull;
@@ -108,13 +120,17 @@ int owl_regtest(void) {
   numfailures += owl_util_regtest();
   numfailures += owl_dict_regtest();
   numfailures += owl_variable_regtest();
+  numfailures += owl_message_regtest();
   numfailures += owl_filter_regtest();
+  numfailures += owl_view_regtest();
   numfailures += owl_editwin_regtest();
   numfailures += owl_fmtext_regtest();
   numfailures += owl_smartfilter_regtest();
   numfailures += owl_history_regtest();
   numfailures += call_filter_regtest();
+  numfailures += zcrypt_regtest();
   numfailures += owl_smartstrip_regtest();
+  numfailures += owl_zephyr_budget_regtest();
   if (numfailures) {
       fprintf(stderr, "# *** WARNING: %d failures total\n", numfailures);
   }
@@ -287,10 +303,52 @@ int owl_util_regtest(void)
   return(numfailed);
 }
 
+static int owl_dict_benchmark_compare(const void *key, const void *el)
+{
+  return strcmp(key, *(char * const *)el);
+}
+
+/* Times lookups of variable-like names in an owl_dict against a
+ * binary search of the same keys in a sorted array, as owl_dict used
+ * to store them. */
+static void owl_dict_benchmark(void)
+{
+  const int nkeys = 200, nlookups = 200000;
+  owl_dict d;
+  GPtrArray *keys;
+  gint64 t0, t1, t2;
+  int i, found = 0;
+
+  owl_dict_create(&d);
+  for (i = 0; i < nkeys; i++) {
+    char *key = g_strdup_printf("some-variable-%d", i);
+    owl_dict_insert_element(&d, key, GINT_TO_POINTER(i + 1), NULL);
+    g_free(key);
+  }
+  keys = owl_dict_get_keys(&d);
+
+  t0 = g_get_monotonic_time();
+  for (i = 0; i < nlookups; i++)
+    found += owl_dict_find_element(&d, keys->pdata[i % nkeys]) != NULL;
+  t1 = g_get_monotonic_time();
+  for (i = 0; i < nlookups; i++)
+    found += bsearch(keys->pdata[i % nkeys], keys->pdata, nkeys,
+                     sizeof(char *), owl_dict_benchmark_compare) != NULL;
+  t2 = g_get_monotonic_time();
+
+  printf("# owl_dict: %d lookups in %d keys: hashed %dus, sorted array %dus (%d found)\n",
+         nlookups, nkeys, (int)(t1 - t0), (int)(t2 - t1), found);
+  owl_ptr_array_free(keys, g_free);
+  owl_dict_cleanup(&d, NULL);
+}
+
 int owl_dict_regtest(void) {
   owl_dict d;
   GPtrArray *l;
   int numfailed=0;
+  int i;
+  bool ok = true;
+  char *key;
   char *av = g_strdup("aval"), *bv = g_strdup("bval"), *cv = g_strdup("cval"),
     *dv = g_strdup("dval");
 
@@ -326,6 +384,38 @@ int owl_dict_regtest(void) {
   g_free(cv);
   g_free(dv);
 
+  /* enough keys to grow the table, with removals in the middle of
+   * probe runs */
+  owl_dict_create(&d);
+  for (i = 0; i < 1000; i++) {
+    key = g_strdup_printf("key%d", i);
+    owl_dict_insert_element(&d, key, GINT_TO_POINTER(i + 1), NULL);
+    g_free(key);
+  }
+  for (i = 0; i < 1000; i += 3) {
+    key = g_strdup_printf("key%d", i);
+    if (owl_dict_remove_element(&d, key) != GINT_TO_POINTER(i + 1)) ok = false;
+    g_free(key);
+  }
+  FAIL_UNLESS("remove many", ok);
+  for (i = 0; i < 1000; i++) {
+    key = g_strdup_printf("key%d", i);
+    if (owl_dict_find_element(&d, key) != (i % 3 ? GINT_TO_POINTER(i + 1) : NULL)) ok = false;
+    g_free(key);
+  }
+  FAIL_UNLESS("find after removals", ok);
+  FAIL_UNLESS("size after removals", owl_dict_get_size(&d) == 666);
+  l = owl_dict_get_keys(&d);
+  for (i = 1; i < l->len; i++) {
+    if (strcmp(l->pdata[i - 1], l->pdata[i]) >= 0) ok = false;
+  }
+  FAIL_UNLESS("get_keys sorted", ok && l->len == 666);
+  owl_ptr_array_free(l, g_free);
+  owl_dict_cleanup(&d, NULL);
+
+  if (tester_benchmark())
+    owl_dict_benchmark();
+
   /*  if (numfailed) printf("*** WARNING: failures encountered with owl_dict\n"); */
   printf("# END testing owl_dict (%d failures)\n", numfailed);
   return(numfailed);
@@ -425,11 +515,211 @@ int owl_variable_regtest(void) {
 
   owl_variable_dict_cleanup(&vd);
 
+  /* the generated accessors follow a variable replaced from perl */
+  owl_global_set_bell_on(&g);
+  owl_variable_dict_newvar_bool(&g.vars, "bell", false, "", "");
+  FAIL_UNLESS("replaced var keeps value", owl_global_is_bell(&g));
+  owl_global_set_bell_off(&g);
+  FAIL_UNLESS("accessor sets replaced var",
+              !owl_variable_get_bool(owl_variable_get_var(&g.vars, "bell")));
+  owl_global_set_bell_on(&g);
+
   /* if (numfailed) printf("*** WARNING: failures encountered with owl_variable\n"); */
   printf("# END testing owl_variable (%d failures)\n", numfailed);
   return(numfailed);
 }
 
+static void owl_message_test_count_attribute(const char *key, const char *value, void *data)
+{
+  (*(int *)data)++;
+}
+
+int owl_message_regtest(void) {
+  int numfailed = 0, count = 0, cachesize, resident, i;
+  unsigned int strings;
+  unsigned long misses;
+  owl_message m, m2, *mp;
+  owl_messagelist *ml, *ml2;
+  owl_regex re;
+  struct stat st;
+  char *path;
+  int fd;
+
+  printf("# BEGIN testing owl_message\n");
+
+  owl_message_init(&m);
+  FAIL_UNLESS("unset class", !strcmp(owl_message_get_class(&m), ""));
+  FAIL_UNLESS("unset attribute", owl_message_get_attribute_value(&m, "class") == NULL);
+  FAIL_UNLESS("default type", !strcmp(owl_message_get_type(&m), "generic"));
+
+  owl_message_set_class(&m, "owl");
+  owl_message_set_attribute(&m, "instance", "tester");
+  FAIL_UNLESS("core setter", !strcmp(owl_message_get_attribute_value(&m, "class"), "owl"));
+  FAIL_UNLESS("core attribute", !strcmp(owl_message_get_instance(&m), "tester"));
+  owl_message_set_class(&m, "barn");
+  FAIL_UNLESS("core replace", !strcmp(owl_message_get_class(&m), "barn"));
+
+  owl_message_set_attribute(&m, "zzz", "1");
+  owl_message_set_attribute(&m, "aaa", "2");
+  owl_message_set_attribute(&m, "mmm", "3");
+  owl_message_set_attribute(&m, "aaa", "4");
+  FAIL_UNLESS("extra attribute", !strcmp(owl_message_get_attribute_value(&m, "zzz"), "1"));
+  FAIL_UNLESS("extra replace", !strcmp(owl_message_get_attribute_value(&m, "aaa"), "4"));
+  FAIL_UNLESS("extra by quark",
+              !strcmp(owl_message_get_attribute_value_quark(&m, g_quark_from_string("mmm")), "3"));
+  FAIL_UNLESS("missing attribute", owl_message_get_attribute_value(&m, "nope") == NULL);
+
+  owl_message_foreach_attribute(&m, owl_message_test_count_attribute, &count);
+  FAIL_UNLESS("foreach", count == 5);
+
+  /* pooled fields are shared between messages */
+  strings = owl_strpool_get_stats()->strings;
+  owl_message_init(&m2);
+  owl_message_set_class(&m2, "barn");
+  owl_message_set_body(&m2, "barn");
+  FAIL_UNLESS("pooled field shared", owl_message_get_class(&m) == owl_message_get_class(&m2));
+  FAIL_UNLESS("body not pooled", owl_message_get_body(&m2) != owl_message_get_class(&m2));
+  FAIL_UNLESS("pool reused", owl_strpool_get_stats()->strings == strings);
+  owl_message_set_class(&m2, "unique-class-for-strpool");
+  FAIL_UNLESS("pool grows", owl_strpool_get_stats()->strings == strings + 1);
+  owl_message_cleanup(&m2);
+  FAIL_UNLESS("pool shrinks", owl_strpool_get_stats()->strings == strings);
+
+  /* the format cache evicts down to its budget, but keeps pinned
+   * messages and the one just formatted */
+  cachesize = owl_global_get_format_cache_size(&g);
+  owl_global_set_format_cache_size(&g, 0);
+  owl_message_init(&m2);
+  owl_message_set_type_admin(&m2);
+  owl_message_set_body(&m2, "one");
+  owl_message_set_body(&m, "two");
+  owl_message_unpin_formats();
+  owl_message_format(&m2);
+  owl_message_pin_format(&m2);
+  owl_message_format(&m);
+  FAIL_UNLESS("pinned format kept", m2.fmtext != NULL && m.fmtext != NULL);
+  misses = owl_message_get_fmtext_cache_stats()->misses;
+  owl_message_format(&m);
+  FAIL_UNLESS("format hit", owl_message_get_fmtext_cache_stats()->misses == misses);
+  owl_message_unpin_formats();
+  owl_message_invalidate_format(&m);
+  owl_message_format(&m);
+  FAIL_UNLESS("unpinned format evicted", m2.fmtext == NULL && m.fmtext != NULL);
+  misses = owl_message_get_fmtext_cache_stats()->misses;
+  FAIL_UNLESS("line count outlives format", owl_message_get_numlines(&m2) > 0);
+  FAIL_UNLESS("line count without formatting",
+              owl_message_get_fmtext_cache_stats()->misses == misses);
+  owl_message_invalidate_format(&m2);
+  owl_message_get_numlines(&m2);
+  FAIL_UNLESS("invalidated line count", owl_message_get_fmtext_cache_stats()->misses == misses + 1);
+  owl_message_cleanup(&m2);
+  owl_global_set_format_cache_size(&g, cachesize);
+
+  /* bodies can be moved out to the message store and back */
+  owl_message_set_body(&m, "a body to spill");
+  FAIL_UNLESS("spill body", owl_msgstore_spill(&m) && m.fields[OWL_MESSAGE_FIELD_BODY] == NULL);
+  FAIL_UNLESS("load body", !strcmp(owl_message_get_body(&m), "a body to spill"));
+  FAIL_UNLESS("spill again", owl_msgstore_spill(&m) && m.fields[OWL_MESSAGE_FIELD_BODY] == NULL);
+  FAIL_UNLESS("body attribute", !strcmp(owl_message_get_attribute_value(&m, "body"), "a body to spill"));
+  owl_message_set_body(&m, "new body");
+  FAIL_UNLESS("replaced body", !strcmp(owl_message_get_body(&m), "new body") && m.spill_offset == -1);
+
+  owl_message_cleanup(&m);
+
+  /* all but the newest bodies are spilled, expunging or no */
+  resident = owl_global_get_resident_messages(&g);
+  owl_global_set_resident_messages(&g, 1);
+  ml = owl_messagelist_new();
+  for (i = 0; i < 6; i++) {
+    mp = g_slice_new(owl_message);
+    owl_message_create_admin(mp, "header", "a body to spill");
+    owl_messagelist_append_element(ml, mp);
+    /* the first two are expunged once the first three are spilled */
+    if (i == 3) {
+      owl_msgstore_spill_old(ml);
+      owl_messagelist_delete_and_expunge_element(ml, 0);
+      owl_messagelist_delete_and_expunge_element(ml, 0);
+    }
+  }
+  owl_msgstore_spill_old(ml);
+  count = 0;
+  for (i = 0; i < owl_messagelist_get_size(ml); i++)
+    count += ((owl_message *)owl_messagelist_get_element(ml, i))->fields[OWL_MESSAGE_FIELD_BODY] == NULL;
+  FAIL_UNLESS("spill old after expunge", count == 3);
+  owl_messagelist_delete(ml, true);
+  owl_global_set_resident_messages(&g, resident);
+
+  /* the message list survives a snapshot */
+  ml = owl_messagelist_new();
+  mp = g_slice_new(owl_message);
+  owl_message_create_admin(mp, "header", "first");
+  owl_message_set_direction_in(mp);
+  owl_message_set_time(mp, 1000000000);
+  owl_messagelist_append_element(ml, mp);
+  mp = g_slice_new(owl_message);
+  owl_message_create_admin(mp, "header", "second");
+  owl_message_set_hostname(mp, "host.example.com");
+  owl_message_mark_delete(mp);
+  owl_messagelist_append_element(ml, mp);
+  fd = g_file_open_tmp("barnowl-tester-XXXXXX", &path, NULL);
+  close(fd);
+  FAIL_UNLESS("snapshot save", owl_snapshot_save(path, ml));
+  ml2 = owl_messagelist_new();
+  FAIL_UNLESS("snapshot load", owl_snapshot_load_file(path, ml2, NULL) == 2);
+  mp = owl_messagelist_get_element(ml2, 0);
+  FAIL_UNLESS("snapshot body", !strcmp(owl_message_get_body(mp), "first"));
+  FAIL_UNLESS("snapshot attribute",
+              !strcmp(owl_message_get_attribute_value(mp, "adminheader"), "header"));
+  FAIL_UNLESS("snapshot direction", owl_message_is_direction_in(mp));
+  FAIL_UNLESS("snapshot time", owl_message_get_time(mp) == 1000000000);
+  FAIL_UNLESS("snapshot ids in use are not reused",
+              owl_message_get_id(mp) > owl_message_get_id(owl_messagelist_get_element(ml, 1)));
+  mp = owl_messagelist_get_element(ml2, 1);
+  FAIL_UNLESS("snapshot delete", owl_message_is_delete(mp));
+  FAIL_UNLESS("snapshot hostname", !strcmp(owl_message_get_hostname(mp), "host.example.com"));
+  FAIL_UNLESS("snapshot order",
+              owl_message_get_id(mp) > owl_message_get_id(owl_messagelist_get_element(ml2, 0)));
+  owl_messagelist_delete(ml2, true);
+  FAIL_UNLESS("snapshot damaged", stat(path, &st) == 0 && truncate(path, st.st_size - 1) == 0);
+  ml2 = owl_messagelist_new();
+  FAIL_UNLESS("snapshot damaged tail", owl_snapshot_load_file(path, ml2, NULL) == 1);
+  owl_messagelist_delete(ml2, true);
+  owl_messagelist_delete(ml, true);
+  unlink(path);
+  g_free(path);
+
+  /* text signatures rule out messages without running regexes */
+  owl_message_init(&m);
+  owl_message_set_sender(&m, "owl-user");
+  owl_message_set_body(&m, "Hello @b(World) from the barn");
+  FAIL_UNLESS("no signature yet", owl_message_may_contain(&m, "xylophonequartz", false));
+  FAIL_UNLESS("signature body", owl_message_may_contain(&m, "from the barn", true));
+  FAIL_UNLESS("signature case", owl_message_may_contain(&m, "hello", true));
+  FAIL_UNLESS("signature stripped", owl_message_may_contain(&m, "hello world", true));
+  FAIL_UNLESS("signature header", owl_message_may_contain(&m, "owl-user", true));
+  FAIL_UNLESS("signature absent", !owl_message_may_contain(&m, "xylophonequartz", true));
+
+  /* searching fields sees the body as displayed, without formatting */
+  FAIL_UNLESS("plain body", !strcmp(owl_message_get_plain_body(&m), "Hello World from the barn"));
+  owl_regex_create_quoted(&re, "world from");
+  misses = owl_message_get_fmtext_cache_stats()->misses;
+  FAIL_UNLESS("search fields", owl_message_search(&m, &re));
+  FAIL_UNLESS("search without formatting", owl_message_get_fmtext_cache_stats()->misses == misses);
+  owl_regex_cleanup(&re);
+  owl_regex_create_quoted(&re, "OWL-USER");
+  FAIL_UNLESS("search sender", owl_message_search(&m, &re));
+  owl_regex_cleanup(&re);
+  owl_regex_create_quoted(&re, "@b(");
+  FAIL_UNLESS("search skips formatting", !owl_message_search(&m, &re));
+  owl_regex_cleanup(&re);
+  owl_message_set_body(&m, "xylophonequartz");
+  FAIL_UNLESS("signature follows body", owl_message_may_contain(&m, "xylophonequartz", false));
+  owl_message_cleanup(&m);
+
+  printf("# END testing owl_message (%d failures)\n", numfailed);
+  return numfailed;
+}
+
 static int owl_filter_test_string(const char *filt, const owl_message *m, int shouldmatch)
 {
   owl_filter *f;
@@ -457,6 +747,10 @@ int owl_filter_regtest(void) {
   int numfailed=0;
   owl_message m;
   owl_filter *f1, *f2, *f3, *f4, *f5;
+  owl_regex re;
+  int start, end, fg, bg, fg0, bg0;
+  char *name, *filt;
+  int i;
 
   owl_message_init(&m);
   owl_message_set_type_zephyr(&m);
@@ -517,11 +811,261 @@ int owl_filter_regtest(void) {
   FAIL_UNLESS("DAG", (f5 = owl_filter_new_fromstring("dag", "filter f1 or filter f1")) != NULL);
   owl_filter_delete(f5);
 
+  /* filters that expand too far are rejected rather than truncated */
+  owl_global_add_filter(&g, owl_filter_new_fromstring("chain0", "class owl"));
+  for (i = 1; i <= OWL_FILTER_MAX_DEPTH + 1; i++) {
+    name = g_strdup_printf("chain%d", i);
+    filt = g_strdup_printf("filter chain%d", i - 1);
+    f5 = owl_filter_new_fromstring(name, filt);
+    g_free(filt);
+    g_free(name);
+    if (!f5)
+      break;
+    owl_global_add_filter(&g, f5);
+  }
+  FAIL_UNLESS("too deep", i == OWL_FILTER_MAX_DEPTH + 1);
+  while (i-- > 0) {
+    name = g_strdup_printf("chain%d", i);
+    owl_global_remove_filter(&g, name);
+    g_free(name);
+  }
+  owl_global_add_filter(&g, owl_filter_new_fromstring("double0", "class owl"));
+  for (i = 1; i < 30; i++) {
+    name = g_strdup_printf("double%d", i);
+    filt = g_strdup_printf("filter double%d or filter double%d", i - 1, i - 1);
+    f5 = owl_filter_new_fromstring(name, filt);
+    g_free(filt);
+    g_free(name);
+    if (!f5)
+      break;
+    owl_global_add_filter(&g, f5);
+  }
+  FAIL_UNLESS("too large", i < 30);
+  TEST_FILTER("filter double1", 1);
+  while (i-- > 0) {
+    name = g_strdup_printf("double%d", i);
+    owl_global_remove_filter(&g, name);
+    g_free(name);
+  }
+
+  /* inlined filters follow redefinition and removal */
+  f5 = owl_filter_new_fromstring("inline", "not filter f1 and instance tester");
+  FAIL_UNLESS("inline missing", owl_filter_message_match(f5, &m));
+  owl_global_add_filter(&g, owl_filter_new_fromstring("f1", "class owl"));
+  FAIL_UNLESS("inline defined", !owl_filter_message_match(f5, &m));
+  owl_global_add_filter(&g, owl_filter_new_fromstring("f1", "class ^other$"));
+  FAIL_UNLESS("inline redefined", owl_filter_message_match(f5, &m));
+  owl_global_add_filter(&g, owl_filter_new_fromstring("f1", "sender owl or foo baz"));
+  FAIL_UNLESS("inline attribute", !owl_filter_message_match(f5, &m));
+  owl_global_remove_filter(&g, "f1");
+  FAIL_UNLESS("inline removed", owl_filter_message_match(f5, &m));
+  owl_filter_delete(f5);
+
+  /* colors kept with a message follow the colored filters */
+  owl_message_get_colors(&m, &fg0, &bg0);
+  f1 = owl_filter_new_fromstring("colortest", "class owl");
+  owl_filter_set_fgcolor(f1, OWL_COLOR_RED);
+  owl_global_add_filter(&g, f1);
+  owl_message_get_colors(&m, &fg, &bg);
+  FAIL_UNLESS("color added", fg == OWL_COLOR_RED && bg == bg0);
+  owl_filter_set_fgcolor(f1, OWL_COLOR_BLUE);
+  owl_message_get_colors(&m, &fg, &bg);
+  FAIL_UNLESS("color changed", fg == OWL_COLOR_BLUE);
+  f2 = owl_filter_new_fromstring("colortest2", "deleted true");
+  owl_filter_set_bgcolor(f2, OWL_COLOR_GREEN);
+  owl_global_add_filter(&g, f2);
+  owl_message_get_colors(&m, &fg, &bg);
+  FAIL_UNLESS("color not matched", bg == bg0);
+  owl_message_mark_delete(&m);
+  owl_message_get_colors(&m, &fg, &bg);
+  FAIL_UNLESS("color after message change", fg == OWL_COLOR_BLUE && bg == OWL_COLOR_GREEN);
+  owl_message_unmark_delete(&m);
+  owl_global_remove_filter(&g, "colortest2");
+  owl_global_remove_filter(&g, "colortest");
+  owl_message_get_colors(&m, &fg, &bg);
+  FAIL_UNLESS("color removed", fg == fg0 && bg == bg0);
+
+  /* literal text a regex requires */
+  owl_regex_create(&re, "^Foo.bar+baz$");
+  FAIL_UNLESS("literal", !g_strcmp0(owl_regex_get_literal(&re), "foo"));
+  owl_regex_cleanup(&re);
+  owl_regex_create(&re, "hello?");
+  FAIL_UNLESS("literal optional", !g_strcmp0(owl_regex_get_literal(&re), "hell"));
+  owl_regex_cleanup(&re);
+  owl_regex_create(&re, "a\\.b[xyz]longest");
+  FAIL_UNLESS("literal escaped", !g_strcmp0(owl_regex_get_literal(&re), "longest"));
+  owl_regex_cleanup(&re);
+  owl_regex_create(&re, "a\\.bcd");
+  FAIL_UNLESS("literal escape", !g_strcmp0(owl_regex_get_literal(&re), "a.bcd"));
+  owl_regex_cleanup(&re);
+  owl_regex_create(&re, "hello|world");
+  FAIL_UNLESS("literal alternation", owl_regex_get_literal(&re) == NULL);
+  owl_regex_cleanup(&re);
+  owl_regex_create(&re, "!hello");
+  FAIL_UNLESS("literal negated", owl_regex_get_literal(&re) == NULL);
+  owl_regex_cleanup(&re);
+
+  /* plain text regexes are matched without the regex engine, with
+   * the same results */
+  owl_regex_create(&re, "^Foo\\.bar$");
+  FAIL_UNLESS("exact kind", re.kind == OWL_REGEX_KIND_EXACT);
+  FAIL_UNLESS("exact match", owl_regex_compare(&re, "foo.BAR", NULL, NULL) == 0);
+  FAIL_UNLESS("exact mismatch", owl_regex_compare(&re, "foo.bars", NULL, NULL) != 0);
+  FAIL_UNLESS("exact dot", owl_regex_compare(&re, "fooxbar", NULL, NULL) != 0);
+  owl_regex_cleanup(&re);
+  owl_regex_create(&re, "^un");
+  FAIL_UNLESS("prefix", owl_regex_compare(&re, "Unclass", NULL, NULL) == 0 &&
+              owl_regex_compare(&re, "class", NULL, NULL) != 0);
+  owl_regex_cleanup(&re);
+  owl_regex_create(&re, ".d$");
+  FAIL_UNLESS("suffix uses the engine", re.kind == OWL_REGEX_KIND_ENGINE);
+  owl_regex_cleanup(&re);
+  owl_regex_create(&re, "\\.d$");
+  FAIL_UNLESS("suffix", owl_regex_compare(&re, "foo.d", &start, &end) == 0 &&
+              start == 3 && end == 5);
+  owl_regex_cleanup(&re);
+  owl_regex_create(&re, "barn");
+  FAIL_UNLESS("contains", owl_regex_compare(&re, "the BARN owl", &start, &end) == 0 &&
+              start == 4 && end == 8);
+  FAIL_UNLESS("contains mismatch", owl_regex_compare(&re, "the owl", NULL, NULL) != 0);
+  FAIL_UNLESS("contains non-ascii", owl_regex_compare(&re, "the b\xc3\xa1rn", NULL, NULL) != 0);
+  owl_regex_cleanup(&re);
+  owl_regex_create(&re, "!^foo$");
+  FAIL_UNLESS("negated plain text", re.kind == OWL_REGEX_KIND_EXACT &&
+              owl_regex_compare(&re, "foo", NULL, NULL) != 0 &&
+              owl_regex_compare(&re, "bar", NULL, NULL) == 0);
+  owl_regex_cleanup(&re);
+
+  owl_regex_create(&re, "^caf\xc3\xa9$");
+  FAIL_UNLESS("exact non-ascii", owl_regex_compare(&re, "CAF\xc3\x89", NULL, NULL) == 0);
+  owl_regex_cleanup(&re);
+
+  /* the shapes smartfilter and friends generate */
+  owl_regex_create(&re, OWL_REGEX_UN_PREFIX "foo" OWL_REGEX_D_SUFFIX);
+  FAIL_UNLESS("decorated kind", re.kind == OWL_REGEX_KIND_DECORATED);
+  FAIL_UNLESS("decorated", owl_regex_compare(&re, "foo", NULL, NULL) == 0 &&
+              owl_regex_compare(&re, "UNunfoo.D.d", NULL, NULL) == 0);
+  FAIL_UNLESS("decorated mismatch", owl_regex_compare(&re, "unfoo.dx", NULL, NULL) != 0 &&
+              owl_regex_compare(&re, "nfoo", NULL, NULL) != 0 &&
+              owl_regex_compare(&re, "foo.", NULL, NULL) != 0);
+  owl_regex_cleanup(&re);
+  owl_regex_create(&re, OWL_REGEX_UN_PREFIX "unix" OWL_REGEX_D_SUFFIX);
+  FAIL_UNLESS("decorated un text", owl_regex_compare(&re, "unix", NULL, NULL) == 0 &&
+              owl_regex_compare(&re, "ununix.d", NULL, NULL) == 0 &&
+              owl_regex_compare(&re, "ix", NULL, NULL) != 0);
+  owl_regex_cleanup(&re);
+  owl_regex_create(&re, ".*");
+  FAIL_UNLESS("any", re.kind == OWL_REGEX_KIND_ANY &&
+              owl_regex_compare(&re, "", NULL, NULL) == 0 &&
+              owl_regex_compare(&re, "anything", NULL, NULL) == 0);
+  owl_regex_cleanup(&re);
+
+  /* whatever the engine, regexes mean what POSIX says */
+  owl_regex_create(&re, "[a\\]b]");
+  FAIL_UNLESS("backslash in brackets", owl_regex_compare(&re, "]", NULL, NULL) != 0 &&
+              owl_regex_compare(&re, "\\b]", NULL, NULL) == 0);
+  owl_regex_cleanup(&re);
+  owl_regex_create(&re, "x\\d");
+  FAIL_UNLESS("unknown escape", owl_regex_compare(&re, "x5", NULL, NULL) != 0);
+  owl_regex_cleanup(&re);
+
+  /* an or of exact matches is looked up in a set */
+  TEST_FILTER("sender ^a$ or sender ^OWL-USER$ or sender ^b$", 1);
+  TEST_FILTER("sender ^a$ or ( sender ^c$ or sender ^b$ )", 0);
+  TEST_FILTER("sender ^a$ or sender ^owl-user$ or instance ^b$", 1);
+  TEST_FILTER("not ( sender ^a$ or sender ^owl-user$ or sender ^b$ )", 0);
+
+  /* an indexed element agrees with the regex */
+  owl_message_build_textsig(&m);
+  TEST_FILTER("sender owl-user", 1);
+  TEST_FILTER("sender xylophone", 0);
+  TEST_FILTER("instance TESTER", 1);
+
+  /* ... including for a type the getter makes up */
+  owl_message_cleanup(&m);
+  owl_message_init(&m);
+  owl_message_build_textsig(&m);
+  TEST_FILTER("type generic", 1);
+
   owl_message_cleanup(&m);
 
   return 0;
 }
 
+static void owl_view_test_add_message(const char *class)
+{
+  owl_message *m = g_slice_new(owl_message);
+  owl_message_init(m);
+  owl_message_set_class(m, class);
+  owl_messagelist_append_element(owl_global_get_msglist(&g), m);
+  owl_view_consider_message(owl_global_get_current_view(&g), m);
+}
+
+int owl_view_regtest(void) {
+  int numfailed = 0;
+  owl_view *v = owl_global_get_current_view(&g);
+  owl_messagelist *ml = owl_global_get_msglist(&g);
+  owl_filter *f;
+  GHashTable *doomed;
+  int i, base, visited;
+
+  printf("# BEGIN testing owl_view\n");
+
+  base = owl_messagelist_get_size(ml);
+  owl_global_add_filter(&g, owl_filter_new_fromstring("view-test", "class ^viewtest$"));
+  for (i = 0; i < 4; i++)
+    owl_view_test_add_message(i % 2 ? "viewtest" : "other");
+
+  owl_view_new_filter(v, owl_global_get_filter(&g, "view-test"));
+  FAIL_UNLESS("narrowed view", 2 == owl_view_get_size(v));
+  owl_view_new_filter(v, owl_global_get_filter(&g, "all"));
+  FAIL_UNLESS("all view", base + 4 == owl_view_get_size(v));
+
+  /* messages which arrive while a view is cached are picked up */
+  owl_view_test_add_message("viewtest");
+  owl_view_new_filter(v, owl_global_get_filter(&g, "view-test"));
+  FAIL_UNLESS("cached view caught up", 3 == owl_view_get_size(v));
+  FAIL_UNLESS("cached view in order",
+              owl_message_get_id(owl_view_get_element(v, 1)) <
+              owl_message_get_id(owl_view_get_element(v, 2)));
+
+  /* redefining a filter throws away its cached view */
+  owl_view_new_filter(v, owl_global_get_filter(&g, "all"));
+  f = owl_filter_new_fromstring("view-test", "class ^other$");
+  owl_global_add_filter(&g, f);
+  owl_view_new_filter(v, f);
+  FAIL_UNLESS("redefined filter", 2 == owl_view_get_size(v));
+
+  /* expunged messages disappear from cached views too */
+  owl_view_new_filter(v, owl_global_get_filter(&g, "all"));
+  /* the background signer only visits messages new since its last pass */
+  owl_textindex_start();
+  owl_textindex_run(G_MAXINT64, NULL);
+  owl_view_test_add_message("viewtest");
+  owl_textindex_start();
+  visited = 0;
+  FAIL_UNLESS("textindex visits new messages only",
+              owl_textindex_run(G_MAXINT64, &visited) && visited == 1);
+
+  doomed = g_hash_table_new(g_direct_hash, g_direct_equal);
+  for (i = base; i < owl_messagelist_get_size(ml); i++)
+    g_hash_table_insert(doomed, owl_messagelist_get_element(ml, i),
+                        owl_messagelist_get_element(ml, i));
+  owl_view_forget_messages(doomed);
+  g_hash_table_destroy(doomed);
+  while (owl_messagelist_get_size(ml) > base)
+    owl_messagelist_delete_and_expunge_element(ml, base);
+  FAIL_UNLESS("expunged from view", base == owl_view_get_size(v));
+  owl_view_new_filter(v, owl_global_get_filter(&g, "view-test"));
+  FAIL_UNLESS("expunged from cached view", 0 == owl_view_get_size(v));
+
+  owl_view_new_filter(v, owl_global_get_filter(&g, "all"));
+  owl_global_remove_filter(&g, "view-test");
+
+  printf("# END testing owl_view (%d failures)\n", numfailed);
+  return numfailed;
+}
+
 int owl_editwin_regtest(void) {
   int numfailed = 0;
   const char *p;
@@ -621,6 +1165,44 @@ int owl_editwin_regtest(void) {
   return numfailed;
 }
 
+/* Draws lines [aline, aline+lines) and columns [acol, bcol] of 'f'
+ * by way of truncated copies, and straight from its index, and returns
+ * whether the two windows look the same. */
+static bool owl_fmtext_test_range(const owl_fmtext *f, int aline, int lines, int acol, int bcol)
+{
+  WINDOW *a = newwin(6, 24, 0, 0), *b = newwin(6, 24, 0, 0);
+  owl_fmtext fm1, fm2;
+  cchar_t ca, cb;
+  wchar_t wa[CCHARW_MAX + 1], wb[CCHARW_MAX + 1];
+  attr_t aa, ab;
+  short pa, pb;
+  int y, x;
+  bool same = true;
+
+  owl_fmtext_init_null(&fm1);
+  owl_fmtext_init_null(&fm2);
+  owl_fmtext_truncate_lines(f, aline, lines, &fm1);
+  owl_fmtext_truncate_cols(&fm1, acol, bcol, &fm2);
+  owl_fmtext_curs_waddstr(&fm2, (FAKE_WINDOW *)a, OWL_FMTEXT_ATTR_NONE, OWL_COLOR_DEFAULT, OWL_COLOR_DEFAULT);
+  owl_fmtext_curs_waddstr_range(f, (FAKE_WINDOW *)b, aline, lines, acol, bcol,
+                                OWL_FMTEXT_ATTR_NONE, OWL_COLOR_DEFAULT, OWL_COLOR_DEFAULT);
+  owl_fmtext_cleanup(&fm1);
+  owl_fmtext_cleanup(&fm2);
+
+  for (y = 0; y < 6; y++) {
+    for (x = 0; x < 24; x++) {
+      mvwin_wch(a, y, x, &ca);
+      mvwin_wch(b, y, x, &cb);
+      getcchar(&ca, wa, &aa, &pa, NULL);
+      getcchar(&cb, wb, &ab, &pb, NULL);
+      if (wcscmp(wa, wb) || aa != ab || pa != pb) same = false;
+    }
+  }
+  delwin(a);
+  delwin(b);
+  return same;
+}
+
 int owl_fmtext_regtest(void) {
   int numfailed = 0;
   int start, end;
@@ -756,6 +1338,24 @@ int owl_fmtext_regtest(void) {
   owl_fmtext_line_extents(&fm1, 2, &start, &end);
   FAIL_UNLESS("point to end of buffer", end == owl_fmtext_num_bytes(&fm1));
 
+  /* Drawing from the index agrees with drawing truncated copies. */
+  owl_fmtext_clear(&fm1);
+  owl_fmtext_append_normal(&fm1, "plain line\n\n");
+  owl_fmtext_append_bold(&fm1, "bold ");
+  owl_fmtext_append_normal_color(&fm1, "red text\n", OWL_COLOR_RED, OWL_COLOR_DEFAULT);
+  owl_fmtext_append_normal(&fm1, "a\ttab\tand \xe4\xb8\xad\xe6\x96\x87 wide\n");
+  owl_fmtext_append_reverse(&fm1, "reversed all the way to the newline\n");
+  owl_fmtext_append_normal(&fm1, "ab\n");
+  owl_fmtext_append_normal(&fm1, "no newline");
+  FAIL_UNLESS("range all", owl_fmtext_test_range(&fm1, 0, 8, 0, 23));
+  FAIL_UNLESS("range lines", owl_fmtext_test_range(&fm1, 2, 3, 0, 23));
+  FAIL_UNLESS("range cols", owl_fmtext_test_range(&fm1, 0, 8, 3, 9));
+  FAIL_UNLESS("range wide edge", owl_fmtext_test_range(&fm1, 3, 1, 1, 16));
+  FAIL_UNLESS("range wide start", owl_fmtext_test_range(&fm1, 3, 1, 16, 22));
+  FAIL_UNLESS("range past end", owl_fmtext_test_range(&fm1, 5, 4, 0, 23));
+  owl_fmtext_append_bold(&fm1, "\nmore");
+  FAIL_UNLESS("range after append", owl_fmtext_test_range(&fm1, 6, 2, 0, 23));
+
   owl_fmtext_cleanup(&fm1);
   owl_fmtext_cleanup(&fm2);
 
@@ -986,6 +1586,38 @@ int owl_history_regtest(void)
   return numfailed;
 }
 
+struct filter_test {
+  const char *in;
+  GString *streamed;
+  char *out;
+  int err, status;
+  int done;
+};
+
+static void filter_test_output(const char *data, gsize len, void *cbdata)
+{
+  struct filter_test *t = cbdata;
+  g_string_append_len(t->streamed, data, len);
+}
+
+static void filter_test_done(char *out, int err, int status, void *cbdata)
+{
+  struct filter_test *t = cbdata;
+  t->out = out;
+  t->err = err;
+  t->status = status;
+  t->done++;
+}
+
+/* Runs the default main context until every filter in t is done */
+static void filter_test_wait(struct filter_test *t, int n)
+{
+  int i;
+  for (i = 0; i < n; i++)
+    while (!t[i].done)
+      g_main_context_iteration(NULL, TRUE);
+}
+
 int call_filter_regtest(void)
 {
   int numfailed = 0;
@@ -1014,10 +1646,203 @@ int call_filter_regtest(void)
                                   strcmp(out, "") == 0));
   g_free(out); out = NULL;
 
+  /* more filters than may run at once, each with more input than
+   * fits in a pipe */
+  struct filter_test t[20];
+  char *ins[G_N_ELEMENTS(t)];
+  int i, ok = 1, once = 1;
+  for (i = 0; i < G_N_ELEMENTS(t); i++) {
+    ins[i] = g_strnfill(1 << 20, 'a' + i);
+    memset(&t[i], 0, sizeof(t[i]));
+    t[i].in = ins[i];
+    call_filter_async(cat_argv, ins[i], NULL, NULL, filter_test_done, &t[i]);
+  }
+  filter_test_wait(t, G_N_ELEMENTS(t));
+  for (i = 0; i < G_N_ELEMENTS(t); i++) {
+    ok = ok && t[i].err == 0 && t[i].status == 0 &&
+      t[i].out && strcmp(t[i].out, t[i].in) == 0;
+    once = once && t[i].done == 1;
+    g_free(t[i].out);
+  }
+  FAIL_UNLESS("call_filter_async cat", ok);
+  FAIL_UNLESS("call_filter_async done once", once);
+
+  memset(&t[0], 0, sizeof(t[0]));
+  t[0].streamed = g_string_new("");
+  call_filter_async(cat_argv, ins[0], NULL, filter_test_output, filter_test_done, &t[0]);
+  filter_test_wait(t, 1);
+  FAIL_UNLESS("call_filter_async streamed", (t[0].err == 0 &&
+                                             t[0].status == 0 &&
+                                             t[0].out == NULL &&
+                                             strcmp(t[0].streamed->str, ins[0]) == 0));
+  g_string_free(t[0].streamed, true);
+  for (i = 0; i < G_N_ELEMENTS(t); i++)
+    g_free(ins[i]);
+
+  const char *false_argv[] = { "false", NULL };
+  memset(&t[0], 0, sizeof(t[0]));
+  call_filter_async(false_argv, NULL, NULL, NULL, filter_test_done, &t[0]);
+  filter_test_wait(t, 1);
+  FAIL_UNLESS("call_filter_async false", (t[0].err == 0 &&
+                                          t[0].status != 0));
+  g_free(t[0].out);
+
+  const char *missing_argv[] = { "barnowl-no-such-filter", NULL };
+  memset(&t[0], 0, sizeof(t[0]));
+  call_filter_async(missing_argv, "Mangos!", NULL, NULL, filter_test_done, &t[0]);
+  filter_test_wait(t, 1);
+  FAIL_UNLESS("call_filter_async missing", (t[0].err != 0 && t[0].out == NULL));
+
+  ret = call_filter(missing_argv, "Mangos!", &out, &status);
+  FAIL_UNLESS("call_filter missing", (ret != 0 && out == NULL));
+
   printf("# END testing call_filter (%d failures)\n", numfailed);
   return numfailed;
 }
 
+#ifdef ZCRYPT_HAVE_DES
+/* Times encrypting and decrypting messages to a class whose key is in
+ * the crypt table at dir/.crypt-table, through a keyring and reading
+ * the files for every message, as zcrypt does. */
+static void zcrypt_benchmark(const char *dir, zcrypt_keyring *kr)
+{
+  const int nmessages = 10000;
+  const char *text = "The quick brown fox jumps over the lazy dog.\n";
+  char *home = g_strdup(g_getenv("HOME"));
+  char *enc, *dec;
+  gint64 t0, t1, t2;
+  int i, ok = 0;
+
+  g_setenv("HOME", dir, TRUE);
+  t0 = g_get_monotonic_time();
+  for (i = 0; i < nmessages; i++) {
+    enc = zcrypt_encrypt_message(kr, "secret", "bench", text);
+    dec = enc ? zcrypt_decrypt_message(kr, "secret", "bench", enc) : NULL;
+    ok += dec && !strcmp(dec, text);
+    g_free(enc);
+    g_free(dec);
+  }
+  t1 = g_get_monotonic_time();
+  for (i = 0; i < nmessages; i++) {
+    enc = zcrypt_encrypt_message(NULL, "secret", "bench", text);
+    dec = enc ? zcrypt_decrypt_message(NULL, "secret", "bench", enc) : NULL;
+    ok += dec && !strcmp(dec, text);
+    g_free(enc);
+    g_free(dec);
+  }
+  t2 = g_get_monotonic_time();
+  if (home)
+    g_setenv("HOME", home, TRUE);
+  else
+    g_unsetenv("HOME");
+  g_free(home);
+
+  printf("# zcrypt: %d messages encrypted and decrypted: keyring %dus, uncached %dus (%d ok)\n",
+         nmessages, (int)(t1 - t0), (int)(t2 - t1), ok);
+}
+#endif
+
+int zcrypt_regtest(void)
+{
+  int numfailed = 0;
+  const char *keyfile;
+#ifdef ZCRYPT_HAVE_DES
+  char *dir, *table, *key1, *key2, *contents, *out, *enc;
+  zcrypt_keyring *kr;
+#endif
+
+  printf("# BEGIN testing zcrypt\n");
+
+  FAIL_UNLESS("ParseCryptSpec AES",
+              ParseCryptSpec("AES: /tmp/key", &keyfile) == CIPHER_AES &&
+              !strcmp(keyfile, "/tmp/key"));
+  FAIL_UNLESS("ParseCryptSpec DES",
+              ParseCryptSpec("DES:/tmp/key", &keyfile) == CIPHER_DES &&
+              !strcmp(keyfile, "/tmp/key"));
+  FAIL_UNLESS("ParseCryptSpec bare",
+              ParseCryptSpec("/tmp/key", &keyfile) == CIPHER_DES &&
+              !strcmp(keyfile, "/tmp/key"));
+
+#ifdef ZCRYPT_HAVE_DES
+  dir = g_strdup("/tmp/barnowl-tester-XXXXXX");
+  FAIL_UNLESS("make directory", mkdtemp(dir) != NULL);
+  table = g_build_filename(dir, ".crypt-table", NULL);
+  key1 = g_build_filename(dir, "key1", NULL);
+  key2 = g_build_filename(dir, "key2", NULL);
+  g_file_set_contents(key1, "barnowl test key\n", -1, NULL);
+  g_file_set_contents(key2, "another key\n", -1, NULL);
+  contents = g_strdup_printf("crypt-default: DES:%s\n"
+                             "crypt-secret: %s\n"
+                             "crypt-secret-foo: AES:%s\n", key1, key2, key1);
+  g_file_set_contents(table, contents, -1, NULL);
+  g_free(contents);
+  kr = zcrypt_keyring_new(table);
+
+  out = zcrypt_keyring_lookup(kr, "secret", "foo");
+  FAIL_UNLESS("keyring instance", out && g_str_has_prefix(out, "AES:") && g_str_has_suffix(out, "/key1"));
+  g_free(out);
+  out = zcrypt_keyring_lookup(kr, "SECRET", "bar");
+  FAIL_UNLESS("keyring class", out && !strcmp(out, key2));
+  g_free(out);
+  out = zcrypt_keyring_lookup(kr, "other", "bar");
+  FAIL_UNLESS("keyring default", out && g_str_has_prefix(out, "DES:") && g_str_has_suffix(out, "/key1"));
+  g_free(out);
+
+  out = zcrypt_decrypt_des(kr, key1, "KUIJOPGGFGOJITMUHQUIGIHKTHLQGUMMNKKFJSSSPFUKHIRIHTQKFOFKMPRIJSRS\n");
+  FAIL_UNLESS("decrypt des", out && !strcmp(out, "Mangos!\nand more text here\n"));
+  g_free(out);
+  /* again, from the cached key schedule */
+  out = zcrypt_decrypt_des(kr, key1, "JOQJPGJKSQHRRHGU");
+  FAIL_UNLESS("decrypt des cached", out && !strcmp(out, "abc\n"));
+  g_free(out);
+  out = zcrypt_decrypt_des(NULL, key1, "JOQJPGJKSQHRRHGU");
+  FAIL_UNLESS("decrypt des uncached", out && !strcmp(out, "abc\n"));
+  g_free(out);
+
+  enc = zcrypt_encrypt_message(kr, "secret", "bar", "Mangos!");
+  out = enc ? zcrypt_decrypt_message(kr, "secret", "bar", enc) : NULL;
+  FAIL_UNLESS("encrypt and decrypt", out && !strcmp(out, "Mangos!\n"));
+  g_free(out);
+  out = enc ? zcrypt_decrypt_des(NULL, key2, enc) : NULL;
+  FAIL_UNLESS("encrypted with the class key", out && !strcmp(out, "Mangos!\n"));
+  g_free(out);
+  g_free(enc);
+
+  /* a changed keyfile is read again */
+  g_file_set_contents(key1, "some other key\n", -1, NULL);
+  out = zcrypt_decrypt_des(kr, key1, "JOQJPGJKSQHRRHGU");
+  FAIL_UNLESS("decrypt des new key", out && strcmp(out, "abc\n") != 0);
+  g_free(out);
+
+  /* and so is a changed crypt table */
+  contents = g_strdup_printf("crypt-secret: %s\n", key2);
+  g_file_set_contents(table, contents, -1, NULL);
+  g_free(contents);
+  out = zcrypt_keyring_lookup(kr, "other", "bar");
+  FAIL_UNLESS("keyring table changed", out == NULL);
+  g_free(out);
+
+  unlink(key1);
+  out = zcrypt_decrypt_des(kr, key1, "JOQJPGJKSQHRRHGU");
+  FAIL_UNLESS("decrypt des no keyfile", out == NULL);
+
+  if (tester_benchmark())
+    zcrypt_benchmark(dir, kr);
+
+  zcrypt_keyring_free(kr);
+  unlink(key2);
+  unlink(table);
+  rmdir(dir);
+  g_free(key1);
+  g_free(key2);
+  g_free(table);
+  g_free(dir);
+#endif
+
+  printf("# END testing zcrypt (%d failures)\n", numfailed);
+  return numfailed;
+}
+
 int owl_smartstrip_regtest(void)
 {
   int numfailed = 0;
@@ -1052,3 +1877,20 @@ int owl_smartstrip_regtest(void)
 
   return numfailed;
 }
+
+int owl_zephyr_budget_regtest(void)
+{
+  int numfailed = 0;
+
+  printf("# BEGIN testing owl_zephyr_dispatch_budget\n");
+
+  FAIL_UNLESS("budget idle", owl_zephyr_dispatch_budget(5000, 0, G_USEC_PER_SEC) == 5000);
+  FAIL_UNLESS("budget backlog", owl_zephyr_dispatch_budget(5000, 120, G_USEC_PER_SEC) == 15000);
+  FAIL_UNLESS("budget backlog capped", owl_zephyr_dispatch_budget(5000, 100000, G_USEC_PER_SEC) == 20000);
+  FAIL_UNLESS("budget typing", owl_zephyr_dispatch_budget(8000, 100000, 1000) == 2000);
+  FAIL_UNLESS("budget floor", owl_zephyr_dispatch_budget(0, 0, G_USEC_PER_SEC) > 0);
+  FAIL_UNLESS("budget typing floor", owl_zephyr_dispatch_budget(2000, 0, 0) > 0);
+
+  printf("# END testing owl_zephyr_dispatch_budget (%d failures)\n", numfailed);
+  return numfailed;
+}
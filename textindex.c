@@ -0,0 +1,180 @@
+#include "owl.h"
+
+/* Each message gets a signature of the text of its core fields: a
+ * small Bloom filter over their lowercased trigrams, with the body
+ * counted both as stored and with its zephyr formatting stripped.
+ * Searches over fields and regex filters check the literal text their
+ * regex needs against it, and pass over messages which can't contain
+ * it without running the regex.
+ *
+ * Signatures are built in the background, newest messages first, and
+ * on demand by searches. */
+
+#define OWL_TEXTSIG_BITS_PER_CHAR 4
+#define OWL_TEXTSIG_MIN_BITS 64
+/* Signatures stay in memory when bodies are spilled, so long texts
+ * get a fuller, less selective one rather than a bigger one. */
+#define OWL_TEXTSIG_MAX_BITS 512
+/* how long the background builder runs before yielding */
+#define OWL_TEXTINDEX_SLICE_USEC 5000
+
+static guint textindex_source = 0;
+/* The messages yet to be visited are those from textindex_next down
+ * to textindex_floor, newest first, and then those from textindex_seen
+ * up, which came in while that was under way.  Everything below the
+ * floor was visited before.  Expunging can shift messages past these
+ * marks; searches sign any they missed on demand. */
+static int textindex_next = -1;
+static int textindex_floor = 0;
+static int textindex_seen = 0;
+
+static inline guint32 owl_textsig_hash(const char *p)
+{
+  guint32 h = ((guint32)(guchar)g_ascii_tolower(p[0]) << 16) |
+              ((guint32)(guchar)g_ascii_tolower(p[1]) << 8) |
+              (guint32)(guchar)g_ascii_tolower(p[2]);
+  return h * 0x9E3779B1u;
+}
+
+/* The two bits a trigram sets, for a signature of mask + 1 bits */
+static inline guint32 owl_textsig_bit1(guint32 h, guint32 mask)
+{
+  return h & mask;
+}
+
+static inline guint32 owl_textsig_bit2(guint32 h, guint32 mask)
+{
+  return (h >> 16 | h << 16) & mask;
+}
+
+static void owl_textsig_add_text(guint64 *sig, guint32 mask, const char *text)
+{
+  guint32 h;
+
+  for (; text[0] && text[1] && text[2]; text++) {
+    h = owl_textsig_hash(text);
+    sig[owl_textsig_bit1(h, mask) / 64] |= G_GUINT64_CONSTANT(1) << (owl_textsig_bit1(h, mask) % 64);
+    sig[owl_textsig_bit2(h, mask) / 64] |= G_GUINT64_CONSTANT(1) << (owl_textsig_bit2(h, mask) % 64);
+  }
+}
+
+/* Computes m's signature.  The body is brought back from the message
+ * store if need be, hence the cast in callers. */
+void owl_message_build_textsig(owl_message *m)
+{
+  const char *texts[OWL_MESSAGE_NFIELDS + 2];
+  size_t len = 0;
+  guint32 bits = OWL_TEXTSIG_MIN_BITS;
+  int i, n = 0;
+
+  for (i = 0; i < OWL_MESSAGE_NFIELDS; i++) {
+    if (i == OWL_MESSAGE_FIELD_BODY && m->spill_offset >= 0)
+      owl_msgstore_load(m);
+    if (m->fields[i])
+      texts[n++] = m->fields[i];
+  }
+  /* filters match the type the getter falls back on, so sign that */
+  if (!m->fields[OWL_MESSAGE_FIELD_TYPE])
+    texts[n++] = owl_message_get_type(m);
+  /* searches see the body as displayed */
+  if (m->plainbody)
+    texts[n++] = m->plainbody;
+
+  for (i = 0; i < n; i++)
+    len += strlen(texts[i]);
+  while (bits < OWL_TEXTSIG_MAX_BITS && bits < len * OWL_TEXTSIG_BITS_PER_CHAR)
+    bits *= 2;
+
+  g_free(m->textsig);
+  m->textsig_words = bits / 64;
+  m->textsig = g_new0(guint64, m->textsig_words);
+  for (i = 0; i < n; i++)
+    owl_textsig_add_text(m->textsig, bits - 1, texts[i]);
+}
+
+void owl_message_clear_textsig(owl_message *m)
+{
+  g_free(m->textsig);
+  m->textsig = NULL;
+  m->textsig_words = 0;
+}
+
+/* Returns false if m's core fields can't contain 'literal', ignoring
+ * ASCII case, and true if they may.  Without a signature, one is
+ * built if 'build' is set, and otherwise the answer is true. */
+bool owl_message_may_contain(const owl_message *m, const char *literal, bool build)
+{
+  guint32 h, mask;
+  const char *p;
+
+  if (!m->textsig) {
+    if (!build) return true;
+    owl_message_build_textsig((owl_message *)m);
+  }
+  mask = m->textsig_words * 64 - 1;
+  for (p = literal; p[0] && p[1] && p[2]; p++) {
+    h = owl_textsig_hash(p);
+    if (!(m->textsig[owl_textsig_bit1(h, mask) / 64] & (G_GUINT64_CONSTANT(1) << (owl_textsig_bit1(h, mask) % 64))) ||
+        !(m->textsig[owl_textsig_bit2(h, mask) / 64] & (G_GUINT64_CONSTANT(1) << (owl_textsig_bit2(h, mask) % 64))))
+      return false;
+  }
+  return true;
+}
+
+/* Signs messages not yet visited until deadline, adding the number
+ * visited to *visited if that is non-NULL.  Returns true once there
+ * are none left. */
+bool owl_textindex_run(gint64 deadline, int *visited)
+{
+  owl_messagelist *ml = owl_global_get_msglist(&g);
+  int size = owl_messagelist_get_size(ml);
+  owl_message *m;
+
+  /* expunging may have moved messages down */
+  if (textindex_seen > size)
+    textindex_seen = size;
+  if (textindex_floor > textindex_seen)
+    textindex_floor = textindex_seen;
+  if (textindex_next >= textindex_seen)
+    textindex_next = textindex_seen - 1;
+
+  while (textindex_next >= textindex_floor || textindex_seen < size) {
+    if (textindex_next >= textindex_floor)
+      m = owl_messagelist_get_element(ml, textindex_next--);
+    else
+      m = owl_messagelist_get_element(ml, textindex_seen++);
+    if (!m->textsig)
+      owl_message_build_textsig(m);
+    if (visited)
+      (*visited)++;
+    if (g_get_monotonic_time() >= deadline)
+      return false;
+  }
+  return true;
+}
+
+static gboolean owl_textindex_build_some(gpointer data)
+{
+  if (!owl_textindex_run(g_get_monotonic_time() + OWL_TEXTINDEX_SLICE_USEC, NULL))
+    return TRUE;
+  textindex_source = 0;
+  return FALSE;
+}
+
+/* Starts signing the messages of the global message list not yet
+ * visited in the background, from the newest message down. */
+void owl_textindex_start(void)
+{
+  int size = owl_messagelist_get_size(owl_global_get_msglist(&g));
+
+  /* with nothing older left to do, the new messages go newest first,
+   * down to the ones already visited */
+  if (textindex_next < textindex_floor && textindex_seen < size) {
+    textindex_floor = textindex_seen;
+    textindex_next = size - 1;
+    textindex_seen = size;
+  }
+  if (!textindex_source)
+    textindex_source = g_idle_add_full(G_PRIORITY_LOW, owl_textindex_build_some,
+                                       NULL, NULL);
+}
@@ -120,6 +120,18 @@ void owl_variable_add_defaults(owl_vardict *vd)
   OWLVAR_BOOL( "txping" /* %OwlVarStub */, 1,
 	       "send pings", "" );
 
+  OWLVAR_INT_FULL( "zephyr_dispatch_budget" /* %OwlVarStub */, 5000,
+                   "microseconds to spend on incoming zephyrs at a time",
+                   "BarnOwl takes zephyrs off libzephyr's queue for up to this\n"
+                   "many microseconds before it goes back to the keyboard and\n"
+                   "the screen.  The time is stretched, up to four times, while\n"
+                   "a long queue is waiting, and cut to a quarter just after a\n"
+                   "keypress.  At least one zephyr is handled each time.\n"
+                   "'show zephyr' reports the zephyr traffic.\n",
+                   "int >= 0",
+                   owl_variable_int_validate_positive,
+                   NULL, NULL);
+
   OWLVAR_BOOL( "sepbar_disable" /* %OwlVarStub */, 0,
 	       "disable printing information in the separator bar", "" );
 
@@ -325,6 +337,68 @@ void owl_variable_add_defaults(owl_vardict *vd)
 	       "                 the cursor will be near the center.\n",
 	       "normal,top,neartop,center,paged,pagedcenter" );
 
+  OWLVAR_ENUM( "search_scope" /* %OwlVarStub */, OWL_SEARCHSCOPE_FIELDS,
+	       "what the search commands look through",
+	       "This controls what / and ? match the search text against:\n\n"
+	       "   fields    - The sender, recipient, class, instance,\n"
+	       "               opcode, realm, zsig and body of each message,\n"
+	       "               with formatting stripped from the body.\n"
+	       "               Messages are not formatted to be searched.\n"
+	       "   formatted - The text of each message as the current\n"
+	       "               style displays it.  This finds text the\n"
+	       "               style adds, but formats every message\n"
+	       "               searched, which is slow in a long view.\n",
+	       "fields,formatted" );
+
+  OWLVAR_INT_FULL( "format_cache_size" /* %OwlVarStub */, 4096,
+                   "kilobytes of formatted messages to keep",
+                   "BarnOwl keeps the formatted text of recently displayed\n"
+                   "messages, up to this many kilobytes, so that it does not\n"
+                   "need to run the style again when they are redisplayed.\n"
+                   "Messages on screen are kept even beyond this limit.\n"
+                   "'show memory' reports how well the cache is doing.\n",
+                   "int >= 0",
+                   owl_variable_int_validate_positive,
+                   NULL, NULL);
+
+  OWLVAR_INT_FULL( "format_prefetch" /* %OwlVarStub */, 50,
+                   "number of messages to format ahead of the screen",
+                   "While idle, BarnOwl formats up to this many messages above\n"
+                   "and below the screen, so that scrolling to them does not\n"
+                   "have to wait for the style.  Set to 0 to disable.\n",
+                   "int >= 0",
+                   owl_variable_int_validate_positive,
+                   NULL, NULL);
+
+  OWLVAR_INT_FULL( "resident_messages" /* %OwlVarStub */, 10000,
+                   "number of recent messages to keep entirely in memory",
+                   "The bodies of older messages are moved out to a temporary\n"
+                   "file, and read back in when needed, to keep long-running\n"
+                   "sessions small.  Zephyrs keep their original packet, which\n"
+                   "holds the body too, in memory.  Set to 0 to keep everything\n"
+                   "in memory.\n",
+                   "int >= 0",
+                   owl_variable_int_validate_positive,
+                   NULL, NULL);
+
+  OWLVAR_BOOL( "save_messages" /* %OwlVarStub */, 0,
+               "keep the message history across restarts",
+               "If set, the message list is saved to messages.snapshot\n"
+               "in the BarnOwl directory as messages arrive, and read back\n"
+               "in when BarnOwl starts.  The file holds the full text of\n"
+               "every message, so it is left off by default; turning it\n"
+               "off removes the file the next time BarnOwl starts.\n" );
+
+  OWLVAR_INT_FULL( "view_cache_size" /* %OwlVarStub */, 8,
+                   "number of recently used views to keep up to date",
+                   "BarnOwl remembers which messages matched the filters of\n"
+                   "this many recently used views, so that switching back to\n"
+                   "one of them only needs to look at new messages.  Set to 0\n"
+                   "to recompute views from scratch every time.\n",
+                   "int >= 0",
+                   owl_variable_int_validate_positive,
+                   NULL, NULL);
+
   OWLVAR_BOOL( "narrow-related" /* %OwlVarStub:narrow_related */, 1,
                "Make smartnarrow use broader filters",
                "Causes smartfilter to narrow to messages \"related\" to \n"
@@ -537,6 +611,10 @@ void owl_variable_dict_add_variable(owl_vardict * vardict,
     oldvalue = owl_variable_get_tostring(oldvar);
   }
   owl_dict_insert_element(vardict, var->name, var, (void (*)(void *))owl_variable_delete);
+  /* Perl replaced a variable: the accessors still point at the old
+   * one, which is gone. */
+  if (oldvar && vardict == &g.vars)
+    owl_global_resolve_varstubs(&g);
   /* Restore the old value. */
   if (oldvalue) {
     owl_variable_set_fromstring(var, oldvalue, 0);
@@ -1,10 +1,190 @@
 #include "owl.h"
 
+/* The message lists of recently used views are kept in a cache keyed
+ * by filter name, so that switching back to one of them only needs to
+ * look at the messages that arrived since we left it. */
+typedef struct _owl_view_cache_ent {         /* noproto */
+  char *filtname;
+  owl_messagelist *ml;
+  int nconsidered;              /* global messages already matched */
+} owl_view_cache_ent;
+
+static void owl_view_cache_ent_delete(owl_view_cache_ent *ent)
+{
+  owl_messagelist_delete(ent->ml, false);
+  g_free(ent->filtname);
+  g_slice_free(owl_view_cache_ent, ent);
+}
+
+/* add global messages from index 'start' on that match the filter */
+static void owl_view_consider_from(const owl_filter *f, owl_messagelist *ml, int start)
+{
+  int i, j;
+  const owl_messagelist *gml;
+  owl_message *m;
+
+  gml=owl_global_get_msglist(&g);
+  j=owl_messagelist_get_size(gml);
+  for (i=start; i<j; i++) {
+    m=owl_messagelist_get_element(gml, i);
+    if (owl_filter_message_match(f, m)) {
+      owl_messagelist_append_element(ml, m);
+    }
+  }
+}
+
+/* Hand the view's message list over to the cache, or free it if it
+ * can't be reused later. */
+static void owl_view_cache_put(owl_view *v)
+{
+  GQueue *cache = owl_global_get_viewcache(&g);
+  owl_view_cache_ent *ent;
+
+  if (v->stale || owl_global_get_view_cache_size(&g) <= 0 ||
+      owl_filter_is_volatile(v->filter)) {
+    owl_messagelist_delete(v->ml, false);
+    v->ml = NULL;
+    return;
+  }
+
+  ent = g_slice_new(owl_view_cache_ent);
+  ent->filtname = g_strdup(owl_filter_get_name(v->filter));
+  ent->ml = v->ml;
+  ent->nconsidered = owl_messagelist_get_size(owl_global_get_msglist(&g));
+  v->ml = NULL;
+  g_queue_push_head(cache, ent);
+
+  while (g_queue_get_length(cache) > owl_global_get_view_cache_size(&g))
+    owl_view_cache_ent_delete(g_queue_pop_tail(cache));
+}
+
+/* Take the cached message list for the filter out of the cache and
+ * bring it up to date, or return NULL if there is none. */
+static owl_messagelist *owl_view_cache_take(const owl_filter *f)
+{
+  GQueue *cache = owl_global_get_viewcache(&g);
+  owl_view_cache_ent *ent;
+  owl_messagelist *ml;
+  GList *l;
+
+  for (l = cache->head; l; l = l->next) {
+    ent = l->data;
+    if (!strcmp(ent->filtname, owl_filter_get_name(f))) {
+      g_queue_delete_link(cache, l);
+      owl_view_consider_from(f, ent->ml, ent->nconsidered);
+      ml = ent->ml;
+      ent->ml = NULL;
+      g_free(ent->filtname);
+      g_slice_free(owl_view_cache_ent, ent);
+      return ml;
+    }
+  }
+  return NULL;
+}
+
+/* Called before the filter named 'filtname' is redefined or removed.
+ * Drops every cached message list whose filter refers to it, and marks
+ * the current view so its list is not cached when we leave it. */
+void owl_view_invalidate_filter(const char *filtname)
+{
+  GQueue *cache = owl_global_get_viewcache(&g);
+  owl_view *v = owl_global_get_current_view(&g);
+  owl_view_cache_ent *ent;
+  const owl_filter *f;
+  GList *l, *next;
+
+  for (l = cache->head; l; l = next) {
+    next = l->next;
+    ent = l->data;
+    f = owl_global_get_filter(&g, ent->filtname);
+    if (f == NULL || owl_filter_depends_on(f, filtname)) {
+      g_queue_delete_link(cache, l);
+      owl_view_cache_ent_delete(ent);
+    }
+  }
+
+  if (v->filter && owl_filter_depends_on(v->filter, filtname))
+    v->stale = true;
+}
+
+/* Call before freeing the messages in 'doomed', a set of messages in
+ * the global message list, so that neither the current view nor any
+ * cached view refers to them afterwards. */
+void owl_view_forget_messages(GHashTable *doomed)
+{
+  GQueue *cache = owl_global_get_viewcache(&g);
+  owl_view *v = owl_global_get_current_view(&g);
+  owl_view_cache_ent *ent;
+  const owl_filter *f;
+  GList *l;
+  int remaining;
+
+  remaining = owl_messagelist_get_size(owl_global_get_msglist(&g))
+    - g_hash_table_size(doomed);
+
+  for (l = cache->head; l; l = l->next) {
+    ent = l->data;
+    /* Catch up first, so the entry is consistent with the global list
+     * once the doomed messages are gone from it. */
+    f = owl_global_get_filter(&g, ent->filtname);
+    if (f)
+      owl_view_consider_from(f, ent->ml, ent->nconsidered);
+    owl_messagelist_remove_set(ent->ml, doomed);
+    ent->nconsidered = remaining;
+  }
+
+  if (v->ml)
+    owl_messagelist_remove_set(v->ml, doomed);
+}
+
+/* Brings ml, the messages matching f, up to date with m.  Returns
+ * true if that added or removed m. */
+static bool owl_view_refilter_message(const owl_filter *f, owl_messagelist *ml, owl_message *m)
+{
+  int n = owl_messagelist_get_index_by_id(ml, owl_message_get_id(m));
+  bool match = owl_filter_message_match(f, m);
+
+  if (match && n < 0)
+    owl_messagelist_insert_element(ml, m);
+  else if (!match && n >= 0)
+    owl_messagelist_remove_element(ml, n);
+  else
+    return false;
+  return true;
+}
+
+/* Call after m, a message in the global message list, changed in a
+ * way that may change which filters match it, as when it has been
+ * decrypted.  Returns true if the current view gained or lost it. */
+bool owl_view_message_changed(owl_message *m)
+{
+  GQueue *cache = owl_global_get_viewcache(&g);
+  owl_view *v = owl_global_get_current_view(&g);
+  owl_view_cache_ent *ent;
+  const owl_filter *f;
+  GList *l;
+  int n;
+
+  n = owl_messagelist_get_index_by_id(owl_global_get_msglist(&g), owl_message_get_id(m));
+  for (l = cache->head; l; l = l->next) {
+    ent = l->data;
+    /* the rest is matched when the entry is taken */
+    if (n >= ent->nconsidered) continue;
+    f = owl_global_get_filter(&g, ent->filtname);
+    if (f)
+      owl_view_refilter_message(f, ent->ml, m);
+  }
+
+  if (!v->ml) return false;
+  return owl_view_refilter_message(v->filter, v->ml, m);
+}
+
 void owl_view_create(owl_view *v, const char *name, owl_filter *f, const owl_style *s)
 {
   v->name=g_strdup(name);
   v->filter=f;
   v->style=s;
+  v->stale=false;
   v->ml = owl_messagelist_new();
   owl_view_recalculate(v);
 }
@@ -27,30 +207,28 @@ void owl_view_consider_message(owl_view *v, owl_message *m)
  */
 void owl_view_recalculate(owl_view *v)
 {
-  int i, j;
-  const owl_messagelist *gml;
-  owl_message *m;
-
-  gml=owl_global_get_msglist(&g);
-
   /* nuke the old list, don't free the messages */
-  owl_messagelist_delete(v->ml, false);
+  if (v->ml)
+    owl_messagelist_delete(v->ml, false);
   v->ml = owl_messagelist_new();
+  v->stale = false;
 
   /* find all the messages we want */
-  j=owl_messagelist_get_size(gml);
-  for (i=0; i<j; i++) {
-    m=owl_messagelist_get_element(gml, i);
-    if (owl_filter_message_match(v->filter, m)) {
-      owl_messagelist_append_element(v->ml, m);
-    }
-  }
+  owl_view_consider_from(v->filter, v->ml, 0);
 }
 
+/* switch the view to a new filter, reusing a cached message list for
+ * it if we have one. */
 void owl_view_new_filter(owl_view *v, owl_filter *f)
 {
+  owl_view_cache_put(v);
   v->filter=f;
-  owl_view_recalculate(v);
+  v->ml = owl_view_cache_take(f);
+  if (v->ml) {
+    v->stale = false;
+  } else {
+    owl_view_recalculate(v);
+  }
 }
 
 void owl_view_set_style(owl_view *v, const owl_style *s)
@@ -155,6 +333,7 @@ const char *owl_view_get_filtname(const owl_view *v)
 
 void owl_view_cleanup(owl_view *v)
 {
-  owl_messagelist_delete(v->ml, false);
+  if (v->ml)
+    owl_messagelist_delete(v->ml, false);
   g_free(v->name);
 }
@@ -89,7 +89,6 @@ static void owl_viewwin_layout(owl_viewwin *v)
 /* regenerate text on the curses window. */
 static void owl_viewwin_redraw_content(owl_window *w, WINDOW *curswin, void *user_data)
 {
-  owl_fmtext fm1, fm2;
   owl_viewwin *v = user_data;
   int winlines, wincols;
 
@@ -98,16 +97,9 @@ static void owl_viewwin_redraw_content(owl_window *w, WINDOW *curswin, void *use
   werase(curswin);
   wmove(curswin, 0, 0);
 
-  owl_fmtext_init_null(&fm1);
-  owl_fmtext_init_null(&fm2);
-
-  owl_fmtext_truncate_lines(&(v->fmtext), v->topline, winlines, &fm1);
-  owl_fmtext_truncate_cols(&fm1, v->rightshift, wincols-1+v->rightshift, &fm2);
-
-  owl_fmtext_curs_waddstr(&fm2, curswin, OWL_FMTEXT_ATTR_NONE, OWL_COLOR_DEFAULT, OWL_COLOR_DEFAULT);
-
-  owl_fmtext_cleanup(&fm1);
-  owl_fmtext_cleanup(&fm2);
+  owl_fmtext_curs_waddstr_range(&(v->fmtext), curswin, v->topline, winlines,
+                                v->rightshift, wincols-1+v->rightshift,
+                                OWL_FMTEXT_ATTR_NONE, OWL_COLOR_DEFAULT, OWL_COLOR_DEFAULT);
 }
 
 static void owl_viewwin_redraw_status(owl_window *w, WINDOW *curswin, void *user_data)
@@ -16,6 +16,7 @@ struct _owl_window { /*noproto*/
   PANEL *pan;
   int nlines, ncols;
   int begin_y, begin_x;
+  guint serial;                 /* of win; see owl_window_get_serial */
 };
 
 enum {
@@ -26,6 +27,8 @@ enum {
 
 static guint window_signals[LAST_SIGNAL] = { 0 };
 
+static guint window_serial = 0;
+
 static void owl_window_dispose(GObject *gobject);
 static void owl_window_finalize(GObject *gobject);
 
@@ -264,6 +267,12 @@ static void _owl_window_create_curses(owl_window *w)
       w->win = derwin(w->parent->win, w->nlines, w->ncols, w->begin_y, w->begin_x);
     }
   }
+  /* a new window may well reuse the address of an old one */
+  if (w->win) {
+    if (++window_serial == 0)
+      window_serial++;
+    w->serial = window_serial;
+  }
 }
 
 static void _owl_window_destroy_curses(owl_window *w)
@@ -320,6 +329,13 @@ bool owl_window_is_realized(owl_window *w)
   return w->win != NULL;
 }
 
+/* Identifies the curses window w is drawn on, which changes each time
+ * w is realized; 0 if it isn't. */
+guint owl_window_get_serial(owl_window *w)
+{
+  return w->win ? w->serial : 0;
+}
+
 bool owl_window_is_toplevel(owl_window *w)
 {
   return w->pan != NULL;
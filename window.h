@@ -46,6 +46,7 @@ void owl_window_show_all(owl_window *w);
 void owl_window_hide(owl_window *w);
 bool owl_window_is_shown(owl_window *w);
 bool owl_window_is_realized(owl_window *w);
+guint owl_window_get_serial(owl_window *w);
 bool owl_window_is_toplevel(owl_window *w);
 bool owl_window_is_subwin(owl_window *w);
 
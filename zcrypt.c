@@ -20,17 +20,11 @@
 
 #include <config.h>
 
-#include <openssl/des.h>
-
 #include "filterproc.h"
+#include "zcryptlib.h"
 
 extern const char *version;
 
-/* Annotate functions in which the caller owns the return value and is
- * responsible for ensuring it is freed. */
-#define CALLER_OWN G_GNUC_WARN_UNUSED_RESULT
-
-#define MAX_KEY      128
 #define MAX_LINE     128
 #define MAX_RESULT   4096
 
@@ -56,10 +50,7 @@ typedef struct
   char *message;
 } ZWRITEOPTIONS;
 
-CALLER_OWN char *GetZephyrVarKeyFile(const char *whoami, const char *class, const char *instance);
-int ParseCryptSpec(const char *spec, const char **keyfile);
 CALLER_OWN char *BuildArgString(char **argv, int start, int end);
-CALLER_OWN char *read_keystring(const char *keyfile);
 
 int do_encrypt(int zephyr, const char *class, const char *instance,
                ZWRITEOPTIONS *zoptions, const char* keyfile, int cipher);
@@ -78,12 +69,6 @@ int do_decrypt_des(const char *keyfile);
 #define M_RANDOMIZE       4
 #define M_SETKEY          5
 
-enum cipher_algo {
-  CIPHER_DES,
-  CIPHER_AES,
-  NCIPHER
-};
-
 typedef struct {
   int (*encrypt)(const char *keyfile, const char *in, int len, FILE *out);
   int (*decrypt)(const char *keyfile);
@@ -94,13 +79,6 @@ cipher_pair ciphers[NCIPHER] = {
   [CIPHER_AES] = { do_encrypt_aes, do_decrypt_aes},
 };
 
-static void owl_zcrypt_string_to_schedule(char *keystring, DES_key_schedule *schedule) {
-  DES_cblock key;
-
-  DES_string_to_key(keystring, &key);
-  DES_key_sched(&key, schedule);
-}
-
 void usage(FILE *file, const char *progname)
 {
   fprintf(file, "Usage: %s [-Z|-D|-E|-R|-S] [-F Keyfile] [-c class] [-i instance]\n", progname);
@@ -354,36 +332,6 @@ int main(int argc, char *argv[])
   return error;
 }
 
-int ParseCryptSpec(const char *spec, const char **keyfile) {
-  int cipher = CIPHER_DES;
-  char *cipher_name = strdup(spec);
-  char *colon = strchr(cipher_name, ':');
-
-  *keyfile = spec;
-
-  if (colon) {
-    char *rest = strchr(spec, ':') + 1;
-    while(isspace(*rest)) rest++;
-
-    *colon-- = '\0';
-    while (colon >= cipher_name && isspace(*colon)) {
-      *colon = '\0';
-    }
-
-    if(strcmp(cipher_name, "AES") == 0) {
-      cipher = CIPHER_AES;
-      *keyfile = rest;
-    } else if(strcmp(cipher_name, "DES") == 0) {
-      cipher = CIPHER_DES;
-      *keyfile = rest;
-    }
-  }
-
-  free(cipher_name);
-
-  return cipher;
-}
-
 /* Build a space-separated string from argv from elements between start  *
  * and end - 1.  malloc()'s the returned string. */
 CALLER_OWN char *BuildArgString(char **argv, int start, int end)
@@ -420,95 +368,6 @@ CALLER_OWN char *BuildArgString(char **argv, int start, int end)
   return result;
 }
 
-#define MAX_BUFF 258
-#define MAX_SEARCH 3
-/* Find the class/instance in the .crypt-table */
-CALLER_OWN char *GetZephyrVarKeyFile(const char *whoami, const char *class, const char *instance)
-{
-  char *keyfile = NULL;
-  char *varname[MAX_SEARCH];
-  int length[MAX_SEARCH], i;
-  char buffer[MAX_BUFF];
-  const char *home;
-  char *filename;
-  char result[MAX_SEARCH][MAX_BUFF];
-  int numsearch = 0;
-  FILE *fsearch;
-
-  memset(varname, 0, sizeof(varname));
-
-  /* Determine names to look for in .crypt-table */
-  if (instance)
-    varname[numsearch++] = g_strdup_printf("crypt-%s-%s:", (class?class:"message"), instance);
-  if (class)
-    varname[numsearch++] = g_strdup_printf("crypt-%s:", class);
-  varname[numsearch++] = g_strdup("crypt-default:");
-
-  /* Setup the result array, and determine string lengths */
-  for (i = 0; i < numsearch; i++)
-  {
-    result[i][0] = '\0';
-    length[i] = strlen(varname[i]);
-  }
-
-  /* Open~/.crypt-table */
-  home = getenv("HOME");
-  if (home == NULL)
-    home = g_get_home_dir();
-  filename = g_build_filename(home, ".crypt-table", NULL);
-  fsearch = fopen(filename, "r");
-  if (fsearch)
-  {
-    /* Scan file for a match */
-    while (!feof(fsearch))
-    {
-      if (!fgets(buffer, MAX_BUFF - 3, fsearch)) break;
-      for (i = 0; i < numsearch; i++)
-        if (strncasecmp(varname[i], buffer, length[i]) == 0)
-        {
-          int j;
-          for (j = length[i]; buffer[j] == ' '; j++)
-            ;
-          strcpy(result[i], &buffer[j]);
-          if (*result[i])
-            if (result[i][strlen(result[i])-1] == '\n')
-              result[i][strlen(result[i])-1] = '\0';
-        }
-    }
-
-    /* Pick the "best" match found */
-    keyfile = NULL;
-    for (i = 0; i < numsearch; i++)
-      if (*result[i])
-      {
-        keyfile = result[i];
-        break;
-      }
-
-    if (keyfile != NULL)
-    {
-      /* Prepare result to be returned */
-      char *temp = keyfile;
-      keyfile = (char *)malloc(strlen(temp) + 1);
-      if (keyfile)
-        strcpy(keyfile, temp);
-      else
-        fprintf(stderr, "Memory allocation error.\n");
-    }
-    fclose(fsearch);
-  }
-  else
-    fprintf(stderr, "Could not open key table file: %s\n", filename);
-
-  for(i = 0; i < MAX_SEARCH; i++) {
-    g_free(varname[i]);
-  }
-
-  g_free(filename);
-
-  return keyfile;
-}
-
 static pid_t zephyrpipe_pid = 0;
 
 /* Open a pipe to zwrite */
@@ -591,20 +450,8 @@ void CloseZephyrPipe(FILE *pipe)
   zephyrpipe_pid = 0;
 }
 
-#define BASE_CODE 70
-#define LAST_CODE (BASE_CODE + 15)
 #define OUTPUT_BLOCK_SIZE 16
 
-void block_to_ascii(unsigned char *output, FILE *outfile)
-{
-  int i;
-  for (i = 0; i < 8; i++)
-  {
-    putc(((output[i] & 0xf0) >> 4) + BASE_CODE, outfile);
-    putc( (output[i] & 0x0f)       + BASE_CODE, outfile);
-  }
-}
-
 CALLER_OWN char *slurp_stdin(int ignoredot, int *length) {
   char *buf;
   char *inptr;
@@ -663,23 +510,6 @@ CALLER_OWN char *GetInputBuffer(ZWRITEOPTIONS *zoptions, int *length) {
   return buf;
 }
 
-CALLER_OWN char *read_keystring(const char *keyfile) {
-  char *keystring;
-  FILE *fkey = fopen(keyfile, "r");
-  if(!fkey) {
-    fprintf(stderr, "Unable to open keyfile %s\n", keyfile);
-    return NULL;
-  }
-  keystring = malloc(MAX_KEY);
-  if(!fgets(keystring, MAX_KEY-1, fkey)) {
-    fprintf(stderr, "Unable to read from keyfile: %s\n", keyfile);
-    free(keystring);
-    keystring = NULL;
-  }
-  fclose(fkey);
-  return keystring;
-}
-
 /* Encrypt stdin, with prompt if isatty, and send to stdout, or to zwrite
    if zephyr is set. */
 int do_encrypt(int zephyr, const char *class, const char *instance,
@@ -719,184 +549,50 @@ int do_encrypt(int zephyr, const char *class, const char *instance,
 
 int do_encrypt_des(const char *keyfile, const char *in, int length, FILE *outfile)
 {
-  DES_key_schedule schedule;
-  unsigned char input[8], output[8];
-  const char *inptr;
-  int num_blocks, last_block_size;
-  char *keystring;
-  int size;
-
-  keystring = read_keystring(keyfile);
-  if(!keystring) {
-    return FALSE;
-  }
-
-  owl_zcrypt_string_to_schedule(keystring, &schedule);
-  free(keystring);
-
-  inptr = in;
-  num_blocks = (length + 7) / 8;
-  last_block_size = ((length + 7) % 8) + 1;
-
-  /* Encrypt the input (inbuff or stdin) and send it to outfile */
-  while (TRUE)
-  {
-    /* Get 8 bytes from buffer */
-    if (num_blocks > 1)
-    {
-      size = 8;
-      memcpy(input, inptr, size);
-      inptr += 8;
-      num_blocks--;
-    }
-    else if (num_blocks == 1)
-    {
-      size = last_block_size;
-      memcpy(input, inptr, size);
-      num_blocks--;
-    }
-    else
-      size = 0;
-
-    /* Check for EOF and pad the string to 8 chars, if needed */
-    if (size == 0)
-      break;
-    if (size < 8)
-      memset(input + size, 0, 8 - size);
-
-    /* Encrypt and output the block */
-    DES_ecb_encrypt(&input, &output, &schedule, TRUE);
-    block_to_ascii(output, outfile);
-
-    if (size < 8)
-      break;
-  }
-
-  putc('\n', outfile);
-
+  char *out = zcrypt_encrypt_des(NULL, keyfile, in, length);
+  if(!out) return FALSE;
+  fwrite(out, strlen(out), 1, outfile);
+  g_free(out);
   return TRUE;
 }
 
 int do_encrypt_aes(const char *keyfile, const char *in, int length, FILE *outfile)
 {
-  char *out;
-  int err, status;
-  int tried_gpg1 = FALSE;
-  const char *argv[] = {
-    "gpg1",
-    "--symmetric",
-    "--no-options",
-    "--no-default-keyring",
-    "--keyring", "/dev/null",
-    "--secret-keyring", "/dev/null",
-    "--batch",
-    "--quiet",
-    "--no-use-agent",
-    "--armor",
-    "--cipher-algo", "AES",
-    "--passphrase-file", keyfile,
-    NULL
-  };
-  while ((err = call_filter(argv, in, &out, &status)) && !out && !tried_gpg1) {
-    tried_gpg1 = TRUE;
-    argv[0] = "gpg";
-  }
-  if(err || status) {
-    g_free(out);
-    return FALSE;
-  }
+  char *out = zcrypt_encrypt_aes(keyfile, in);
+  if(!out) return FALSE;
   fwrite(out, strlen(out), 1, outfile);
   g_free(out);
   return TRUE;
 }
 
-/* Read a half-byte from stdin, skipping invalid characters.  Returns -1
-   if at EOF or file error */
-int read_ascii_nybble(void)
+/* Decrypt stdin */
+int do_decrypt(const char *keyfile, int cipher)
 {
-  char c;
-
-  while (TRUE)
-  {
-    if (fread(&c, 1, 1, stdin) == 0)
-      return -1;
-    else if (c >= BASE_CODE && c <= LAST_CODE)
-      return c - BASE_CODE;
-  }
+  return ciphers[cipher].decrypt(keyfile);
 }
 
-/* Read both halves of the byte and return the single byte.  Returns -1
-   if at EOF or file error. */
-int read_ascii_byte(void)
+/* Read all of stdin */
+CALLER_OWN char *read_stdin(void)
 {
-  int c1, c2;
-  c1 = read_ascii_nybble();
-  if (c1 >= 0)
-  {
-    c2 = read_ascii_nybble();
-    if (c2 >= 0)
-    {
-      return c1 * 0x10 + c2;
-    }
-  }
-  return -1;
-}
+  GString *in = g_string_new("");
+  char buf[MAX_RESULT];
+  size_t n;
 
-/* Read an 8-byte DES block from stdin */
-int read_ascii_block(unsigned char *input)
-{
-  int c;
-
-  int i;
-  for (i = 0; i < 8; i++)
-  {
-    c = read_ascii_byte();
-    if (c < 0)
-      return FALSE;
-
-    input[i] = c;
-  }
-
-  return TRUE;
-}
-
-/* Decrypt stdin */
-int do_decrypt(const char *keyfile, int cipher)
-{
-  return ciphers[cipher].decrypt(keyfile);
+  while ((n = fread(buf, 1, sizeof(buf), stdin)) > 0)
+    g_string_append_len(in, buf, n);
+  return g_string_free(in, FALSE);
 }
 
 int do_decrypt_aes(const char *keyfile) {
   char *in, *out;
   int length;
-  int tried_gpg1 = FALSE;
-  const char *argv[] = {
-    "gpg1",
-    "--decrypt",
-    "--no-options",
-    "--no-default-keyring",
-    "--keyring", "/dev/null",
-    "--secret-keyring", "/dev/null",
-    "--batch",
-    "--no-use-agent",
-    "--quiet",
-    "--passphrase-file", keyfile,
-    NULL
-  };
-  int err, status;
 
   in = slurp_stdin(TRUE, &length);
   if(!in) return FALSE;
 
-  while ((err = call_filter(argv, in, &out, &status)) && !out && !tried_gpg1) {
-    tried_gpg1 = TRUE;
-    argv[0] = "gpg";
-  }
+  out = zcrypt_decrypt_aes(keyfile, in);
   free(in);
-  if(err || status) {
-    g_free(out);
-    return FALSE;
-  }
+  if(!out) return FALSE;
   fwrite(out, strlen(out), 1, stdout);
   g_free(out);
 
@@ -904,40 +600,14 @@ int do_decrypt_aes(const char *keyfile) {
 }
 
 int do_decrypt_des(const char *keyfile) {
-  DES_key_schedule schedule;
-  unsigned char input[8], output[8];
-  char tmp[9];
-  char *keystring;
-
-  /*
-    DES decrypts 8 bytes at a time. We copy those over into the 9-byte
-    'tmp', which has the final byte zeroed, to ensure that we always
-    have a NULL-terminated string we can call printf/strlen on.
-
-    We don't pass 'tmp' to DES_ecb_encrypt directly, because it's
-    prototyped as taking 'unsigned char[8]', and this avoids a stupid
-    cast.
-
-    We zero 'tmp' entirely, not just the final byte, in case there are
-    no input blocks.
-  */
-  memset(tmp, 0, sizeof tmp);
-
-  keystring = read_keystring(keyfile);
-  if(!keystring) return FALSE;
-
-  owl_zcrypt_string_to_schedule(keystring, &schedule);
-
-  free(keystring);
+  char *in, *out;
 
-  while (read_ascii_block(input))
-  {
-    DES_ecb_encrypt(&input, &output, &schedule, FALSE);
-    memcpy(tmp, output, 8);
-    printf("%s", tmp);
-  }
+  in = read_stdin();
+  out = zcrypt_decrypt_des(NULL, keyfile, in);
+  g_free(in);
+  if(!out) return FALSE;
+  fwrite(out, strlen(out), 1, stdout);
+  g_free(out);
 
-  if (!tmp[0] || tmp[strlen(tmp) - 1] != '\n')
-      printf("\n");
   return TRUE;
 }
@@ -0,0 +1,772 @@
+/* zcryptlib.c -- the ciphers of zcrypt, shared with BarnOwl: finding  *
+ *   the key for a class and instance in ~/.crypt-table, and encrypting  *
+ *   and decrypting DES and AES (by way of gpg) zcrypt messages.  A      *
+ *   keyring keeps the crypt table and the DES key schedules in memory   *
+ *   for as long as the files they came from stay the same.              */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "zcryptlib.h"
+#include "filterproc.h"
+
+#ifdef ZCRYPT_HAVE_DES
+#include <openssl/des.h>
+#endif
+
+#ifndef TRUE
+#define TRUE -1
+#endif
+#ifndef FALSE
+#define FALSE 0
+#endif
+
+int ParseCryptSpec(const char *spec, const char **keyfile) {
+  int cipher = CIPHER_DES;
+  char *cipher_name = strdup(spec);
+  char *colon = strchr(cipher_name, ':');
+
+  *keyfile = spec;
+
+  if (colon) {
+    char *rest = strchr(spec, ':') + 1;
+    while(isspace(*rest)) rest++;
+
+    *colon-- = '\0';
+    while (colon >= cipher_name && isspace(*colon)) {
+      *colon = '\0';
+    }
+
+    if(strcmp(cipher_name, "AES") == 0) {
+      cipher = CIPHER_AES;
+      *keyfile = rest;
+    } else if(strcmp(cipher_name, "DES") == 0) {
+      cipher = CIPHER_DES;
+      *keyfile = rest;
+    }
+  }
+
+  free(cipher_name);
+
+  return cipher;
+}
+
+#define MAX_BUFF 258
+#define MAX_SEARCH 3
+
+static CALLER_OWN char *zcrypt_table_path(void)
+{
+  const char *home = getenv("HOME");
+  if (home == NULL)
+    home = g_get_home_dir();
+  return g_build_filename(home, ".crypt-table", NULL);
+}
+
+/* Reads the crypt table at filename, in the pieces fgets reads it in.
+ * Returns NULL if it can't be opened. */
+static GPtrArray *zcrypt_table_read(const char *filename)
+{
+  char buffer[MAX_BUFF];
+  GPtrArray *lines;
+  FILE *fsearch;
+
+  fsearch = fopen(filename, "r");
+  if (!fsearch) return NULL;
+  lines = g_ptr_array_new();
+  while (fgets(buffer, MAX_BUFF - 3, fsearch))
+    g_ptr_array_add(lines, g_strdup(buffer));
+  fclose(fsearch);
+  return lines;
+}
+
+static void zcrypt_table_free(GPtrArray *lines)
+{
+  g_ptr_array_foreach(lines, (GFunc)g_free, NULL);
+  g_ptr_array_free(lines, TRUE);
+}
+
+/* Finds the keyfile for class and instance among the lines of a crypt
+ * table: from crypt-class-instance:, or else crypt-class:, or else
+ * crypt-default:, where the last line for each counts. */
+static CALLER_OWN char *zcrypt_table_lookup(const GPtrArray *lines, const char *class, const char *instance)
+{
+  char *varname[MAX_SEARCH];
+  const char *result[MAX_SEARCH];
+  int length[MAX_SEARCH], i, j, len;
+  const char *buffer;
+  char *keyfile = NULL;
+  int numsearch = 0;
+  guint n;
+
+  /* Determine names to look for in .crypt-table */
+  if (instance)
+    varname[numsearch++] = g_strdup_printf("crypt-%s-%s:", (class?class:"message"), instance);
+  if (class)
+    varname[numsearch++] = g_strdup_printf("crypt-%s:", class);
+  varname[numsearch++] = g_strdup("crypt-default:");
+
+  for (i = 0; i < numsearch; i++)
+  {
+    result[i] = "";
+    length[i] = strlen(varname[i]);
+  }
+
+  /* Scan the table for a match */
+  for (n = 0; n < lines->len; n++)
+  {
+    buffer = lines->pdata[n];
+    for (i = 0; i < numsearch; i++)
+      if (strncasecmp(varname[i], buffer, length[i]) == 0)
+      {
+        for (j = length[i]; buffer[j] == ' '; j++)
+          ;
+        result[i] = &buffer[j];
+      }
+  }
+
+  /* Pick the "best" match found */
+  for (i = 0; i < numsearch; i++)
+  {
+    len = strlen(result[i]);
+    if (len && result[i][len - 1] == '\n')
+      len--;
+    if (len)
+    {
+      keyfile = g_strndup(result[i], len);
+      break;
+    }
+  }
+
+  for (i = 0; i < numsearch; i++)
+    g_free(varname[i]);
+
+  return keyfile;
+}
+
+/* Find the class/instance in the .crypt-table */
+CALLER_OWN char *GetZephyrVarKeyFile(const char *whoami, const char *class, const char *instance)
+{
+  char *filename = zcrypt_table_path();
+  GPtrArray *lines = zcrypt_table_read(filename);
+  char *keyfile = NULL;
+
+  if (lines) {
+    keyfile = zcrypt_table_lookup(lines, class, instance);
+    zcrypt_table_free(lines);
+  } else {
+    fprintf(stderr, "Could not open key table file: %s\n", filename);
+  }
+  g_free(filename);
+  return keyfile;
+}
+
+CALLER_OWN char *read_keystring(const char *keyfile) {
+  char *keystring;
+  FILE *fkey = fopen(keyfile, "r");
+  if(!fkey) {
+    fprintf(stderr, "Unable to open keyfile %s\n", keyfile);
+    return NULL;
+  }
+  keystring = malloc(MAX_KEY);
+  if(!fgets(keystring, MAX_KEY-1, fkey)) {
+    fprintf(stderr, "Unable to read from keyfile: %s\n", keyfile);
+    free(keystring);
+    keystring = NULL;
+  }
+  fclose(fkey);
+  return keystring;
+}
+
+/* What a file looked like when it was read, to tell when it changes */
+typedef struct {
+  int exists;
+  dev_t dev;
+  ino_t ino;
+  off_t size;
+  time_t mtime, ctime;
+} zcrypt_file_stamp;
+
+static void zcrypt_file_stamp_get(zcrypt_file_stamp *stamp, const char *filename)
+{
+  struct stat st;
+
+  memset(stamp, 0, sizeof(*stamp));
+  if (stat(filename, &st) < 0) return;
+  stamp->exists = TRUE;
+  stamp->dev = st.st_dev;
+  stamp->ino = st.st_ino;
+  stamp->size = st.st_size;
+  stamp->mtime = st.st_mtime;
+  stamp->ctime = st.st_ctime;
+}
+
+static int zcrypt_file_stamp_equal(const zcrypt_file_stamp *a, const zcrypt_file_stamp *b)
+{
+  return a->exists == b->exists && a->dev == b->dev && a->ino == b->ino &&
+    a->size == b->size && a->mtime == b->mtime && a->ctime == b->ctime;
+}
+
+struct _zcrypt_keyring {
+#if GLIB_CHECK_VERSION(2, 31, 0)
+  GMutex lock;
+#else
+  GMutex *lock;
+#endif
+  char *table;                  /* path of the crypt table */
+  zcrypt_file_stamp table_stamp;
+  GPtrArray *lines;             /* the table, or NULL if it can't be read */
+  GHashTable *specs;            /* class and instance to crypt spec, "" for none */
+  GHashTable *keys;             /* keyfile to zcrypt_des_key */
+};
+
+static GMutex *zcrypt_keyring_get_lock(zcrypt_keyring *kr)
+{
+#if GLIB_CHECK_VERSION(2, 31, 0)
+  return &kr->lock;
+#else
+  return kr->lock;
+#endif
+}
+
+#ifdef ZCRYPT_HAVE_DES
+/* The key schedule made from a keyfile */
+typedef struct {
+  zcrypt_file_stamp stamp;
+  DES_key_schedule schedule;
+} zcrypt_des_key;
+#endif
+
+static void zcrypt_des_key_free(gpointer data)
+{
+#ifdef ZCRYPT_HAVE_DES
+  memset(data, 0, sizeof(zcrypt_des_key));
+#endif
+  g_free(data);
+}
+
+/* Makes a keyring over the crypt table at 'table', which need not
+ * exist yet.  Keyrings may be used from several threads at once. */
+zcrypt_keyring *zcrypt_keyring_new(const char *table)
+{
+  zcrypt_keyring *kr = g_new0(zcrypt_keyring, 1);
+
+#if GLIB_CHECK_VERSION(2, 31, 0)
+  g_mutex_init(&kr->lock);
+#else
+  kr->lock = g_mutex_new();
+#endif
+  kr->table = g_strdup(table);
+  kr->specs = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+  kr->keys = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, zcrypt_des_key_free);
+  return kr;
+}
+
+void zcrypt_keyring_free(zcrypt_keyring *kr)
+{
+  if (kr->lines)
+    zcrypt_table_free(kr->lines);
+  g_hash_table_destroy(kr->specs);
+  g_hash_table_destroy(kr->keys);
+  g_free(kr->table);
+#if GLIB_CHECK_VERSION(2, 31, 0)
+  g_mutex_clear(&kr->lock);
+#else
+  g_mutex_free(kr->lock);
+#endif
+  g_free(kr);
+}
+
+/* The keyring over ~/.crypt-table, made on first use */
+zcrypt_keyring *zcrypt_keyring_get_default(void)
+{
+  static zcrypt_keyring *kr = NULL;
+  G_LOCK_DEFINE_STATIC(default_keyring);
+  char *table;
+
+  G_LOCK(default_keyring);
+  if (kr == NULL) {
+    table = zcrypt_table_path();
+    kr = zcrypt_keyring_new(table);
+    g_free(table);
+  }
+  G_UNLOCK(default_keyring);
+  return kr;
+}
+
+/* Looks up the crypt spec for class and instance, as
+ * GetZephyrVarKeyFile does, reading the crypt table again only if it
+ * has changed.  Returns NULL if there is none. */
+CALLER_OWN char *zcrypt_keyring_lookup(zcrypt_keyring *kr, const char *class, const char *instance)
+{
+  zcrypt_file_stamp stamp;
+  char *key, *spec;
+
+  zcrypt_file_stamp_get(&stamp, kr->table);
+  key = g_strdup_printf("%c%s\n%c%s", class ? '+' : '-', class ? class : "",
+                        instance ? '+' : '-', instance ? instance : "");
+
+  g_mutex_lock(zcrypt_keyring_get_lock(kr));
+  if (!zcrypt_file_stamp_equal(&stamp, &kr->table_stamp) ||
+      (stamp.exists && !kr->lines)) {
+    if (kr->lines)
+      zcrypt_table_free(kr->lines);
+    kr->lines = zcrypt_table_read(kr->table);
+    kr->table_stamp = stamp;
+    g_hash_table_remove_all(kr->specs);
+  }
+  spec = g_hash_table_lookup(kr->specs, key);
+  if (spec) {
+    g_free(key);
+  } else {
+    spec = kr->lines ? zcrypt_table_lookup(kr->lines, class, instance) : NULL;
+    if (!spec) spec = g_strdup("");
+    g_hash_table_insert(kr->specs, key, spec);
+  }
+  spec = *spec ? g_strdup(spec) : NULL;
+  g_mutex_unlock(zcrypt_keyring_get_lock(kr));
+
+  return spec;
+}
+
+#ifdef ZCRYPT_HAVE_DES
+static void zcrypt_string_to_schedule(const char *keystring, DES_key_schedule *schedule)
+{
+  DES_cblock key;
+
+  DES_string_to_key(keystring, &key);
+  DES_key_sched(&key, schedule);
+  memset(&key, 0, sizeof(key));
+}
+
+/* Gets the key schedule for keyfile.  With a keyring, the keyfile is
+ * only read if it has changed since it was last read. */
+static int zcrypt_get_des_schedule(zcrypt_keyring *kr, const char *keyfile, DES_key_schedule *schedule)
+{
+  zcrypt_file_stamp stamp;
+  zcrypt_des_key *key;
+  char *keystring;
+  int found = FALSE;
+
+  if (kr) {
+    zcrypt_file_stamp_get(&stamp, keyfile);
+    g_mutex_lock(zcrypt_keyring_get_lock(kr));
+    key = g_hash_table_lookup(kr->keys, keyfile);
+    if (key && stamp.exists && zcrypt_file_stamp_equal(&key->stamp, &stamp)) {
+      memcpy(schedule, &key->schedule, sizeof(*schedule));
+      found = TRUE;
+    }
+    g_mutex_unlock(zcrypt_keyring_get_lock(kr));
+    if (found) return TRUE;
+  }
+
+  keystring = read_keystring(keyfile);
+  if (!keystring) return FALSE;
+  zcrypt_string_to_schedule(keystring, schedule);
+  memset(keystring, 0, strlen(keystring));
+  free(keystring);
+
+  if (kr) {
+    key = g_new(zcrypt_des_key, 1);
+    key->stamp = stamp;
+    memcpy(&key->schedule, schedule, sizeof(*schedule));
+    g_mutex_lock(zcrypt_keyring_get_lock(kr));
+    g_hash_table_replace(kr->keys, g_strdup(keyfile), key);
+    g_mutex_unlock(zcrypt_keyring_get_lock(kr));
+  }
+  return TRUE;
+}
+
+static void block_to_ascii(const unsigned char *output, GString *out)
+{
+  int i;
+  for (i = 0; i < 8; i++)
+  {
+    g_string_append_c(out, ((output[i] & 0xf0) >> 4) + BASE_CODE);
+    g_string_append_c(out, (output[i] & 0x0f) + BASE_CODE);
+  }
+}
+
+/* Encrypts the 'length' bytes at 'in' with DES and the key in keyfile.
+ * Returns the ciphertext as zcrypt -E prints it, or NULL on error. */
+CALLER_OWN char *zcrypt_encrypt_des(zcrypt_keyring *kr, const char *keyfile, const char *in, int length)
+{
+  DES_key_schedule schedule;
+  unsigned char input[8], output[8];
+  const char *inptr;
+  int num_blocks, last_block_size;
+  int size;
+  GString *out;
+
+  if (!zcrypt_get_des_schedule(kr, keyfile, &schedule))
+    return NULL;
+
+  inptr = in;
+  num_blocks = (length + 7) / 8;
+  last_block_size = ((length + 7) % 8) + 1;
+  out = g_string_sized_new(2 * length + 18);
+
+  while (TRUE)
+  {
+    /* Get 8 bytes from buffer */
+    if (num_blocks > 1)
+    {
+      size = 8;
+      memcpy(input, inptr, size);
+      inptr += 8;
+      num_blocks--;
+    }
+    else if (num_blocks == 1)
+    {
+      size = last_block_size;
+      memcpy(input, inptr, size);
+      num_blocks--;
+    }
+    else
+      size = 0;
+
+    /* Check for EOF and pad the string to 8 chars, if needed */
+    if (size == 0)
+      break;
+    if (size < 8)
+      memset(input + size, 0, 8 - size);
+
+    /* Encrypt and output the block */
+    DES_ecb_encrypt(&input, &output, &schedule, TRUE);
+    block_to_ascii(output, out);
+
+    if (size < 8)
+      break;
+  }
+  memset(&schedule, 0, sizeof(schedule));
+  memset(input, 0, sizeof(input));
+
+  g_string_append_c(out, '\n');
+  return g_string_free(out, FALSE);
+}
+/* Reads a half-byte from *in, skipping invalid characters.  Returns -1
+   at the end of the string. */
+static int read_ascii_nybble(const char **in)
+{
+  char c;
+
+  while ((c = **in) != '\0')
+  {
+    (*in)++;
+    if (c >= BASE_CODE && c <= LAST_CODE)
+      return c - BASE_CODE;
+  }
+  return -1;
+}
+
+/* Reads an 8-byte DES block from *in */
+static int read_ascii_block(const char **in, unsigned char *input)
+{
+  int c1, c2;
+  int i;
+
+  for (i = 0; i < 8; i++)
+  {
+    c1 = read_ascii_nybble(in);
+    if (c1 < 0)
+      return FALSE;
+    c2 = read_ascii_nybble(in);
+    if (c2 < 0)
+      return FALSE;
+
+    input[i] = c1 * 0x10 + c2;
+  }
+
+  return TRUE;
+}
+
+/* Decrypts the DES ciphertext 'in' with the key in keyfile.  The
+ * keyring, if not NULL, keeps the key schedule.  Returns
+ * the text as zcrypt -D prints it, or NULL on error. */
+CALLER_OWN char *zcrypt_decrypt_des(zcrypt_keyring *kr, const char *keyfile, const char *in)
+{
+  DES_key_schedule schedule;
+  unsigned char input[8], output[8];
+  char tmp[9];
+  GString *out;
+
+  /*
+    DES decrypts 8 bytes at a time. We copy those over into the 9-byte
+    'tmp', which has the final byte zeroed, so each block is only
+    taken up to its first NUL, as printf would.  We zero 'tmp'
+    entirely in case there are no input blocks.
+  */
+  memset(tmp, 0, sizeof tmp);
+
+  if (!zcrypt_get_des_schedule(kr, keyfile, &schedule))
+    return NULL;
+
+  out = g_string_new("");
+  while (read_ascii_block(&in, input))
+  {
+    DES_ecb_encrypt(&input, &output, &schedule, FALSE);
+    memcpy(tmp, output, 8);
+    g_string_append(out, tmp);
+  }
+  memset(&schedule, 0, sizeof(schedule));
+
+  if (!tmp[0] || tmp[strlen(tmp) - 1] != '\n')
+    g_string_append_c(out, '\n');
+  return g_string_free(out, FALSE);
+}
+#else
+CALLER_OWN char *zcrypt_encrypt_des(zcrypt_keyring *kr, const char *keyfile, const char *in, int length)
+{
+  fprintf(stderr, "DES is not supported in this build\n");
+  return NULL;
+}
+
+CALLER_OWN char *zcrypt_decrypt_des(zcrypt_keyring *kr, const char *keyfile, const char *in)
+{
+  fprintf(stderr, "DES is not supported in this build\n");
+  return NULL;
+}
+#endif
+
+/* The gpg command line which encrypts with AES, with the passphrase
+ * in keyfile.  gpg1 is tried first, and gpg after it. */
+#define ZCRYPT_AES_ENCRYPT_ARGV(keyfile) {      \
+    "gpg1",                                     \
+    "--symmetric",                              \
+    "--no-options",                             \
+    "--no-default-keyring",                     \
+    "--keyring", "/dev/null",                   \
+    "--secret-keyring", "/dev/null",            \
+    "--batch",                                  \
+    "--quiet",                                  \
+    "--no-use-agent",                           \
+    "--armor",                                  \
+    "--cipher-algo", "AES",                     \
+    "--passphrase-file", (keyfile),             \
+    NULL                                        \
+  }
+
+/* Encrypts 'in' with AES by way of gpg, with the passphrase in
+ * keyfile.  Returns the ASCII-armored message, or NULL on error. */
+CALLER_OWN char *zcrypt_encrypt_aes(const char *keyfile, const char *in)
+{
+  char *out;
+  int err, status;
+  int tried_gpg1 = FALSE;
+  const char *argv[] = ZCRYPT_AES_ENCRYPT_ARGV(keyfile);
+
+  while ((err = call_filter(argv, in, &out, &status)) && !out && !tried_gpg1) {
+    tried_gpg1 = TRUE;
+    argv[0] = "gpg";
+  }
+  if(err || status) {
+    g_free(out);
+    return NULL;
+  }
+  return out;
+}
+
+/* Decrypts the AES ciphertext 'in', an ASCII-armored gpg message,
+ * with the passphrase in keyfile.  Returns NULL on error. */
+CALLER_OWN char *zcrypt_decrypt_aes(const char *keyfile, const char *in)
+{
+  char *out;
+  int tried_gpg1 = FALSE;
+  const char *argv[] = {
+    "gpg1",
+    "--decrypt",
+    "--no-options",
+    "--no-default-keyring",
+    "--keyring", "/dev/null",
+    "--secret-keyring", "/dev/null",
+    "--batch",
+    "--no-use-agent",
+    "--quiet",
+    "--passphrase-file", keyfile,
+    NULL
+  };
+  int err, status;
+
+  while ((err = call_filter(argv, in, &out, &status)) && !out && !tried_gpg1) {
+    tried_gpg1 = TRUE;
+    argv[0] = "gpg";
+  }
+  if(err || status) {
+    g_free(out);
+    return NULL;
+  }
+  return out;
+}
+
+CALLER_OWN char *zcrypt_encrypt(zcrypt_keyring *kr, const char *keyfile, int cipher, const char *in)
+{
+  switch (cipher) {
+  case CIPHER_DES:
+    return zcrypt_encrypt_des(kr, keyfile, in, strlen(in));
+  case CIPHER_AES:
+    return zcrypt_encrypt_aes(keyfile, in);
+  default:
+    return NULL;
+  }
+}
+
+CALLER_OWN char *zcrypt_decrypt(zcrypt_keyring *kr, const char *keyfile, int cipher, const char *in)
+{
+  switch (cipher) {
+  case CIPHER_DES:
+    return zcrypt_decrypt_des(kr, keyfile, in);
+  case CIPHER_AES:
+    return zcrypt_decrypt_aes(keyfile, in);
+  default:
+    return NULL;
+  }
+}
+
+/* Looks up the crypt spec for class and instance in kr, or straight
+ * from ~/.crypt-table if kr is NULL */
+static CALLER_OWN char *zcrypt_lookup(zcrypt_keyring *kr, const char *class, const char *instance)
+{
+  if (kr)
+    return zcrypt_keyring_lookup(kr, class, instance);
+  return GetZephyrVarKeyFile("barnowl", class, instance);
+}
+
+/* Encrypts the body of a zephyr to class and instance, with the key
+ * the crypt table gives for them.  Returns NULL on error. */
+CALLER_OWN char *zcrypt_encrypt_message(zcrypt_keyring *kr, const char *class, const char *instance, const char *in)
+{
+  char *cryptspec, *out;
+  const char *keyfile;
+  int cipher;
+
+  cryptspec = zcrypt_lookup(kr, class, instance);
+  if (!cryptspec) return NULL;
+  cipher = ParseCryptSpec(cryptspec, &keyfile);
+  out = zcrypt_encrypt(kr, keyfile, cipher, in);
+  g_free(cryptspec);
+  return out;
+}
+
+/* Decrypts the body of a zephyr to class and instance, with the key
+ * the crypt table gives for them.  Returns NULL on error. */
+CALLER_OWN char *zcrypt_decrypt_message(zcrypt_keyring *kr, const char *class, const char *instance, const char *in)
+{
+  char *cryptspec, *out;
+  const char *keyfile;
+  int cipher;
+
+  cryptspec = zcrypt_lookup(kr, class, instance);
+  if (!cryptspec) return NULL;
+  cipher = ParseCryptSpec(cryptspec, &keyfile);
+  out = zcrypt_decrypt(kr, keyfile, cipher, in);
+  g_free(cryptspec);
+  return out;
+}
+
+struct zcrypt_request {
+  GMainContext *context;
+  char *keyfile;
+  char *in;
+  char *out;
+  int tried_gpg1;
+  zcrypt_done_func done;
+  void *data;
+};
+
+static void zcrypt_request_free(void *data)
+{
+  struct zcrypt_request *req = data;
+
+  g_main_context_unref(req->context);
+  g_free(req->keyfile);
+  g_free(req->in);
+  g_free(req->out);
+  g_slice_free(struct zcrypt_request, req);
+}
+
+static gboolean zcrypt_request_deliver(void *data)
+{
+  struct zcrypt_request *req = data;
+  char *out = req->out;
+
+  req->out = NULL;
+  req->done(out, req->data);
+  return FALSE;
+}
+
+/* Hands req's outcome to its caller, from its main context */
+static void zcrypt_request_finish(struct zcrypt_request *req)
+{
+  GSource *source = g_idle_source_new();
+
+  g_source_set_callback(source, zcrypt_request_deliver, req, zcrypt_request_free);
+  g_source_attach(source, req->context);
+  g_source_unref(source);
+}
+
+static void zcrypt_encrypt_aes_start(struct zcrypt_request *req);
+
+static void zcrypt_encrypt_aes_done(char *out, int err, int status, void *data)
+{
+  struct zcrypt_request *req = data;
+
+  if (err && !out && !req->tried_gpg1) {
+    req->tried_gpg1 = TRUE;
+    zcrypt_encrypt_aes_start(req);
+    return;
+  }
+  if (err || status) {
+    g_free(out);
+    out = NULL;
+  }
+  req->done(out, req->data);
+  zcrypt_request_free(req);
+}
+
+static void zcrypt_encrypt_aes_start(struct zcrypt_request *req)
+{
+  const char *argv[] = ZCRYPT_AES_ENCRYPT_ARGV(req->keyfile);
+
+  if (req->tried_gpg1)
+    argv[0] = "gpg";
+  call_filter_async(argv, req->in, req->context, NULL,
+                    zcrypt_encrypt_aes_done, req);
+}
+
+/* Like zcrypt_encrypt_message, but doesn't wait for gpg: 'done' gets
+ * the ciphertext (NULL on error, and the callee's to free) from
+ * 'context', or the default main context if that is NULL, and always
+ * after this returns. */
+void zcrypt_encrypt_message_async(zcrypt_keyring *kr, const char *class, const char *instance, const char *in,
+                                  GMainContext *context, zcrypt_done_func done, void *data)
+{
+  struct zcrypt_request *req = g_slice_new0(struct zcrypt_request);
+  char *cryptspec;
+  const char *keyfile;
+  int cipher;
+
+  req->context = g_main_context_ref(context ? context : g_main_context_default());
+  req->done = done;
+  req->data = data;
+
+  cryptspec = zcrypt_lookup(kr, class, instance);
+  if (!cryptspec) {
+    zcrypt_request_finish(req);
+    return;
+  }
+  cipher = ParseCryptSpec(cryptspec, &keyfile);
+  if (cipher == CIPHER_AES) {
+    req->keyfile = g_strdup(keyfile);
+    req->in = g_strdup(in);
+    zcrypt_encrypt_aes_start(req);
+  } else {
+    /* DES takes no time worth waiting for */
+    req->out = zcrypt_encrypt(kr, keyfile, cipher, in);
+    zcrypt_request_finish(req);
+  }
+  g_free(cryptspec);
+}
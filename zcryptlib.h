@@ -0,0 +1,63 @@
+#ifndef INC_BARNOWL_ZCRYPTLIB_H
+#define INC_BARNOWL_ZCRYPTLIB_H
+
+#include <config.h>
+#include <glib.h>
+
+/* The ciphers of the zcrypt program, which BarnOwl uses directly to
+ * encrypt and decrypt zephyrs. */
+
+#if defined(HAVE_DES_STRING_TO_KEY) && defined(HAVE_DES_KEY_SCHED) && \
+    defined(HAVE_DES_ECB_ENCRYPT)
+#define ZCRYPT_HAVE_DES 1
+#endif
+
+/* Annotate functions in which the caller owns the return value and is
+ * responsible for ensuring it is freed. */
+#define CALLER_OWN G_GNUC_WARN_UNUSED_RESULT
+
+#define MAX_KEY      128
+
+/* DES blocks are written out as two characters per byte, a nybble
+ * each, counting up from BASE_CODE */
+#define BASE_CODE 70
+#define LAST_CODE (BASE_CODE + 15)
+
+enum cipher_algo {
+  CIPHER_DES,
+  CIPHER_AES,
+  NCIPHER
+};
+
+/* The crypt table and the DES key schedules from the keyfiles it
+ * names, kept for as long as the files stay the same.  The functions
+ * below which take a keyring also take NULL, to read everything
+ * afresh. */
+typedef struct _zcrypt_keyring zcrypt_keyring;
+
+/* Receives the outcome of an asynchronous encryption: the ciphertext,
+ * which it then owns, or NULL on error */
+typedef void (*zcrypt_done_func)(char *out, void *data);
+
+CALLER_OWN char *GetZephyrVarKeyFile(const char *whoami, const char *class, const char *instance);
+int ParseCryptSpec(const char *spec, const char **keyfile);
+CALLER_OWN char *read_keystring(const char *keyfile);
+
+zcrypt_keyring *zcrypt_keyring_new(const char *table);
+void zcrypt_keyring_free(zcrypt_keyring *kr);
+zcrypt_keyring *zcrypt_keyring_get_default(void);
+CALLER_OWN char *zcrypt_keyring_lookup(zcrypt_keyring *kr, const char *class, const char *instance);
+
+CALLER_OWN char *zcrypt_encrypt_des(zcrypt_keyring *kr, const char *keyfile, const char *in, int length);
+CALLER_OWN char *zcrypt_encrypt_aes(const char *keyfile, const char *in);
+CALLER_OWN char *zcrypt_encrypt(zcrypt_keyring *kr, const char *keyfile, int cipher, const char *in);
+CALLER_OWN char *zcrypt_encrypt_message(zcrypt_keyring *kr, const char *class, const char *instance, const char *in);
+void zcrypt_encrypt_message_async(zcrypt_keyring *kr, const char *class, const char *instance, const char *in,
+                                  GMainContext *context, zcrypt_done_func done, void *data);
+
+CALLER_OWN char *zcrypt_decrypt_des(zcrypt_keyring *kr, const char *keyfile, const char *in);
+CALLER_OWN char *zcrypt_decrypt_aes(const char *keyfile, const char *in);
+CALLER_OWN char *zcrypt_decrypt(zcrypt_keyring *kr, const char *keyfile, int cipher, const char *in);
+CALLER_OWN char *zcrypt_decrypt_message(zcrypt_keyring *kr, const char *class, const char *instance, const char *in);
+
+#endif /* INC_BARNOWL_ZCRYPTLIB_H */
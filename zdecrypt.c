@@ -0,0 +1,137 @@
+#include "owl.h"
+#include "zcryptlib.h"
+
+/* Zephyrs with the opcode "crypt" are decrypted by a small pool of
+ * worker threads, in-process, so a busy encrypted class neither forks
+ * per message nor holds up the UI.  Meanwhile the message goes about
+ * with a placeholder body, and the snapshot keeps the ciphertext.
+ * Once it has its text it goes past the punt list and the views
+ * again, and perl and the incoming message actions hear about it. */
+
+#define OWL_ZCRYPT_THREADS 2
+#define OWL_ZCRYPT_PLACEHOLDER "decrypting\xe2\x80\xa6"
+
+typedef struct _owl_zcrypt_job { /* noproto */
+  owl_message *message;         /* main thread only; NULL once it's gone */
+  char *class;
+  char *instance;
+  char *in;                     /* the ciphertext */
+  char *out;                    /* the text, or NULL if decryption failed */
+} owl_zcrypt_job;
+
+static GThreadPool *zcrypt_pool = NULL;
+
+static void owl_zcrypt_job_free(void *data)
+{
+  owl_zcrypt_job *job = data;
+
+  g_free(job->class);
+  g_free(job->instance);
+  g_free(job->in);
+  g_free(job->out);
+  g_slice_free(owl_zcrypt_job, job);
+}
+
+/* Puts the outcome of a job into its message, in the main thread */
+static void owl_zcrypt_finish(void *data)
+{
+  owl_zcrypt_job *job = data;
+  owl_message *m = job->message;
+  owl_messagelist *ml = owl_global_get_msglist(&g);
+  const GPtrArray *pl = owl_global_get_puntlist(&g);
+  owl_view *v = owl_global_get_current_view(&g);
+  GPtrArray *msgs;
+  int i, n, lastmsgid;
+
+  /* it was punted or expunged in the meantime */
+  if (!m) return;
+
+  m->decrypt_job = NULL;
+  if (job->out) {
+    owl_message_set_body(m, job->out);
+    owl_message_save_ccs(m);
+  } else {
+    owl_message_set_body(m, job->in);
+    /* Replace the opcode. Otherwise the UI and other bits of code think the
+     * message was encrypted. */
+    owl_message_set_opcode(m, "failed-decrypt");
+  }
+  owl_message_invalidate_format(m);
+
+  /* a message still in the queue is processed as usual */
+  n = owl_messagelist_get_index_by_id(ml, owl_message_get_id(m));
+  if (n < 0) return;
+
+  /* the placeholder got past the punt list, but the text may not */
+  for (i = 0; i < pl->len; i++) {
+    if (owl_filter_message_match(pl->pdata[i], m)) {
+      owl_function_delete_and_expunge_message(n);
+      return;
+    }
+  }
+
+  owl_snapshot_note_update(m);
+  lastmsgid = owl_function_get_curmsg_id(v);
+  if (owl_view_message_changed(m))
+    owl_function_redisplay_to_nearest(lastmsgid, v);
+  if (owl_message_is_direction_in(m))
+    owl_function_incoming_message(m);
+  msgs = g_ptr_array_sized_new(1);
+  g_ptr_array_add(msgs, m);
+  owl_perlconfig_new_messages(msgs);
+  g_ptr_array_free(msgs, true);
+
+  owl_mainwin_redisplay(owl_global_get_mainwin(&g));
+}
+
+/* Runs in a worker thread, so touches nothing but the job */
+static void owl_zcrypt_run(gpointer data, gpointer user_data)
+{
+  owl_zcrypt_job *job = data;
+
+  job->out = zcrypt_decrypt_message(zcrypt_keyring_get_default(),
+                                    job->class, job->instance, job->in);
+  owl_select_post_task(owl_zcrypt_finish, job, owl_zcrypt_job_free,
+                       g_main_context_default());
+}
+
+/* Starts decrypting the body of m, a zephyr with the opcode "crypt",
+ * and leaves a placeholder in its place. */
+void owl_zcrypt_start(owl_message *m)
+{
+  owl_zcrypt_job *job;
+  GError *err = NULL;
+
+  if (!zcrypt_pool) {
+    zcrypt_pool = g_thread_pool_new(owl_zcrypt_run, NULL, OWL_ZCRYPT_THREADS,
+                                    FALSE, &err);
+    if (!zcrypt_pool) {
+      owl_function_error("Unable to start decrypting: %s", err->message);
+      g_error_free(err);
+      owl_message_set_opcode(m, "failed-decrypt");
+      return;
+    }
+  }
+
+  job = g_slice_new0(owl_zcrypt_job);
+  job->message = m;
+  job->class = g_strdup(owl_message_get_class(m));
+  job->instance = g_strdup(owl_message_get_instance(m));
+  job->in = g_strdup(owl_message_get_body(m));
+  m->decrypt_job = job;
+  owl_message_set_body(m, OWL_ZCRYPT_PLACEHOLDER);
+  g_thread_pool_push(zcrypt_pool, job, NULL);
+}
+
+/* The ciphertext of m, if it is being decrypted, and NULL otherwise */
+const char *owl_zcrypt_get_ciphertext(const owl_message *m)
+{
+  return m->decrypt_job ? m->decrypt_job->in : NULL;
+}
+
+/* Called as m goes away before its decryption is done */
+void owl_zcrypt_forget(owl_message *m)
+{
+  m->decrypt_job->message = NULL;
+  m->decrypt_job = NULL;
+}
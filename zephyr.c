@@ -599,6 +599,93 @@ CALLER_OWN char *owl_zephyr_get_field_as_utf8(const void *n, int j)
 
 
 #ifdef HAVE_LIBZEPHYR
+/* Takes over n, packet and all, for a message to keep.  The fields of
+ * its z_message are indexed here, once; nothing is copied. */
+CALLER_OWN owl_zephyr_notice *owl_zephyr_notice_new(const ZNotice_t *n)
+{
+  owl_zephyr_notice *zn;
+  const char *f, *end = n->z_message + n->z_message_len, *nul;
+  int i, nfields = owl_zephyr_get_num_fields(n);
+
+  zn = g_malloc(sizeof(owl_zephyr_notice) + nfields * sizeof(owl_zephyr_field_view));
+  zn->notice = *n;
+  zn->nfields = nfields;
+  for (i = 0, f = owl_zephyr_first_raw_field(n); f != NULL;
+       i++, f = owl_zephyr_next_raw_field(n, f)) {
+    nul = memchr(f, '\0', end - f);
+    zn->fields[i].offset = f - n->z_message;
+    zn->fields[i].len = (nul ? nul : end) - f;
+    zn->fields[i].utf8 = NULL;
+    zn->fields[i].utf8_owned = false;
+  }
+  return zn;
+}
+
+void owl_zephyr_notice_delete(owl_zephyr_notice *zn)
+{
+  int i;
+
+  for (i = 0; i < zn->nfields; i++) {
+    if (zn->fields[i].utf8_owned)
+      g_free((char *)zn->fields[i].utf8);
+  }
+  ZFreeNotice(&zn->notice);
+  g_free(zn);
+}
+
+/* Forgets the UTF-8 forms of zn's fields; they are worked out again
+ * when next asked for. */
+void owl_zephyr_notice_drop_utf8(owl_zephyr_notice *zn)
+{
+  int i;
+
+  for (i = 0; i < zn->nfields; i++) {
+    if (zn->fields[i].utf8_owned)
+      g_free((char *)zn->fields[i].utf8);
+    zn->fields[i].utf8 = NULL;
+    zn->fields[i].utf8_owned = false;
+  }
+}
+
+int owl_zephyr_notice_get_num_fields(const owl_zephyr_notice *zn)
+{
+  return zn->nfields;
+}
+
+/* Returns field j of zn, counting from 1, as UTF-8, or "" if there is
+ * no such field.  A field which is already valid UTF-8, free of format
+ * characters and NUL-terminated within the packet is returned in
+ * place; any other is converted the first time, and the conversion
+ * kept.  That doesn't change zn as far as callers can tell, hence the
+ * cast. */
+const char *owl_zephyr_notice_get_field(const owl_zephyr_notice *zn, int j)
+{
+  owl_zephyr_field_view *f;
+  const char *raw;
+  char *tmp;
+
+  if (j < 1 || j > zn->nfields)
+    return "";
+  f = (owl_zephyr_field_view *)&zn->fields[j - 1];
+  if (f->utf8)
+    return f->utf8;
+
+  raw = zn->notice.z_message + f->offset;
+  if (f->offset + f->len < zn->notice.z_message_len &&
+      !memchr(raw, OWL_FMTEXT_UC_STARTBYTE_UTF8, f->len) &&
+      g_utf8_validate(raw, f->len, NULL)) {
+    f->utf8 = raw;
+  } else {
+    tmp = g_strndup(raw, f->len);
+    f->utf8 = owl_validate_or_convert(tmp);
+    g_free(tmp);
+    if (!f->utf8)
+      f->utf8 = g_strdup("");
+    f->utf8_owned = true;
+  }
+  return f->utf8;
+}
+
 int owl_zephyr_get_num_fields(const ZNotice_t *n)
 {
   int i;
@@ -609,6 +696,20 @@ int owl_zephyr_get_num_fields(const ZNotice_t *n)
   return i;
 }
 #else
+void owl_zephyr_notice_delete(owl_zephyr_notice *zn)
+{
+}
+
+int owl_zephyr_notice_get_num_fields(const owl_zephyr_notice *zn)
+{
+  return(0);
+}
+
+const char *owl_zephyr_notice_get_field(const owl_zephyr_notice *zn, int j)
+{
+  return("");
+}
+
 int owl_zephyr_get_num_fields(const void *n)
 {
   return(0);
@@ -616,14 +717,15 @@ int owl_zephyr_get_num_fields(const void *n)
 #endif
 
 #ifdef HAVE_LIBZEPHYR
-/* return a pointer to the message, place the message length in k
+/* return the body of the message, built from the fields of zn
  * caller must free the return
  */
-CALLER_OWN char *owl_zephyr_get_message(const ZNotice_t *n, const owl_message *m)
+CALLER_OWN char *owl_zephyr_get_message(const owl_zephyr_notice *zn, const owl_message *m)
 {
 #define OWL_NFIELDS	5
   int i;
-  char *fields[OWL_NFIELDS + 1];
+  const ZNotice_t *n = &zn->notice;
+  const char *fields[OWL_NFIELDS + 1];
   char *msg = NULL;
 
   /* don't let ping messages have a body */
@@ -632,7 +734,7 @@ CALLER_OWN char *owl_zephyr_get_message(const ZNotice_t *n, const owl_message *m
   }
 
   for(i = 0; i < OWL_NFIELDS; i++)
-    fields[i + 1] = owl_zephyr_get_field(n, i + 1);
+    fields[i + 1] = owl_zephyr_notice_get_field(zn, i + 1);
 
   /* deal with MIT NOC messages */
   if (!strcasecmp(n->z_default_format, "@center(@bold(NOC Message))\n\n@bold(Sender:) $1 <$sender>\n@bold(Time:  ) $time\n\n@italic($opcode service on $instance $3.) $4\n")) {
@@ -653,15 +755,12 @@ CALLER_OWN char *owl_zephyr_get_message(const ZNotice_t *n, const owl_message *m
                           owl_message_get_hostname(m),
                           fields[1]);
   } else {
-    if (owl_zephyr_get_num_fields(n) == 1)
+    if (owl_zephyr_notice_get_num_fields(zn) == 1)
       msg = g_strdup(fields[1]);
     else
       msg = g_strdup(fields[2]);
   }
 
-  for (i = 0; i < OWL_NFIELDS; i++)
-    g_free(fields[i + 1]);
-
   return msg;
 }
 #endif
@@ -1447,15 +1546,84 @@ gboolean owl_zephyr_buddycheck_timer(void *data)
   return TRUE;
 }
 
+/* How the zephyr_dispatch_budget variable stretches and shrinks:
+ * for every OWL_ZEPHYR_BACKLOG_STEP notices waiting it grows by the
+ * base budget, up to OWL_ZEPHYR_BUDGET_MAX_SCALE times the base, and
+ * within OWL_ZEPHYR_TYPING_USEC of a keypress it is cut to a quarter,
+ * but never below OWL_ZEPHYR_BUDGET_MIN_USEC. */
+#define OWL_ZEPHYR_BACKLOG_STEP     50
+#define OWL_ZEPHYR_BUDGET_MAX_SCALE 4
+#define OWL_ZEPHYR_TYPING_USEC      250000
+#define OWL_ZEPHYR_BUDGET_MIN_USEC  1000
+
+static owl_zephyr_stats zephyr_stats;
+/* the counts as of the start of the current rate window, and the rates
+ * over the last one */
+static owl_zephyr_stats zephyr_stats_mark, zephyr_rates;
+static gint64 zephyr_stats_mark_time = 0;
+
+/* Starts a new rate window once the current one is a second old */
+static void owl_zephyr_stats_roll(gint64 now)
+{
+  gint64 elapsed = now - zephyr_stats_mark_time;
+
+  if (zephyr_stats_mark_time == 0) {
+    zephyr_stats_mark_time = now;
+    return;
+  }
+  if (elapsed < G_USEC_PER_SEC)
+    return;
+
+#define OWL_ZEPHYR_RATE(field) \
+  zephyr_rates.field = (zephyr_stats.field - zephyr_stats_mark.field) * G_USEC_PER_SEC / elapsed
+  OWL_ZEPHYR_RATE(notices);
+  OWL_ZEPHYR_RATE(acks);
+  OWL_ZEPHYR_RATE(pings_dropped);
+  OWL_ZEPHYR_RATE(pseudologins);
+  OWL_ZEPHYR_RATE(dispatches);
+#undef OWL_ZEPHYR_RATE
+
+  zephyr_stats_mark = zephyr_stats;
+  zephyr_stats_mark_time = now;
+}
+
+/* Counts of zephyr traffic since startup */
+const owl_zephyr_stats *owl_zephyr_get_stats(void)
+{
+  return &zephyr_stats;
+}
+
+/* The same counts per second, over the last second or so of traffic */
+const owl_zephyr_stats *owl_zephyr_get_rates(void)
+{
+  owl_zephyr_stats_roll(g_get_monotonic_time());
+  return &zephyr_rates;
+}
+
+/* The time, in microseconds, to spend on libzephyr's queue in one
+ * dispatch: 'budget' from the zephyr_dispatch_budget variable, more
+ * when 'backlog' notices are waiting, less if the last keypress was
+ * only 'idle_usec' ago. */
+gint64 owl_zephyr_dispatch_budget(gint64 budget, int backlog, gint64 idle_usec)
+{
+  gint64 scale;
+
+  if (idle_usec < OWL_ZEPHYR_TYPING_USEC)
+    return MAX(budget / 4, OWL_ZEPHYR_BUDGET_MIN_USEC);
+
+  scale = 1 + backlog / OWL_ZEPHYR_BACKLOG_STEP;
+  return MAX(budget * MIN(scale, OWL_ZEPHYR_BUDGET_MAX_SCALE),
+             OWL_ZEPHYR_BUDGET_MIN_USEC);
+}
+
 /*
  * Process zephyrgrams from libzephyr's queue. To prevent starvation,
- * process a maximum of OWL_MAX_ZEPHYRGRAMS_TO_PROCESS.
+ * stop once the time from owl_zephyr_dispatch_budget is up, though
+ * always after at least one zephyrgram.
  *
  * Returns the number of zephyrgrams processed.
  */
 
-#define OWL_MAX_ZEPHYRGRAMS_TO_PROCESS 20
-
 #ifdef HAVE_LIBZEPHYR
 static int _owl_zephyr_process_events(void)
 {
@@ -1463,8 +1631,17 @@ static int _owl_zephyr_process_events(void)
   ZNotice_t notice;
   Code_t code;
   owl_message *m=NULL;
+  gint64 now = g_get_monotonic_time();
+  gint64 deadline = now +
+    owl_zephyr_dispatch_budget(owl_global_get_zephyr_dispatch_budget(&g),
+                               owl_zephyr_zpending(),
+                               owl_global_get_input_idle_usec(&g));
+
+  owl_zephyr_stats_roll(now);
+  zephyr_stats.dispatches++;
 
-  while(owl_zephyr_zpending() && zpendcount < OWL_MAX_ZEPHYRGRAMS_TO_PROCESS) {
+  while(owl_zephyr_zpending() &&
+        (zpendcount == 0 || g_get_monotonic_time() < deadline)) {
     if (owl_zephyr_zpending()) {
       if ((code = ZReceiveNotice(&notice, NULL)) != ZERR_NONE) {
         owl_function_debugmsg("Error: %s while calling ZReceiveNotice\n",
@@ -1472,9 +1649,11 @@ static int _owl_zephyr_process_events(void)
         continue;
       }
       zpendcount++;
+      zephyr_stats.notices++;
 
       /* is this an ack from a zephyr we sent? */
       if (owl_zephyr_notice_is_ack(&notice)) {
+        zephyr_stats.acks++;
         owl_zephyr_handle_ack(&notice);
         ZFreeNotice(&notice);
         continue;
@@ -1482,12 +1661,14 @@ static int _owl_zephyr_process_events(void)
 
       /* if it's a ping and we're not viewing pings then skip it */
       if (!owl_global_is_rxping(&g) && !strcasecmp(notice.z_opcode, "ping")) {
+        zephyr_stats.pings_dropped++;
         ZFreeNotice(&notice);
         continue;
       }
 
       /* if it is a LOCATE message, it's for pseudologins. */
       if (strcmp(notice.z_opcode, LOCATE_LOCATE) == 0) {
+        zephyr_stats.pseudologins++;
         owl_zephyr_process_pseudologin(&notice);
         ZFreeNotice(&notice);
         continue;